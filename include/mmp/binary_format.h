@@ -0,0 +1,164 @@
+// -*- mode: c++ -*-
+#ifndef MMP_BINARY_FORMAT_H_
+#define MMP_BINARY_FORMAT_H_
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <valhalla/midgard/pointll.h>
+#include <valhalla/baldr/graphid.h>
+
+#include <mmp/map_matching.h>
+
+
+namespace mmp {
+
+using namespace valhalla;
+
+
+// Binary traces and match results, for bulk jobs where reading and
+// writing GeoJSON would cost more than matching. A file (or a request
+// body) is laid out as (in host byte order):
+//
+//   BinaryFileHeader
+//   records, each a BinaryRecordHeader followed by its columns, 8-byte aligned
+//
+// Records start with their lengths so that they can be streamed, or
+// skipped over in a mapped file. The columns of a trace record of
+// count measurements are:
+//
+//   coordinates: count (lng, lat) of float, or of int32_t in 1e-7 degrees if kFixedPoint
+//   times: count double if kHasTimes
+//   accuracies: count float if kHasAccuracies
+//   headings: count float if kHasHeadings
+//
+// where unknown values are negative, as in Measurement. Known values
+// are checked as GeoJSON properties are: headings in [0, 360), times
+// going forward, and accuracies are raised to 0.01 meters. The columns
+// of a result record of count results are:
+//
+//   coordinates: count (lng, lat) of float
+//   graphids: count uint64_t, invalid ones if not matched
+//   distances: count float
+//   offsets: count float, along the edges, negative if unknown
+//   graphtypes: count uint8_t (GraphType)
+//
+// or count chars of the error message if kError
+struct BinaryFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t spare;
+};
+
+
+struct BinaryRecordHeader
+{
+  // Of the whole record, the header and the padding included
+  uint64_t length;
+  uint32_t count;
+  uint32_t flags;
+};
+
+
+enum BinaryRecordFlag: uint32_t
+{
+  kHasTimes = 1,
+  kHasAccuracies = 2,
+  kHasHeadings = 4,
+  kFixedPoint = 8,
+  kError = 16
+};
+
+
+constexpr char kBinaryTraceMagic[8] = "MMPTRCE";
+
+constexpr char kBinaryResultMagic[8] = "MMPRSLT";
+
+constexpr uint32_t kBinaryFormatVersion = 1;
+
+// Records read from streams are no longer than this (about ten
+// million measurements of all columns)
+constexpr uint64_t kMaxBinaryRecordLength = 256 << 20;
+
+
+// A result as read back from a result record
+struct BinaryResult
+{
+  midgard::PointLL lnglat;
+  baldr::GraphId graphid;
+  float distance;
+  float offset;
+  GraphType graphtype;
+};
+
+
+void AppendBinaryHeader(std::string& out, const char (&magic)[8]);
+
+// Columns of times, accuracies and headings are only written if any
+// measurement of the trace has them
+void AppendBinaryTrace(std::string& out,
+                       const std::vector<Measurement>& trace,
+                       bool fixed_point = false);
+
+// Offsets are located along the edges with the matching if it's
+// given (the one that the results are matched with), otherwise they
+// are unknown
+void AppendBinaryResults(std::string& out,
+                         const std::vector<MatchResult>& results,
+                         const MapMatching* mm = nullptr);
+
+void AppendBinaryError(std::string& out, const std::string& message);
+
+// Check the file header at the beginning of the buffer and return its
+// size. Throw std::runtime_error if it isn't one of the magic
+size_t ReadBinaryHeader(const char* data, size_t length, const char (&magic)[8]);
+
+// Decode the record at the beginning of the buffer and return its
+// length. Throw std::runtime_error if it isn't a valid record
+size_t ReadBinaryTrace(const char* data, size_t length, std::vector<Measurement>& trace);
+
+// The error message is set (and the results cleared) if it's an
+// error record
+size_t ReadBinaryResults(const char* data, size_t length,
+                         std::vector<BinaryResult>& results, std::string& error);
+
+// Read the next trace record from the stream into the buffer and
+// decode it. Return false at the end of the stream. Records longer
+// than kMaxBinaryRecordLength are rejected
+bool ReadBinaryTrace(std::istream& in, std::string& buffer, std::vector<Measurement>& trace);
+
+
+// A binary trace file mapped into memory, whose traces are decoded
+// one by one
+class BinaryTraceFile
+{
+ public:
+  // Throw std::runtime_error if the file can't be mapped or it
+  // isn't a binary trace file
+  explicit BinaryTraceFile(const std::string& path);
+
+  ~BinaryTraceFile();
+
+  BinaryTraceFile(const BinaryTraceFile&) = delete;
+
+  BinaryTraceFile& operator=(const BinaryTraceFile&) = delete;
+
+  // Decode the next trace. Return false at the end of the file
+  bool Next(std::vector<Measurement>& trace);
+
+ private:
+  std::shared_ptr<const char> mapping_;
+
+  size_t length_;
+
+  size_t position_;
+};
+
+}
+
+
+#endif // MMP_BINARY_FORMAT_H_
@@ -3,11 +3,12 @@
 #define MMP_CANDIDATE_SEARCH_H_
 
 #include <cmath>
+#include <limits>
 #include <tuple>
 #include <algorithm>
+#include <unordered_map>
 
 #include <boost/property_tree/ptree.hpp>
-#include <boost/iterator/counting_iterator.hpp>
 
 #include <valhalla/midgard/distanceapproximator.h>
 #include <valhalla/midgard/linesegment2.h>
@@ -18,9 +19,14 @@
 #include <valhalla/sif/dynamiccost.h>
 
 #include <mmp/candidate.h>
+#include <mmp/grid_cache.h>
 #include <mmp/grid_range_query.h>
+#include <mmp/grid_index.h>
+#include <mmp/segment_id.h>
+#include <mmp/shape_cache.h>
 #include <mmp/graph_helpers.h>
 #include <mmp/geometry_helpers.h>
+#include <mmp/thread_pool.h>
 
 
 namespace mmp {
@@ -28,65 +34,340 @@ namespace mmp {
 using namespace valhalla;
 
 
+// Candidates of many locations in one array
+struct BulkCandidates
+{
+  std::vector<Candidate> candidates;
+
+  // Candidates of location i are at [offsets[i], offsets[i + 1])
+  std::vector<uint32_t> offsets;
+
+  // Number of locations
+  size_t size() const
+  { return offsets.empty()? 0 : offsets.size() - 1; }
+
+  Span<Candidate> operator[](size_t idx) const
+  { return {candidates.data() + offsets[idx], candidates.data() + offsets[idx + 1]}; }
+};
+
+
+// Keep only the directed edges heading (at the projections of the
+// location) within the tolerance of the location's heading. Headings
+// are in degrees clockwise from north, and a negative heading is
+// unknown, which keeps all edges
+struct HeadingFilter
+{
+  HeadingFilter(float the_heading = -1.f, float the_tolerance = 180.f)
+      : heading(the_heading), tolerance(the_tolerance) {}
+
+  // Whether it may filter out any edge
+  bool enabled() const
+  { return 0.f <= heading && tolerance < 180.f; }
+
+  bool Allowed(float edge_heading) const
+  {
+    const float difference = std::abs(std::fmod(edge_heading - heading + 540.f, 360.f) - 180.f);
+    return !enabled() || difference <= tolerance;
+  }
+
+  float heading;
+
+  float tolerance;
+};
+
+
+// Snap the projection of the location onto the shape to an end of the
+// shape if it's within the snap distance (along the shape) of it, and
+// the end is still in the radius. The nearer end is taken if both
+// are. Lengths are of the shape up to the projection and of the whole
+// shape
+void SnapToEnds(const midgard::PointLL& location,
+                float sq_search_radius,
+                float snap_distance,
+                const std::vector<midgard::PointLL>& shape,
+                float partial_length,
+                float total_length,
+                midgard::PointLL& point,
+                float& sq_distance,
+                float& offset);
+
+
+// Add the candidate, unless it snaps to a node (snapped_node is
+// valid) that has a candidate already: then its edges not in that
+// candidate are added to it, so that each node is one candidate with
+// all its edges. node_candidates maps nodes to their candidates
+void MergeNodeCandidate(const Candidate& candidate,
+                        const baldr::GraphId& snapped_node,
+                        std::unordered_map<baldr::GraphId, size_t>& node_candidates,
+                        std::vector<Candidate>& candidates);
+
+
+// Search candidates by scanning all edges of the tiles that intersect
+// the search circle. It's slow but exhaustive, which makes it the
+// reference of faster searches
 class CandidateQuery
 {
  public:
-  CandidateQuery(baldr::GraphReader& reader) : reader_(reader) {}
+  CandidateQuery(baldr::GraphReader& reader) : reader_(reader), snap_distance_(0.f) {}
 
   virtual ~CandidateQuery() {}
 
+  // Projections within this distance (in meters, along the edge) of
+  // a node snap to it, and all projections that snap to a node are
+  // merged into one candidate of all their edges. 0 only merges those
+  // exactly at nodes
+  float snap_distance() const
+  { return snap_distance_; }
+
+  void set_snap_distance(float snap_distance)
+  { snap_distance_ = snap_distance; }
+
   virtual std::vector<Candidate>
-  Query(const midgard::PointLL& point, float radius, sif::EdgeFilter filter = nullptr) const;
+  Query(const midgard::PointLL& point, float radius, sif::EdgeFilter filter = nullptr,
+        const HeadingFilter& heading_filter = HeadingFilter()) const;
 
   virtual std::vector<std::vector<Candidate>>
   QueryBulk(const std::vector<midgard::PointLL>& points, float radius, sif::EdgeFilter filter = nullptr);
 
- protected:
-  template <typename edgeid_iterator_t> std::vector<Candidate>
-  WithinSquaredDistance(const midgard::PointLL& location,
-                        float sq_search_radius,
-                        edgeid_iterator_t edgeid_begin,
-                        edgeid_iterator_t edgeid_end,
-                        sif::EdgeFilter filter,
-                        bool directed) const;
+  // Query candidates of all locations into the results. Heading
+  // filters and squared search radii (instead of sq_search_radius),
+  // if given, are of the locations respectively
+  virtual void
+  QueryBulk(const std::vector<midgard::PointLL>& locations,
+            float sq_search_radius,
+            sif::EdgeFilter filter,
+            BulkCandidates& results,
+            const std::vector<HeadingFilter>& heading_filters = {},
+            const std::vector<float>& sq_search_radii = {}) const;
 
+ protected:
   baldr::GraphReader& reader_;
+
+  float snap_distance_;
+};
+
+
+// Add each road linestring's line segments of the tile into the grid
+// by their segment ids
+void IndexTile(const baldr::GraphTile& tile, GridRangeQueryBuilder<SegmentId>& grid);
+
+
+// Index the tile into a grid of the bounding box. Cells are scaled
+// from the base cell sizes by a power of two (within
+// [kMinCellScale, kMaxCellScale]), so that non-empty cells hold about
+// cell_items segments on average: cells of dense tiles get smaller and
+// cells of sparse tiles get larger. Zero cell_items keeps the base
+// cell sizes
+GridRangeQuery<SegmentId>
+BuildTileGrid(const baldr::GraphTile& tile,
+              const midgard::AABB2<midgard::PointLL>& bbox,
+              float cell_width,
+              float cell_height,
+              float cell_items);
+
+constexpr float kMinCellScale = 0.5f;
+
+constexpr float kMaxCellScale = 4.f;
+
+
+struct GridCacheStats
+{
+  // Grids found in the cache
+  size_t hits = 0;
+
+  // Grids indexed or read from the grid index
+  size_t misses = 0;
+
+  // Grids evicted to fit in the memory budget
+  size_t evictions = 0;
 };
 
 
+// Search candidates in tile grids of a GridCache. Graph readers are
+// not thread-safe, so a query is used by one thread at a time, but
+// queries of many threads (each with its own graph reader) can share
+// one cache. A grid returned by GetGrid is valid until the next call
 class CandidateGridQuery final: public CandidateQuery
 {
  public:
-  CandidateGridQuery(baldr::GraphReader& reader, float cell_width, float cell_height);
+  // Search in a cache of its own
+  CandidateGridQuery(baldr::GraphReader& reader, float cell_width, float cell_height,
+                     size_t max_memory_size = std::numeric_limits<size_t>::max());
+
+  // Search in a shared cache
+  CandidateGridQuery(baldr::GraphReader& reader, std::shared_ptr<GridCache> cache);
 
   ~CandidateGridQuery();
 
-  const GridRangeQuery<baldr::GraphId>* GetGrid(baldr::GraphId tile_id) const;
+  CandidateGridQuery(const CandidateGridQuery&) = delete;
+
+  CandidateGridQuery& operator=(const CandidateGridQuery&) = delete;
+
+  const std::shared_ptr<GridCache>& cache() const
+  { return cache_; }
+
+  // Read grids from the grid index file instead of indexing tiles
+  // when possible. Tiles not in the index are still indexed on the
+  // fly. Throw std::runtime_error if the index is built with
+  // different cell sizes or cell items
+  void LoadIndex(const std::string& path)
+  { cache_->LoadIndex(path); }
+
+  const GridIndex* index() const
+  { return cache_->index(); }
+
+  // Target number of segments in non-empty cells when tiles are
+  // indexed (see BuildTileGrid). Cached grids are cleared. Set it
+  // before loading the index
+  void set_cell_items(float cell_items)
+  { cache_->set_cell_items(cell_items); }
+
+  float cell_items() const
+  { return cache_->cell_items(); }
 
-  const GridRangeQuery<baldr::GraphId>* GetGrid(const baldr::GraphTile* tile_ptr) const;
+  const GridRangeQuery<SegmentId>* GetGrid(baldr::GraphId tile_id) const;
 
+  const GridRangeQuery<SegmentId>* GetGrid(const baldr::GraphTile* tile_ptr) const;
+
+  // Query edge segments of all tiles that intersect with the range
+  // into the buffer. The results are sorted (so segments of an edge
+  // are adjacent) and unique, and valid until the buffer changes
+  Span<SegmentId>
+  RangeQuery(const midgard::AABB2<midgard::PointLL>& range,
+             std::vector<SegmentId>& buffer) const;
+
+  // Query edges of all tiles that intersect with the range
   std::unordered_set<baldr::GraphId>
   RangeQuery(const midgard::AABB2<midgard::PointLL>& range) const;
 
   std::vector<Candidate>
-  Query(const midgard::PointLL& location, float sq_search_radius, sif::EdgeFilter filter) const override;
+  Query(const midgard::PointLL& location, float sq_search_radius, sif::EdgeFilter filter,
+        const HeadingFilter& heading_filter = HeadingFilter()) const override;
+
+  using CandidateQuery::QueryBulk;
+
+  // Query locations in the order of tiles and cells, so that each
+  // grid is fetched once for nearby locations and their edges are
+  // decoded once. Then project them onto the edges on the thread
+  // pool if there is one
+  void
+  QueryBulk(const std::vector<midgard::PointLL>& locations,
+            float sq_search_radius,
+            sif::EdgeFilter filter,
+            BulkCandidates& results,
+            const std::vector<HeadingFilter>& heading_filters = {},
+            const std::vector<float>& sq_search_radii = {}) const override;
+
+  // Project locations of bulk queries on these threads (0 for the
+  // calling thread only)
+  void set_thread_count(size_t count);
+
+  size_t thread_count() const
+  { return pool_? pool_->size() : 0; }
+
+  // Number of cached grids
+  size_t size() const
+  { return cache_->size(); }
+
+  // Bytes taken by cached grids
+  size_t memory_size() const
+  { return cache_->memory_size(); }
 
-  std::unordered_map<baldr::GraphId, GridRangeQuery<baldr::GraphId> >::size_type
-  size() const
-  { return grid_cache_.size(); }
+  size_t max_memory_size() const
+  { return cache_->max_memory_size(); }
 
+  // Evict grids right away if they don't fit
+  void set_max_memory_size(size_t max_memory_size)
+  { cache_->set_max_memory_size(max_memory_size); }
+
+  // Hits and misses of this query, and evictions of the cache since
+  // the stats are reset
+  GridCacheStats stats() const;
+
+  void ResetStats();
+
+  // Shapes of the edges found, decoded once while their tiles are
+  // loaded in the reader
+  ShapeCache& shape_cache() const
+  { return shape_cache_; }
+
+  // Grids in the index remain mapped
   void Clear()
-  { grid_cache_.clear(); }
+  {
+    cache_->Clear();
+    shape_cache_.Clear();
+  }
 
  private:
+  // Get the grid of the tile, assuming the reader is pinned
+  const GridRangeQuery<SegmentId>* FindGrid(const baldr::GraphTile* tile_ptr) const;
+
+  // RangeQuery, assuming the reader is pinned
+  Span<SegmentId>
+  CollectRange(const midgard::AABB2<midgard::PointLL>& range,
+               std::vector<SegmentId>& buffer) const;
+
+  // An edge found near a location, with what projecting the location
+  // onto it needs, so that projecting doesn't read the graph
+  struct NearEdge
+  {
+    baldr::GraphId edgeid;
+    const baldr::DirectedEdge* edge;
+    bool included;
+
+    baldr::GraphId opp_edgeid;
+    const baldr::DirectedEdge* opp_edge;
+    bool opp_included;
+
+    ShapeCache::Shape shape;
+
+    // Shape indexes of nearby segments are at [begin, end) of the
+    // segment indexes
+    uint32_t segments_begin;
+    uint32_t segments_end;
+  };
+
+  // Append edges of the segments (that are not filtered out) and
+  // shape indexes of the segments
+  void ResolveEdges(Span<SegmentId> segments,
+                    sif::EdgeFilter filter,
+                    std::vector<NearEdge>& edges,
+                    std::vector<uint32_t>& segment_indexes) const;
+
+  // Project the location onto the nearby segments of the edges and
+  // append candidates in the radius. It only reads resolved data, so
+  // it can run on any thread
+  static void ProjectEdges(const midgard::PointLL& location,
+                           float sq_search_radius,
+                           const HeadingFilter& heading_filter,
+                           float snap_distance,
+                           const NearEdge* edges_begin,
+                           const NearEdge* edges_end,
+                           const std::vector<uint32_t>& segment_indexes,
+                           helpers::SegmentBuffer& buffer,
+                           std::vector<Candidate>& candidates);
 
   const baldr::TileHierarchy& hierarchy_;
 
-  float cell_width_;
+  std::shared_ptr<GridCache> cache_;
+
+  GridCache::Reader* cache_reader_;
+
+  mutable size_t hits_;
+
+  mutable size_t misses_;
+
+  size_t evictions_base_;
+
+  mutable ShapeCache shape_cache_;
+
+  // Reused by Query for range query results
+  mutable std::vector<SegmentId> range_buffer_;
 
-  float cell_height_;
+  // Reused by Query for projecting onto segments
+  mutable helpers::SegmentBuffer segment_buffer_;
 
-  mutable std::unordered_map<baldr::GraphId, GridRangeQuery<baldr::GraphId>> grid_cache_;
+  std::unique_ptr<ThreadPool> pool_;
 };
 
 }
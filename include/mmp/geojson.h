@@ -0,0 +1,481 @@
+// -*- mode: c++ -*-
+#ifndef MMP_GEOJSON_H_
+#define MMP_GEOJSON_H_
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/error/en.h>
+
+#include <mmp/map_matching.h>
+
+
+// Read measurements from GeoJSON and write match results as GeoJSON,
+// for the service and the tools
+
+namespace mmp {
+
+class SequenceParseError: public std::runtime_error {
+  // Need its constructor
+  using std::runtime_error::runtime_error;
+};
+
+
+inline void
+parse_json(rapidjson::Document& document, const char* text)
+{
+  document.Parse(text);
+
+  if (document.HasParseError()) {
+    std::string message(GetParseError_En(document.GetParseError()));
+    throw SequenceParseError("Unable to parse JSON body: " + message);
+  }
+}
+
+
+inline bool
+is_geojson_geometry(const rapidjson::Value& geometry)
+{
+  return geometry.IsObject() && geometry.HasMember("coordinates");
+}
+
+
+inline std::vector<Measurement>
+read_geojson_geometry(const rapidjson::Value& geometry)
+{
+  if (!is_geojson_geometry(geometry)) {
+    throw SequenceParseError("Invalid GeoJSON geometry");
+  }
+
+  // Parse coordinates
+  if (!geometry.HasMember("coordinates")) {
+    throw SequenceParseError("Invalid GeoJSON geometry: coordinates not found");
+  }
+
+  const auto& coordinates = geometry["coordinates"];
+  if (!coordinates.IsArray()) {
+    throw SequenceParseError("Invalid GeoJSON geometry: coordindates is not an array of coordinates");
+  }
+
+  std::vector<Measurement> measurements;
+  for (rapidjson::SizeType i = 0; i < coordinates.Size(); i++) {
+    const auto& coordinate = coordinates[i];
+    if (!coordinate.IsArray()
+        || coordinate.Size() != 2
+        || !coordinate[0].IsNumber()
+        || !coordinate[1].IsNumber()) {
+      throw SequenceParseError("Invalid GeoJSON geometry: coordindate at "
+                               + std::to_string(i)
+                               + " is not a valid coordinate (a array of two numbers)");
+    }
+    auto lng = coordinate[0].GetDouble(),
+         lat = coordinate[1].GetDouble();
+    measurements.emplace_back(midgard::PointLL(lng, lat));
+  }
+
+  return measurements;
+}
+
+
+inline bool
+is_geojson_feature(const rapidjson::Value& object)
+{
+  // Strictly speak a GeoJSON feature must have "id" and "properties",
+  // but in our case they are optional. A full example is as folllows:
+  // {"id": 1, "type": "Feature", "geometry": GEOMETRY, "properties": {"times": [], "accuracies": [], "headings": []}}
+
+  // We follow Postel's Law: be liberal in what you accept
+  return object.IsObject()
+      // && object.HasMember("type")
+      // && std::string(object["type"].GetString()) == "Feature"
+      && object.HasMember("geometry");
+}
+
+
+// Read a property of the feature that is an array of a number (or
+// null if unknown) per measurement, in [min, max)
+template <typename setter_t>
+void read_geojson_property(const rapidjson::Value& properties,
+                           const char* name,
+                           std::vector<Measurement>& measurements,
+                           double min,
+                           double max,
+                           setter_t set)
+{
+  if (!properties.HasMember(name)) {
+    return;
+  }
+
+  const auto& values = properties[name];
+  if (!values.IsArray() || values.Size() != measurements.size()) {
+    throw SequenceParseError(std::string("Invalid GeoJSON feature: ")
+                             + name + " is not an array of the same size as coordinates");
+  }
+
+  for (rapidjson::SizeType i = 0; i < values.Size(); i++) {
+    if (values[i].IsNull()) {
+      continue;
+    }
+    if (!values[i].IsNumber() || values[i].GetDouble() < min || max <= values[i].GetDouble()) {
+      throw SequenceParseError(std::string("Invalid GeoJSON feature: ")
+                               + name + " at " + std::to_string(i)
+                               + " is not a number in the range");
+    }
+    set(measurements[i], values[i].GetDouble());
+  }
+}
+
+
+inline std::vector<Measurement>
+read_geojson_feature(const rapidjson::Value& feature)
+{
+  if (!is_geojson_feature(feature)) {
+    throw SequenceParseError("Invalid GeoJSON feature");
+  }
+
+  auto measurements = read_geojson_geometry(feature["geometry"]);
+
+  if (feature.HasMember("properties")) {
+    const auto& properties = feature["properties"];
+    if (properties.IsObject()) {
+      read_geojson_property(properties, "headings", measurements, 0.0, 360.0,
+                            [](Measurement& measurement, double value) { measurement.set_heading(value); });
+      read_geojson_property(properties, "accuracies", measurements, 0.0, std::numeric_limits<double>::infinity(),
+                            // Zero accuracy would make emission costs infinite
+                            [](Measurement& measurement, double value) { measurement.set_accuracy(std::max(value, 0.01)); });
+      read_geojson_property(properties, "times", measurements, 0.0, std::numeric_limits<double>::infinity(),
+                            [](Measurement& measurement, double value) { measurement.set_time(value); });
+
+      // Times go forward
+      double last_time = -1.0;
+      for (size_t i = 0; i < measurements.size(); i++) {
+        if (measurements[i].has_time()) {
+          if (measurements[i].time() < last_time) {
+            throw SequenceParseError("Invalid GeoJSON feature: time at "
+                                     + std::to_string(i)
+                                     + " is earlier than the previous one");
+          }
+          last_time = measurements[i].time();
+        }
+      }
+    }
+  }
+
+  return measurements;
+}
+
+
+inline std::vector<Measurement>
+read_geojson(const rapidjson::Value& object)
+{
+  if (is_geojson_feature(object)) {
+    return read_geojson_feature(object);
+  } else if (is_geojson_geometry(object)) {
+    return read_geojson_geometry(object);
+  } else {
+    throw SequenceParseError("Invalid GeoJSON object: expect either Feature or Geometry");
+  }
+}
+
+
+template <typename buffer_t>
+void serialize_coordinate(const midgard::PointLL& coord,
+                          rapidjson::Writer<buffer_t>& writer)
+{
+  writer.StartArray();
+  // TODO lower precision
+  writer.Double(coord.lng());
+  writer.Double(coord.lat());
+  writer.EndArray();
+}
+
+
+template <typename buffer_t>
+void serialize_graphid(const baldr::GraphId& graphid,
+                       rapidjson::Writer<buffer_t>& writer)
+{
+  if (graphid.Is_Valid()) {
+    writer.StartObject();
+
+    writer.String("id");
+    writer.Uint(graphid.id());
+
+    writer.String("level");
+    writer.Uint(graphid.level());
+
+    writer.String("tileid");
+    writer.Uint(graphid.tileid());
+
+    writer.EndObject();
+  } else {
+    writer.Null();
+  }
+}
+
+
+template <typename buffer_t>
+void serialize_geometry_matched_coordinates(const std::vector<MatchResult>& results,
+                                            rapidjson::Writer<buffer_t>& writer)
+{
+  writer.StartObject();
+
+  writer.String("type");
+  writer.String("MultiPoint");
+
+  writer.String("coordinates");
+  writer.StartArray();
+  for (const auto& result : results) {
+    serialize_coordinate(result.lnglat(), writer);
+  }
+  writer.EndArray();
+
+  writer.EndObject();
+}
+
+
+template <typename buffer_t>
+void serialize_geometry_route(const std::vector<MatchResult>& results,
+                              const MapMatching& mm,
+                              rapidjson::Writer<buffer_t>& writer)
+{
+  writer.StartObject();
+
+  writer.String("type");
+  writer.String("MultiLineString");
+
+  writer.String("coordinates");
+  writer.StartArray();
+  const auto& route = ConstructRoute(mm.graphreader(), results.cbegin(), results.cend());
+  bool open = false;
+  for (auto segment = route.cbegin(), prev_segment = route.cend();
+       segment != route.cend(); segment++) {
+    assert(segment->edgeid.Is_Valid());
+    const auto& shape = segment->Shape(mm.graphreader(), mm.shape_cache());
+    if (!shape.empty()) {
+      assert(shape.size() >= 2);
+      if (prev_segment != route.cend()
+          && prev_segment->Adjoined(mm.graphreader(), *segment)) {
+        for (auto vertex = std::next(shape.begin()); vertex != shape.end(); vertex++) {
+          serialize_coordinate(*vertex, writer);
+        }
+      } else {
+        if (open) {
+          writer.EndArray();
+          open = false;
+        }
+        writer.StartArray();
+        open = true;
+        for (auto vertex = shape.begin(); vertex != shape.end(); vertex++) {
+          serialize_coordinate(*vertex, writer);
+        }
+      }
+    }
+    prev_segment = segment;
+  }
+  if (open) {
+    writer.EndArray();
+    open = false;
+  }
+  writer.EndArray();
+
+  writer.EndObject();
+}
+
+
+template <typename buffer_t>
+void serialize_routes(const State& state,
+                      const MapMatching& mm,
+                      rapidjson::Writer<buffer_t>& writer)
+{
+  if (!state.routed()) {
+    writer.Null();
+    return;
+  }
+
+  writer.StartArray();
+  if (state.time() + 1 < mm.size()) {
+    for (const auto& next_state : mm.states(state.time() + 1)) {
+      auto label = state.RouteBegin(*next_state);
+      if (label != state.RouteEnd()) {
+        writer.StartObject();
+
+        writer.String("next_state");
+        writer.Uint(next_state->id());
+
+        writer.String("edgeid");
+        serialize_graphid(label->edgeid, writer);
+
+        const auto label = state.last_label(*next_state);
+        writer.String("route_distance");
+        writer.Double(label->cost);
+
+        writer.String("route_turn_cost");
+        writer.Double(label->turn_cost);
+
+        writer.String("route");
+        writer.StartArray();
+        for (auto label = state.RouteBegin(*next_state);
+             label != state.RouteEnd();
+             label++) {
+          writer.StartObject();
+
+          writer.String("edgeid");
+          serialize_graphid(label->edgeid, writer);
+
+          writer.String("nodeid");
+          serialize_graphid(label->nodeid, writer);
+
+          writer.String("source");
+          writer.Double(label->source);
+
+          writer.String("target");
+          writer.Double(label->target);
+
+          writer.String("route_distance");
+          writer.Double(label->cost);
+
+          writer.String("turn_cost");
+          writer.Double(label->turn_cost);
+
+          writer.EndObject();
+        }
+        writer.EndArray();
+
+        writer.EndObject();
+      }
+    }
+  }
+  writer.EndArray();
+}
+
+
+template <typename buffer_t>
+void serialize_state(const State& state,
+                     const MapMatching& mm,
+                     rapidjson::Writer<buffer_t>& writer)
+{
+  writer.StartObject();
+
+  writer.String("id");
+  writer.Uint(state.id());
+
+  writer.String("time");
+  writer.Uint(state.time());
+
+  writer.String("distance");
+  writer.Double(state.candidate().distance());
+
+  writer.String("coordinate");
+  serialize_coordinate(state.candidate().vertex(), writer);
+
+  writer.String("routes");
+  serialize_routes(state, mm, writer);
+
+  writer.EndObject();
+}
+
+
+template <typename buffer_t>
+void serialize_properties(const std::vector<MatchResult>& results,
+                          const MapMatching& mm,
+                          rapidjson::Writer<buffer_t>& writer,
+                          bool verbose)
+{
+  writer.StartObject();
+
+  writer.String("matched_coordinates");
+  writer.StartArray();
+  for (const auto& result : results) {
+    serialize_coordinate(result.lnglat(), writer);
+  }
+  writer.EndArray();
+
+  if (verbose) {
+    writer.String("distances");
+    writer.StartArray();
+    for (const auto& result : results) {
+      writer.Double(result.distance());
+    }
+    writer.EndArray();
+
+    writer.String("graphids");
+    writer.StartArray();
+    for (const auto& result : results) {
+      writer.Uint64(result.graphid().id());
+    }
+    writer.EndArray();
+
+    writer.String("states");
+    writer.StartArray();
+    for (const auto& result : results) {
+      writer.StartArray();
+      if (result.state()) {
+        for (const auto state : mm.states(result.state()->time())) {
+          serialize_state(*state, mm, writer);
+        }
+      }
+      writer.EndArray();
+    }
+    writer.EndArray();
+  }
+
+  writer.EndObject();
+}
+
+
+template <typename buffer_t>
+void serialize_results_as_feature(const std::vector<MatchResult>& results,
+                                  const MapMatching& mm,
+                                  rapidjson::Writer<buffer_t>& writer,
+                                  bool route,
+                                  bool verbose)
+{
+  writer.StartObject();
+
+  writer.String("type");
+  writer.String("Feature");
+
+  writer.String("geometry");
+  if (route) {
+    serialize_geometry_route(results, mm, writer);
+  } else {
+    serialize_geometry_matched_coordinates(results, writer);
+  }
+
+  writer.String("properties");
+  serialize_properties(results, mm, writer, verbose);
+
+  writer.EndObject();
+}
+
+
+template <typename buffer_t>
+void serialize_config(MapMatcher* matcher,
+                      rapidjson::Writer<buffer_t>& writer)
+{
+  // Property tree -> string
+  std::stringstream ss;
+  boost::property_tree::json_parser::write_json(ss, matcher->config());
+  const auto& str = ss.str();
+
+  // String -> JSON document
+  rapidjson::Document document;
+  document.Parse(str.c_str());
+
+  // JSON document -> writer stream
+  document.Accept(writer);
+}
+
+}
+
+
+#endif // MMP_GEOJSON_H_
@@ -4,6 +4,10 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
 
 #include <valhalla/midgard/aabb2.h>
 #include <valhalla/midgard/constants.h>
@@ -174,6 +178,112 @@ ExpandMeters(const midgard::PointLL& pt, float meters)
 }
 
 
+// Line segments in the structure of arrays layout, with coordinates
+// in meters relative to a test point (see Append). Segments of many
+// edges are appended at once, projected in one loop (see Project)
+// and then searched edge by edge (see Closest)
+class SegmentBuffer
+{
+ public:
+  // Set the test point and clear the segments
+  void Reset(const midgard::PointLL& point)
+  {
+    point_ = point;
+    meters_per_lng_ = midgard::DistanceApproximator::MetersPerLngDegree(point.lat());
+    ax_.clear();
+    ay_.clear();
+    dx_.clear();
+    dy_.clear();
+    sq_distances_.clear();
+    scales_.clear();
+  }
+
+  void Append(const midgard::PointLL& a, const midgard::PointLL& b)
+  {
+    const float ax = (a.lng() - point_.lng()) * meters_per_lng_,
+                ay = (a.lat() - point_.lat()) * midgard::kMetersPerDegreeLat,
+                bx = (b.lng() - point_.lng()) * meters_per_lng_,
+                by = (b.lat() - point_.lat()) * midgard::kMetersPerDegreeLat;
+    ax_.push_back(ax);
+    ay_.push_back(ay);
+    dx_.push_back(bx - ax);
+    dy_.push_back(by - ay);
+  }
+
+  size_t size() const
+  { return ax_.size(); }
+
+  bool empty() const
+  { return ax_.empty(); }
+
+  // Project the test point onto all segments appended
+  void Project()
+  {
+    const auto count = size();
+    sq_distances_.resize(count);
+    scales_.resize(count);
+
+    const float* ax = ax_.data();
+    const float* ay = ay_.data();
+    const float* dx = dx_.data();
+    const float* dy = dy_.data();
+    float* distances = sq_distances_.data();
+    float* scales = scales_.data();
+    // Vectorized where the build enables OpenMP SIMD (-fopenmp-simd),
+    // which also lets it reorder the float operations
+#pragma omp simd
+    for (size_t i = 0; i < count; i++) {
+      // Never divide by zero: the dot product is zero as well if the
+      // segment is degenerate
+      const float sq_length = dx[i] * dx[i] + dy[i] * dy[i] + std::numeric_limits<float>::min();
+      // The test point is the origin
+      const float dot = -(ax[i] * dx[i] + ay[i] * dy[i]);
+      // Clamp it into [0, 1] with fabs, which unlike comparisons
+      // doesn't branch
+      const float u = dot / sq_length,
+                  v = 1.f - 0.5f * (u + std::fabs(u)),
+                  t = 1.f - 0.5f * (v + std::fabs(v));
+      const float px = ax[i] + dx[i] * t,
+                  py = ay[i] + dy[i] * t;
+      distances[i] = px * px + py * py;
+      scales[i] = t;
+    }
+  }
+
+  // Find the segment in [begin, end) closest to the test point after
+  // it's projected. Return its index, and set the squared distance (in
+  // squared meters) and the offset of the closest point along the
+  // segment (between 0 and 1)
+  size_t Closest(size_t begin, size_t end, float& sq_distance, float& scale) const
+  {
+    if (end <= begin || sq_distances_.size() < end) {
+      throw std::logic_error("Expect at least one projected segment");
+    }
+    const auto distances = sq_distances_.data();
+    const auto closest = std::min_element(distances + begin, distances + end) - distances;
+    sq_distance = distances[closest];
+    scale = scales_[closest];
+    return closest;
+  }
+
+  // Project the test point and find the closest of all segments
+  size_t Closest(float& sq_distance, float& scale)
+  {
+    Project();
+    return Closest(0, size(), sq_distance, scale);
+  }
+
+ private:
+  midgard::PointLL point_;
+
+  float meters_per_lng_ = 0.f;
+
+  std::vector<float> ax_, ay_, dx_, dy_;
+
+  std::vector<float> sq_distances_, scales_;
+};
+
+
 // snapped point, sqaured distance, segment index, offset
 template <typename coord_t>
 std::tuple<coord_t, float, typename std::vector<coord_t>::size_type, float>
@@ -13,6 +13,14 @@ namespace helpers {
 using namespace valhalla;
 
 
+// Convert an offset along the edge's shape, which goes the way of
+// the forward one of the edge pair, to the offset along the directed
+// edge
+inline float
+edge_offset(const baldr::DirectedEdge* directededge, float shape_offset)
+{ return directededge->forward()? shape_offset : 1.f - shape_offset; }
+
+
 inline const baldr::DirectedEdge*
 edge_directededge(baldr::GraphReader& graphreader,
                   const baldr::GraphId& edgeid,
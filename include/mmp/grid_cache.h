@@ -0,0 +1,213 @@
+// -*- mode: c++ -*-
+#ifndef MMP_GRID_CACHE_H_
+#define MMP_GRID_CACHE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <valhalla/baldr/graphid.h>
+
+#include <mmp/grid_index.h>
+#include <mmp/grid_range_query.h>
+#include <mmp/segment_id.h>
+
+
+namespace mmp {
+
+using namespace valhalla;
+
+
+// Tile grids shared by many threads. Published grids are looked up
+// without locks. A missing grid is built by the first thread that
+// asks for it while the others wait for it. Grids are evicted in the
+// clock (second chance) order once they take more than
+// max_memory_size bytes, and freed only after no reader can still be
+// using them (epoch based reclamation).
+//
+// Each thread reads through its own Reader. A reader pins the current
+// epoch while it reads, and grids it gets stay valid until it's
+// unpinned or pinned again. Configuring the cache (LoadIndex,
+// set_cell_items, set_max_memory_size and Clear) is not safe while
+// other threads read it
+class GridCache
+{
+ public:
+  // A thread's handle to the cache (see Register)
+  class Reader
+  {
+   public:
+    Reader() : epoch_(0) {}
+
+   private:
+    friend class GridCache;
+
+    // The pinned epoch, or 0 if not pinned
+    std::atomic<uint64_t> epoch_;
+
+    // Keep epochs of different readers off the same cache line
+    char padding_[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  using Builder = std::function<GridRangeQuery<SegmentId>()>;
+
+  GridCache(float cell_width, float cell_height,
+            size_t max_memory_size = std::numeric_limits<size_t>::max());
+
+  ~GridCache();
+
+  GridCache(const GridCache&) = delete;
+
+  GridCache& operator=(const GridCache&) = delete;
+
+  float cell_width() const
+  { return cell_width_; }
+
+  float cell_height() const
+  { return cell_height_; }
+
+  // Target number of segments in non-empty cells when tiles are
+  // indexed (see BuildTileGrid)
+  float cell_items() const
+  { return cell_items_; }
+
+  // Cached grids are cleared. Set it before loading the index
+  void set_cell_items(float cell_items);
+
+  // Read grids from the grid index file instead of building them
+  // when possible. Throw std::runtime_error if the index is built
+  // with different cell sizes or cell items
+  void LoadIndex(const std::string& path);
+
+  const GridIndex* index() const
+  { return index_.get(); }
+
+  size_t max_memory_size() const
+  { return max_memory_size_; }
+
+  // Evict grids right away if they don't fit
+  void set_max_memory_size(size_t max_memory_size);
+
+  // Number of published grids
+  size_t size() const
+  { return size_.load(std::memory_order_relaxed); }
+
+  // Bytes taken by published grids
+  size_t memory_size() const
+  { return memory_size_.load(std::memory_order_relaxed); }
+
+  // Grids evicted to fit in the memory budget
+  size_t evictions() const
+  { return evictions_.load(std::memory_order_relaxed); }
+
+  // Grids built because the index is out of date with their tiles
+  size_t stale_index_grids() const
+  { return stale_index_grids_.load(std::memory_order_relaxed); }
+
+  // Unpublish all grids. Grids in the index remain mapped
+  void Clear();
+
+  // Register a reader. It must be unregistered before the cache is
+  // destroyed
+  Reader* Register();
+
+  void Unregister(Reader* reader);
+
+  // Pin the reader to the current epoch, after which grids evicted
+  // earlier may be freed
+  void Pin(Reader* reader) const;
+
+  // Let all grids the reader got be freed once evicted
+  void Unpin(Reader* reader) const;
+
+  // Return the grid of the tile, which stays valid as long as the
+  // pinned reader is. Set hit if it's published already. Otherwise it
+  // is read from the index, or built with the builder (on the calling
+  // thread) if the tile is not indexed or it is indexed with a
+  // different number of directed edges than edge_count
+  const GridRangeQuery<SegmentId>* Get(Reader* reader,
+                                       baldr::GraphId tile_id,
+                                       uint32_t edge_count,
+                                       const Builder& builder,
+                                       bool& hit);
+
+ private:
+  struct Entry;
+
+  struct Chunk;
+
+  // Slots are indexed by levels and tile ids (25 bits of GraphId), in
+  // chunks allocated on first use
+  static constexpr uint32_t kChunkBits = 12;
+
+  static constexpr uint32_t kChunkCount = 1 << (25 - kChunkBits);
+
+  std::atomic<Entry*>& Slot(baldr::GraphId tile_id);
+
+  Entry* Find(baldr::GraphId tile_id) const;
+
+  // Unpublish least recently referenced grids (but the kept one)
+  // until they fit in max_memory_size_. Require mutex_ to be held
+  void Evict(const Entry* keep);
+
+  void Retire(Entry* entry);
+
+  // Free retired entries that no pinned reader can refer to. Require
+  // mutex_ to be held
+  void Reclaim();
+
+  float cell_width_;
+
+  float cell_height_;
+
+  float cell_items_;
+
+  size_t max_memory_size_;
+
+  std::unique_ptr<GridIndex> index_;
+
+  std::unique_ptr<std::atomic<Chunk*>[]> chunks_;
+
+  std::atomic<size_t> size_;
+
+  std::atomic<size_t> memory_size_;
+
+  std::atomic<size_t> evictions_;
+
+  std::atomic<size_t> stale_index_grids_;
+
+  // Starts from 1 since 0 marks readers not pinned
+  mutable std::atomic<uint64_t> epoch_;
+
+  // Guards everything below, and publishing grids
+  std::mutex mutex_;
+
+  // Notified whenever a build is done
+  std::condition_variable built_;
+
+  // Tiles being built
+  std::unordered_set<baldr::GraphId> building_;
+
+  // Published entries, swept by the clock hand
+  std::vector<Entry*> published_;
+
+  size_t hand_;
+
+  // Unpublished entries waiting to be freed
+  std::vector<Entry*> retired_;
+
+  std::list<Reader> readers_;
+};
+
+}
+
+
+#endif // MMP_GRID_CACHE_H_
@@ -0,0 +1,147 @@
+// -*- mode: c++ -*-
+#ifndef MMP_GRID_INDEX_H_
+#define MMP_GRID_INDEX_H_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <valhalla/baldr/graphid.h>
+
+#include <mmp/grid_range_query.h>
+#include <mmp/segment_id.h>
+
+
+namespace mmp {
+
+using namespace valhalla;
+
+
+// A grid index file keeps frozen tile grids that are built offline,
+// so that they can be mapped into memory at startup instead of being
+// indexed from tiles. The file is laid out as (in host byte order):
+//
+//   GridIndexHeader
+//   offsets (uint32_t) and items (SegmentId) of each tile, 8-byte aligned
+//   GridIndexEntry of each tile, sorted by tile id
+//
+// Cell sizes in the header are the base ones that the index is built
+// with. Each tile keeps its own cell sizes, which are scaled from the
+// base ones by its density (see BuildTileGrid), and the number of
+// directed edges of the tile it's built from, so that a grid of a tile
+// that has changed since is not used
+struct GridIndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  float cell_width;
+  float cell_height;
+  uint32_t tile_count;
+  float cell_items;
+  uint32_t spare;
+  uint64_t table_offset;
+};
+
+
+struct GridIndexEntry
+{
+  uint64_t tile_id;
+  float minx, miny, maxx, maxy;
+  uint64_t offsets_offset;
+  uint64_t items_offset;
+  uint64_t item_count;
+  uint32_t cell_count;
+  float cell_width, cell_height;
+  uint32_t edge_count;
+};
+
+
+constexpr char kGridIndexMagic[8] = "MMPGRID";
+
+constexpr uint32_t kGridIndexVersion = 4;
+
+
+// Write tile grids into a grid index file. Tiles can be written in
+// any order but each tile only once
+class GridIndexWriter
+{
+ public:
+  GridIndexWriter(const std::string& path, float cell_width, float cell_height,
+                  float cell_items = 0.f);
+
+  ~GridIndexWriter();
+
+  // Write the grid of the tile that has edge_count directed edges
+  void Write(baldr::GraphId tile_id, uint32_t edge_count, const GridRangeQuery<SegmentId>& grid);
+
+  // Write the tile table and the header. The file is incomplete
+  // until it's closed
+  void Close();
+
+  size_t size() const
+  { return entries_.size(); }
+
+ private:
+  std::ofstream out_;
+
+  float cell_width_;
+
+  float cell_height_;
+
+  float cell_items_;
+
+  std::vector<GridIndexEntry> entries_;
+
+  void Pad();
+};
+
+
+// A grid index file mapped into memory. Grids read from it view the
+// mapped file directly, and keep it mapped as long as they live
+class GridIndex
+{
+ public:
+  // Throw std::runtime_error if the file can't be mapped or it is
+  // not a valid grid index
+  explicit GridIndex(const std::string& path);
+
+  ~GridIndex();
+
+  GridIndex(const GridIndex&) = delete;
+
+  GridIndex& operator=(const GridIndex&) = delete;
+
+  float cell_width() const
+  { return header_->cell_width; }
+
+  float cell_height() const
+  { return header_->cell_height; }
+
+  float cell_items() const
+  { return header_->cell_items; }
+
+  // Number of tiles indexed
+  size_t size() const
+  { return header_->tile_count; }
+
+  // Return nullptr if the tile is not indexed
+  const GridIndexEntry* Find(baldr::GraphId tile_id) const;
+
+  GridRangeQuery<SegmentId> Grid(const GridIndexEntry& entry) const;
+
+ private:
+  std::shared_ptr<const char> mapping_;
+
+  size_t length_;
+
+  const GridIndexHeader* header_;
+
+  const GridIndexEntry* entries_;
+};
+
+}
+
+
+#endif // MMP_GRID_INDEX_H_
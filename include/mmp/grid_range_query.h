@@ -9,6 +9,9 @@
 #include <unordered_set>
 #include <cmath>
 #include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <stdexcept>
 
 #include <valhalla/midgard/aabb2.h>
@@ -29,13 +32,72 @@ struct BoundingBoxIntersection {
 };
 
 
+// A read-only view of contiguous items
+template <typename key_t>
+class Span
+{
+ public:
+  Span(const key_t* begin, const key_t* end)
+      : begin_(begin), end_(end) {}
+
+  const key_t* begin() const {
+    return begin_;
+  }
+
+  const key_t* end() const {
+    return end_;
+  }
+
+  size_t size() const {
+    return end_ - begin_;
+  }
+
+  bool empty() const {
+    return begin_ == end_;
+  }
+
+ private:
+  const key_t* begin_;
+  const key_t* end_;
+};
+
+
+// Sort the items and remove duplicates
+template <typename key_t>
+void SortUnique(std::vector<key_t>& items)
+{
+  std::sort(items.begin(), items.end());
+  items.erase(std::unique(items.begin(), items.end()), items.end());
+}
+
+
+template <typename key_t>
+class GridRangeQueryBuilder;
+
+
+// A frozen grid index. Items of all cells are kept in one array in
+// the compressed sparse row layout: items of cell c are at
+// [offsets_[c], offsets_[c + 1]). Use GridRangeQueryBuilder to index
+// items into it. Copies share the same arrays
 template <typename key_t>
 class GridRangeQuery
 {
  public:
   GridRangeQuery() = delete;
 
-  GridRangeQuery(const BoundingBox& bbox, float cell_width, float cell_height) {
+  // An empty grid
+  GridRangeQuery(const BoundingBox& bbox, float cell_width, float cell_height)
+      : GridRangeQuery(bbox, cell_width, cell_height, nullptr, nullptr, 0, nullptr) {}
+
+  // A grid on the arrays kept alive by the storage (which can be a
+  // mapped file): cell_count() + 1 offsets and size items
+  GridRangeQuery(const BoundingBox& bbox, float cell_width, float cell_height,
+                 const uint32_t* offsets, const key_t* items, size_t size,
+                 std::shared_ptr<const void> storage)
+      : offsets_(offsets),
+        items_(items),
+        size_(size),
+        storage_(storage) {
     if (cell_width <= 0.f) {
       throw std::invalid_argument("invalid cell width (require positive width)");
     }
@@ -55,7 +117,9 @@ class GridRangeQuery
     cell_height_ = std::min(bbox_height, cell_height);
     num_rows_ = ceil(bbox_width / cell_width_);
     num_cols_ = ceil(bbox_height / cell_height_);
-    items_.resize(num_cols_ * num_rows_);
+    if (!offsets_ && size_) {
+      throw std::invalid_argument("expect offsets for the items");
+    }
   }
 
   const BoundingBox& bbox() const {
@@ -78,6 +142,29 @@ class GridRangeQuery
     return cell_height_;
   }
 
+  size_t cell_count() const {
+    return num_rows_ * num_cols_;
+  }
+
+  // Number of items in all cells
+  size_t size() const {
+    return size_;
+  }
+
+  // Offsets of cells (nullptr if the grid is empty)
+  const uint32_t* offsets() const {
+    return offsets_;
+  }
+
+  const key_t* items() const {
+    return items_;
+  }
+
+  // Bytes taken by the offsets and items
+  size_t memory_size() const {
+    return (offsets_? (cell_count() + 1) * sizeof(uint32_t) : 0) + size_ * sizeof(key_t);
+  }
+
   std::pair<int, int> GridCoordinates(const Point &p) const {
     float dx = p.x() - bbox_.minx();
     float dy = p.y() - bbox_.miny();
@@ -102,16 +189,20 @@ class GridRangeQuery
   }
 
 
-  const std::vector<key_t> &ItemsInCell(int i, int j) const {
-    return items_[i + j * num_cols_];
+  int CellIndex(int i, int j) const {
+    return i + j * num_cols_;
   }
 
-  std::vector<key_t> &ItemsInCell(int i, int j) {
-    return items_[i + j * num_cols_];
+  Span<key_t> ItemsInCell(int i, int j) const {
+    if (!offsets_) {
+      return {items_, items_};
+    }
+    const auto cell = CellIndex(i, j);
+    return {items_ + offsets_[cell], items_ + offsets_[cell + 1]};
   }
 
 
-  bool InteriorLineSegment(const LineSegment &segment, LineSegment &interior) {
+  bool InteriorLineSegment(const LineSegment &segment, LineSegment &interior) const {
     const Point& a = segment.a();
     const Point& b = segment.b();
 
@@ -155,55 +246,9 @@ class GridRangeQuery
   }
 
 
-  // Index a line segment into the grid
-  void AddLineSegment(const key_t edgeid, const LineSegment& segment) {
-    LineSegment interior;
-
-    // Do nothing if segment is completely outside the box
-    if (!InteriorLineSegment(segment, interior)) return;
-
-    const Point& start = interior.a();
-    const Point& end = interior.b();
-
-    Point current_point = start;
-    int i, j;
-    std::tie(i, j) = GridCoordinates(current_point);
-
-    // Special case
-    if (start == end) {
-      ItemsInCell(i, j).push_back(edgeid);
-      return;
-    }
-
-    // Walk along start,end
-    while (Unlerp(start, end, current_point) < 1.0) {
-      ItemsInCell(i, j).push_back(edgeid);
-
-      const auto& intersects = CellLineSegmentIntersections(i, j, LineSegment(current_point, end));
-
-      float bestd = end.DistanceSquared(CellCenter(i, j));
-      BoundingBoxIntersection bestp;
-      for (const auto &intersect : intersects) {
-        float d = end.DistanceSquared(CellCenter(i + intersect.dx, j + intersect.dy));
-        if (d < bestd) {
-          bestd = d;
-          bestp = intersect;
-        }
-      }
-      if (bestd < end.DistanceSquared(CellCenter(i, j))) {
-        current_point = bestp.point;
-        i += bestp.dx;
-        j += bestp.dy;
-      } else {
-        break;
-      }
-    }
-  }
-
-  // Query all edges that intersects with the range
-  std::unordered_set<key_t> Query(const BoundingBox& range) const {
-    std::unordered_set<key_t> results;
-
+  // Append items in the cells that intersect with the range to the
+  // buffer. Items that span many cells are appended many times
+  void CollectItems(const BoundingBox& range, std::vector<key_t>& buffer) const {
     int mini, minj, maxi, maxj;
     std::tie(mini, minj) = GridCoordinates(range.minpt());
     std::tie(maxi, maxj) = GridCoordinates(range.maxpt());
@@ -215,12 +260,27 @@ class GridRangeQuery
 
     for (int i = mini; i <= maxi; ++i) {
       for (int j = minj; j <= maxj; ++j) {
-        const auto& items = ItemsInCell(i, j);
-        results.insert(items.begin(), items.end());
+        const auto items = ItemsInCell(i, j);
+        buffer.insert(buffer.end(), items.begin(), items.end());
       }
     }
+  }
 
-    return results;
+  // Query all edges that intersects with the range into the buffer.
+  // The results are sorted and unique, and valid until the buffer
+  // changes. Reuse the buffer to avoid allocations
+  Span<key_t> Query(const BoundingBox& range, std::vector<key_t>& buffer) const {
+    buffer.clear();
+    CollectItems(range, buffer);
+    SortUnique(buffer);
+    return {buffer.data(), buffer.data() + buffer.size()};
+  }
+
+  // Query all edges that intersects with the range
+  std::unordered_set<key_t> Query(const BoundingBox& range) const {
+    std::vector<key_t> buffer;
+    CollectItems(range, buffer);
+    return std::unordered_set<key_t>(buffer.begin(), buffer.end());
   }
 
 
@@ -265,12 +325,161 @@ class GridRangeQuery
 
 
  private:
+  friend class GridRangeQueryBuilder<key_t>;
+
   BoundingBox bbox_;
   float cell_width_;
   float cell_height_;
   int num_rows_;
   int num_cols_;
-  std::vector<std::vector<key_t> > items_;
+  const uint32_t* offsets_;
+  const key_t* items_;
+  size_t size_;
+  std::shared_ptr<const void> storage_;
+};
+
+
+// Index items into a grid. Items are collected as (cell, item) pairs
+// in one array, and sorted by cells when the grid is built
+template <typename key_t>
+class GridRangeQueryBuilder
+{
+ public:
+  GridRangeQueryBuilder(const BoundingBox& bbox, float cell_width, float cell_height)
+      : grid_(bbox, cell_width, cell_height),
+        items_() {}
+
+  // The empty grid, for its geometry
+  const GridRangeQuery<key_t>& grid() const {
+    return grid_;
+  }
+
+  size_t size() const {
+    return items_.size();
+  }
+
+  void reserve(size_t count) {
+    items_.reserve(count);
+  }
+
+  // Number of cells that have items, counted without building the
+  // grid
+  size_t occupied_cell_count() const {
+    std::vector<bool> occupied(grid_.cell_count(), false);
+    size_t count = 0;
+    for (const auto& item : items_) {
+      if (!occupied[item.first]) {
+        occupied[item.first] = true;
+        count++;
+      }
+    }
+    return count;
+  }
+
+  void AddItem(int i, int j, const key_t& item) {
+    items_.emplace_back(grid_.CellIndex(i, j), item);
+  }
+
+  // Index a line segment into all cells it crosses. Cells are
+  // walked from the start to the end with a DDA traversal (Amanatides
+  // and Woo): the next cell is across whichever of the vertical or the
+  // horizontal cell border the segment reaches first
+  void AddLineSegment(const key_t item, const LineSegment& segment) {
+    const Point& a = segment.a();
+    const Point& b = segment.b();
+    const auto& bbox = grid_.bbox();
+
+    // Clip it only if it may leave the box
+    LineSegment interior;
+    if (bbox.minx() < a.x() && a.x() < bbox.maxx() && bbox.miny() < a.y() && a.y() < bbox.maxy()
+        && bbox.minx() < b.x() && b.x() < bbox.maxx() && bbox.miny() < b.y() && b.y() < bbox.maxy()) {
+      interior = segment;
+    } else if (!grid_.InteriorLineSegment(segment, interior)) {
+      // Do nothing if segment is completely outside the box
+      return;
+    }
+
+    const Point& start = interior.a();
+    const Point& end = interior.b();
+
+    int i, j, end_i, end_j;
+    std::tie(i, j) = CellCoordinates(start);
+    std::tie(end_i, end_j) = CellCoordinates(end);
+    AddItem(i, j, item);
+
+    // Parameters along the segment (0 at the start, 1 at the end) where
+    // it crosses the next vertical and horizontal borders, and between
+    // two borders
+    const float dx = end.x() - start.x(),
+                dy = end.y() - start.y();
+    const int step_i = dx < 0.f? -1 : 1,
+              step_j = dy < 0.f? -1 : 1;
+    const float inf = std::numeric_limits<float>::infinity();
+    float next_x = dx != 0.f? (bbox.minx() + (i + (step_i > 0)) * grid_.cell_width() - start.x()) / dx : inf,
+          next_y = dy != 0.f? (bbox.miny() + (j + (step_j > 0)) * grid_.cell_height() - start.y()) / dy : inf;
+    const float delta_x = dx != 0.f? grid_.cell_width() / std::abs(dx) : inf,
+                delta_y = dy != 0.f? grid_.cell_height() / std::abs(dy) : inf;
+
+    // Take exactly the steps to the end cell, so that rounding errors
+    // never walk past it
+    for (int steps = std::abs(end_i - i) + std::abs(end_j - j); steps > 0; steps--) {
+      const bool along_x = j == end_j || (i != end_i && next_x < next_y);
+      // A segment that ends on a border doesn't cross it
+      if (along_x) {
+        const float border = bbox.minx() + (i + (step_i > 0)) * grid_.cell_width();
+        if (step_i > 0? end.x() <= border : end.x() >= border) break;
+      } else {
+        const float border = bbox.miny() + (j + (step_j > 0)) * grid_.cell_height();
+        if (step_j > 0? end.y() <= border : end.y() >= border) break;
+      }
+      if (along_x) {
+        i += step_i;
+        next_x += delta_x;
+      } else {
+        j += step_j;
+        next_y += delta_y;
+      }
+      AddItem(i, j, item);
+    }
+  }
+
+  // Freeze the items added so far into a grid. Items in a cell keep
+  // the order they were added
+  GridRangeQuery<key_t> Build() const {
+    auto storage = std::make_shared<std::pair<std::vector<uint32_t>, std::vector<key_t>>>();
+    auto& offsets = storage->first;
+    offsets.assign(grid_.cell_count() + 1, 0);
+    for (const auto& item : items_) {
+      offsets[item.first + 1]++;
+    }
+    for (size_t cell = 1; cell < offsets.size(); cell++) {
+      offsets[cell] += offsets[cell - 1];
+    }
+
+    auto& items = storage->second;
+    items.resize(items_.size());
+    std::vector<uint32_t> cursors(offsets.begin(), offsets.end() - 1);
+    for (const auto& item : items_) {
+      items[cursors[item.first]++] = item.second;
+    }
+
+    return GridRangeQuery<key_t>(grid_.bbox(), grid_.cell_width(), grid_.cell_height(),
+                                 offsets.data(), items.data(), items.size(), storage);
+  }
+
+ private:
+  GridRangeQuery<key_t> grid_;
+
+  std::vector<std::pair<uint32_t, key_t>> items_;
+
+  // Coordinates of the cell of the point, clamped into the grid so
+  // that points on the far borders belong to the last cells
+  std::pair<int, int> CellCoordinates(const Point& p) const {
+    int i, j;
+    std::tie(i, j) = grid_.GridCoordinates(p);
+    return {std::max(0, std::min(i, grid_.num_cols() - 1)),
+            std::max(0, std::min(j, grid_.num_rows() - 1))};
+  }
 };
 
 
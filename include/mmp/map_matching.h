@@ -3,9 +3,17 @@
 #define MMP_MAP_MATCHING_H_
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 
 #include <valhalla/midgard/logging.h>
 #include <valhalla/midgard/pointll.h>
+#include <valhalla/midgard/distanceapproximator.h>
 #include <valhalla/baldr/pathlocation.h>
 #include <valhalla/sif/edgelabel.h>
 #include <valhalla/sif/costconstants.h>
@@ -14,6 +22,9 @@
 #include <mmp/candidate_search.h>
 #include <mmp/viterbi_search.h>
 #include <mmp/routing.h>
+#include <mmp/shape_cache.h>
+#include <mmp/thread_pool.h>
+#include <mmp/trace_simplifier.h>
 
 
 namespace mmp {
@@ -24,14 +35,53 @@ using namespace valhalla;
 class Measurement
 {
  public:
-  Measurement(const midgard::PointLL& lnglat)
-      : lnglat_(lnglat) {}
+  // Heading is in degrees clockwise from north, accuracy is in meters
+  // (the standard deviation of the GPS error) and time is in seconds.
+  // Each of them is negative if it's unknown
+  Measurement(const midgard::PointLL& lnglat,
+              float heading = -1.f,
+              float accuracy = -1.f,
+              double time = -1.0)
+      : lnglat_(lnglat), heading_(heading), accuracy_(accuracy), time_(time) {}
 
   const midgard::PointLL& lnglat() const
   { return lnglat_; }
 
+  float heading() const
+  { return heading_; }
+
+  bool has_heading() const
+  { return 0.f <= heading_; }
+
+  void set_heading(float heading)
+  { heading_ = heading; }
+
+  float accuracy() const
+  { return accuracy_; }
+
+  bool has_accuracy() const
+  { return 0.f < accuracy_; }
+
+  void set_accuracy(float accuracy)
+  { accuracy_ = accuracy; }
+
+  double time() const
+  { return time_; }
+
+  bool has_time() const
+  { return 0.0 <= time_; }
+
+  void set_time(double time)
+  { time_ = time; }
+
  private:
   midgard::PointLL lnglat_;
+
+  float heading_;
+
+  float accuracy_;
+
+  double time_;
 };
 
 
@@ -52,30 +102,47 @@ class State
   { return candidate_; }
 
   bool routed() const
-  { return labelset_ != nullptr; }
+  { return routed_; }
 
-  void route(const std::vector<const State*>& states,
+  // Route to the states and keep the paths found in the arena. Return
+  // the number of labels settled
+  size_t route(const std::vector<const State*>& states,
+             RouteArena& arena,
              baldr::GraphReader& graphreader,
              float max_route_distance,
              const midgard::DistanceApproximator& approximator,
              float search_radius,
              sif::cost_ptr_t costing,
              std::shared_ptr<const sif::EdgeLabel> edgelabel,
-             const float turn_cost_table[181]) const;
+             const float turn_cost_table[181],
+             EdgeAccessCache* access_cache = nullptr,
+             ShapeCache* shape_cache = nullptr) const;
 
-  const Label* last_label(const State& state) const;
+  // Drop the routes so that the next route starts over
+  void unroute() const
+  {
+    routed_ = false;
+    paths_.clear();
+  }
 
-  RoutePathIterator RouteBegin(const State& state) const
+  // The last step of the route to the state
+  const RouteStep* last_label(const State& state) const;
+
+  // The edge label of the last step of the route to the state
+  std::shared_ptr<const sif::EdgeLabel> last_edgelabel(const State& state) const;
+
+  RouteStepIterator RouteBegin(const State& state) const
   {
-    const auto it = label_idx_.find(state.id());
-    if (it != label_idx_.end()) {
-      return RoutePathIterator(labelset_.get(), it->second);
+    const auto it = paths_.find(state.id());
+    if (it != paths_.end()) {
+      // It equals to RouteEnd() if the state is not reachable
+      return RouteStepIterator(arena_, it->second);
     }
-    return RoutePathIterator(labelset_.get());
+    return RouteStepIterator();
   }
 
-  RoutePathIterator RouteEnd() const
-  { return RoutePathIterator(labelset_.get()); }
+  RouteStepIterator RouteEnd() const
+  { return RouteStepIterator(); }
 
  private:
   const StateId id_;
@@ -84,9 +151,14 @@ class State
 
   const Candidate candidate_;
 
-  mutable std::shared_ptr<LabelSet> labelset_;
+  mutable bool routed_;
 
-  mutable std::unordered_map<StateId, uint32_t> label_idx_;
+  // Where the routes are kept
+  mutable const RouteArena* arena_;
+
+  // Path of each routed state (of size 0 if the state is not
+  // reachable)
+  mutable std::unordered_map<StateId, RoutePath> paths_;
 };
 
 
@@ -101,12 +173,19 @@ class MapMatching: public ViterbiSearch<State>
               float breakage_distance,
               float max_route_distance_factor,
               float search_radius,
-              float turn_penalty_factor);
+              float turn_penalty_factor,
+              float max_speed = 0.f,
+              EdgeAccessCache* access_cache = nullptr,
+              RoutePool* route_pool = nullptr,
+              ShapeCache* shape_cache = nullptr);
 
   MapMatching(baldr::GraphReader& graphreader,
               const sif::cost_ptr_t* mode_costing,
               const sif::TravelMode mode,
-              const boost::property_tree::ptree& config);
+              const boost::property_tree::ptree& config,
+              EdgeAccessCache* access_cache = nullptr,
+              RoutePool* route_pool = nullptr,
+              ShapeCache* shape_cache = nullptr);
 
   virtual ~MapMatching();
 
@@ -115,6 +194,16 @@ class MapMatching: public ViterbiSearch<State>
   baldr::GraphReader& graphreader() const
   { return graphreader_; }
 
+  float sigma_z() const
+  { return sigma_z_; }
+
+  // Labels settled by all routes since it's cleared
+  size_t settled_count() const
+  { return settled_count_; }
+
+  ShapeCache* shape_cache() const
+  { return shape_cache_; }
+
   sif::cost_ptr_t costing() const
   { return mode_costing_[static_cast<size_t>(mode_)]; }
 
@@ -137,6 +226,11 @@ class MapMatching: public ViterbiSearch<State>
                    candidate_iterator_t end);
 
  protected:
+  // Routes between the states go no farther than this. By default it
+  // is bounded by the distance between their measurements (times
+  // max_route_distance_factor), breakage_distance, and the max speed
+  // in the elapsed time if the measurements have times. Override it
+  // to bound routes otherwise
   virtual float MaxRouteDistance(const State& left, const State& right) const;
 
   float TransitionCost(const State& left, const State& right) const override;
@@ -146,6 +240,18 @@ class MapMatching: public ViterbiSearch<State>
   double CostSofar(double prev_costsofar, float transition_cost, float emission_cost) const override;
 
  private:
+  // Route from the left state (that comes from the predecessor) to
+  // the unreached states at the right state's time
+  void Route(const State& left,
+             StateId prev_stateid,
+             const State& right,
+             baldr::GraphReader& graphreader,
+             EdgeAccessCache* access_cache,
+             ShapeCache* shape_cache) const;
+
+  // Route from the left state and other queued states in its column
+  // in parallel
+  void RouteColumn(const State& left, const State& right) const;
 
   baldr::GraphReader& graphreader_;
 
@@ -171,6 +277,28 @@ class MapMatching: public ViterbiSearch<State>
 
   float turn_penalty_factor_;
 
+  // Meters per second, or 0 to not bound routes by elapsed times
+  float max_speed_;
+
+  // Shared verdicts of edge accessibility (optional)
+  EdgeAccessCache* access_cache_;
+
+  // Workers for routing a column at once (optional)
+  RoutePool* route_pool_;
+
+  // Shared decoded shapes of graphreader_ (optional)
+  ShapeCache* shape_cache_;
+
+  // Paths of all routes from all states
+  mutable RouteArena arena_;
+
+  // Summed by routes that may run on route workers at once
+  mutable std::atomic<size_t> settled_count_;
+
+  // Predecessors that the states routed ahead in a column were routed
+  // with. Their best labels may still change before they are scanned
+  mutable std::unordered_map<StateId, StateId> batch_predecessor_;
+
   // Cost for each degree in [0, 180]
   float turn_cost_table_[181];
 };
@@ -241,7 +369,8 @@ struct EdgeSegment
               float the_source = 0.f,
               float the_target = 1.f);
 
-  std::vector<midgard::PointLL> Shape(baldr::GraphReader& graphreader) const;
+  std::vector<midgard::PointLL> Shape(baldr::GraphReader& graphreader,
+                                      ShapeCache* shape_cache = nullptr) const;
 
   bool Adjoined(baldr::GraphReader& graphreader, const EdgeSegment& other) const;
 
@@ -479,7 +608,9 @@ class MapMatcher final
              baldr::GraphReader&,
              CandidateGridQuery&,
              const sif::cost_ptr_t*,
-             sif::TravelMode);
+             sif::TravelMode,
+             EdgeAccessCache* = nullptr,
+             RoutePool* = nullptr);
 
   ~MapMatcher();
 
@@ -501,6 +632,10 @@ class MapMatcher final
   MapMatching& mapmatching()
   { return mapmatching_; }
 
+  // Picks the measurements matched as states
+  const TraceSimplifier& simplifier() const
+  { return *simplifier_; }
+
   std::vector<MatchResult>
   OfflineMatch(const std::vector<Measurement>&);
 
@@ -516,12 +651,35 @@ class MapMatcher final
   sif::TravelMode travelmode_;
 
   MapMatching mapmatching_;
+
+  std::unique_ptr<TraceSimplifier> simplifier_;
 };
 
 
 constexpr size_t kModeCostingCount = 8;
 
 
+struct BatchOptions
+{
+  // Mode and preferences of all traces, as of MapMatcherFactory::Create
+  boost::property_tree::ptree preferences;
+
+  // Number of worker threads, 0 for one per hardware thread
+  size_t thread_count = 0;
+};
+
+
+// What MatchBatch gives for a trace
+struct BatchResult
+{
+  // Without states since matchers are reused
+  std::vector<MatchResult> results;
+
+  // Set instead of the results if matching the trace threw
+  std::exception_ptr error;
+};
+
+
 class MapMatcherFactory final
 {
 public:
@@ -535,6 +693,20 @@ public:
   CandidateQuery& rangequery()
   { return rangequery_; }
 
+  // Tile grids, which candidate queries of other threads (with their
+  // own graph readers) can share
+  const std::shared_ptr<GridCache>& grid_cache() const
+  { return rangequery_.cache(); }
+
+  GridCacheStats grid_cache_stats() const
+  { return rangequery_.stats(); }
+
+  // Shapes decoded and found in the caches of the matchers and the
+  // route workers since the stats are reset
+  ShapeCacheStats shape_cache_stats() const;
+
+  void ResetShapeCacheStats();
+
   sif::TravelMode NameToTravelMode(const std::string&);
 
   const std::string& TravelModeToName(sif::TravelMode);
@@ -553,6 +725,98 @@ public:
 
   MapMatcher* Create(sif::TravelMode, const boost::property_tree::ptree&);
 
+  // Called on the workers with the index of each trace, the matcher
+  // and its results, whose states are valid until the call returns
+  using batch_callback_t = std::function<void(size_t, MapMatcher&, std::vector<MatchResult>&)>;
+
+  // Called on the workers with the index of each trace that failed
+  // (in matching or in the callback above) and its exception
+  using batch_error_callback_t = std::function<void(size_t, std::exception_ptr)>;
+
+  // Match the traces on worker threads, each with its own graph
+  // reader and candidate query but sharing the grid cache. Workers
+  // are kept for later batches of as many threads. The results are
+  // in the order of the traces, and a trace that fails only fails its
+  // own result. Batches of a factory run one at a time: a concurrent
+  // call waits for the running one
+  std::vector<BatchResult>
+  MatchBatch(const std::vector<std::vector<Measurement>>& traces,
+             const BatchOptions& options = BatchOptions());
+
+  // Same as above, but hand the results to the callback instead
+  // (concurrently, in no particular order), and the failures to the
+  // error callback. Without the error callback the first failure is
+  // rethrown once all traces are done. The callbacks must not clear
+  // the caches or read the stats of the factory, which wait for the
+  // batch
+  void MatchBatch(const std::vector<std::vector<Measurement>>& traces,
+                  const BatchOptions& options,
+                  const batch_callback_t& callback,
+                  const batch_error_callback_t& error_callback = nullptr);
+
+  // Traces matched on the batch workers as they are submitted, so
+  // that a stream of traces can be matched with only a window of them
+  // in memory. The factory is held by the batch as by MatchBatch from
+  // OpenBatch until the batch is destroyed, which waits for the traces
+  // submitted
+  class Batch
+  {
+   public:
+    // Called on the workers with the matcher and the results of the
+    // trace, whose states are valid until the call returns
+    using callback_t = std::function<void(MapMatcher&, std::vector<MatchResult>&)>;
+
+    // Called on the workers with the exception of the trace if it
+    // failed (in matching or in the callback above)
+    using error_callback_t = std::function<void(std::exception_ptr)>;
+
+    ~Batch();
+
+    Batch(const Batch&) = delete;
+
+    Batch& operator=(const Batch&) = delete;
+
+    // Queue the trace, which must live until the future is ready.
+    // Without the error callback the future rethrows the failure
+    std::future<void> Submit(const std::vector<Measurement>& trace,
+                             const callback_t& callback,
+                             const error_callback_t& error_callback = nullptr);
+
+   private:
+    friend class MapMatcherFactory;
+
+    Batch(MapMatcherFactory& factory, const BatchOptions& options);
+
+    void Match(size_t worker,
+               const std::vector<Measurement>& trace,
+               const callback_t& callback,
+               const error_callback_t& error_callback);
+
+    MapMatcherFactory& factory_;
+
+    // Released last, after the traces are done
+    std::unique_lock<std::mutex> lock_;
+
+    boost::property_tree::ptree config_;
+
+    sif::TravelMode travelmode_;
+
+    // Each worker creates its matcher with the first trace it gets,
+    // and matches the others with it
+    std::vector<std::unique_ptr<MapMatcher>> matchers_;
+
+    // Traces submitted but not done yet
+    size_t pending_;
+
+    std::mutex mutex_;
+
+    std::condition_variable done_;
+  };
+
+  // Start a batch of traces to submit one by one. It waits for a
+  // running batch, and throws if the preferences are invalid
+  std::unique_ptr<Batch> OpenBatch(const BatchOptions& options = BatchOptions());
+
   boost::property_tree::ptree
   MergeConfig(const std::string&, const boost::property_tree::ptree&);
 
@@ -568,6 +832,8 @@ private:
 
   boost::property_tree::ptree config_;
 
+  boost::property_tree::ptree mjolnir_config_;
+
   baldr::GraphReader graphreader_;
 
   sif::cost_ptr_t mode_costing_[kModeCostingCount];
@@ -576,7 +842,31 @@ private:
 
   CandidateGridQuery rangequery_;
 
-  float max_grid_cache_size_;
+  EdgeAccessCache access_cache_;
+
+  // Created only if mm.route_threads is positive
+  std::unique_ptr<RoutePool> route_pool_;
+
+  // What a worker of MatchBatch reads tiles and candidates with
+  struct BatchWorker
+  {
+    BatchWorker(const boost::property_tree::ptree& mjolnir_config,
+                const std::shared_ptr<GridCache>& grid_cache,
+                float snap_distance);
+
+    baldr::GraphReader graphreader;
+
+    CandidateGridQuery rangequery;
+
+    EdgeAccessCache access_cache;
+  };
+
+  // Created by the first MatchBatch, and guarded by batch_mutex_
+  std::vector<std::unique_ptr<BatchWorker>> batch_workers_;
+
+  std::unique_ptr<ThreadPool> batch_pool_;
+
+  mutable std::mutex batch_mutex_;
 
   size_t register_costing(const std::string&, factory_function_t, const boost::property_tree::ptree&);
 
@@ -73,6 +73,12 @@ class SPQueue
     return heap_.top();
   }
 
+  // The label queued with the id, or nullptr if there is none
+  const T* find(const typename T::id_type& id) const {
+    const auto handler_itr = handlers_.find(id);
+    return handler_itr == handlers_.end()? nullptr : &(*handler_itr->second);
+  }
+
   bool empty() const {
     assert(heap_.empty() == handlers_.empty());
     return heap_.empty();
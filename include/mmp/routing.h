@@ -8,6 +8,12 @@
 #include <stdexcept>
 #include <algorithm>
 #include <cassert>
+#include <limits>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <boost/property_tree/ptree.hpp>
 
 #include <valhalla/midgard/distanceapproximator.h>
 #include <valhalla/baldr/graphid.h>
@@ -17,6 +23,9 @@
 #include <valhalla/sif/edgelabel.h>
 #include <valhalla/sif/dynamiccost.h>
 
+#include <mmp/shape_cache.h>
+#include <mmp/thread_pool.h>
+
 
 namespace mmp {
 
@@ -45,6 +54,19 @@ class BucketQueue
     buckets_.reserve(bucket_count_);
   }
 
+  // Raise the cost limit so that keys rejected before can be added
+  // now. The limit never shrinks
+  void set_bucket_count(size_type count) {
+    if (bucket_count_ < count) {
+      bucket_count_ = count;
+      buckets_.reserve(bucket_count_);
+    }
+  }
+
+  size_type bucket_count() const {
+    return bucket_count_;
+  }
+
   bool add(const key_t& key, float cost) {
     if (cost < 0.f) {
       throw std::invalid_argument("expect non-negative cost");
@@ -165,6 +187,232 @@ class BucketQueue
 };
 
 
+// A monotone radix heap on bucket indexes of costs. Unlike
+// BucketQueue it holds a logarithmic number of buckets, which are
+// linked lists threaded through the items, so the memory it takes
+// doesn't grow with the cost limit. Keys lower than the last popped
+// one (destination labels are added without heuristics) are allowed:
+// they go to bucket 0 to be popped next, in no particular order among
+// themselves
+template<typename key_t, key_t invalid_key>
+class RadixQueue
+{
+ public:
+  using size_type = std::size_t;
+
+  RadixQueue(size_type count, float size = 1.f)
+      : bucket_count_(count),
+        bucket_size_(size),
+        last_(0),
+        entries_() {
+    if (bucket_size_ <= 0.f) {
+      throw std::invalid_argument("expect bucket size to be positive");
+    }
+    std::fill(heads_, heads_ + kRadixCount, invalid_key);
+  }
+
+  void set_bucket_count(size_type count) {
+    if (bucket_count_ < count) {
+      bucket_count_ = count;
+    }
+  }
+
+  size_type bucket_count() const {
+    return bucket_count_;
+  }
+
+  bool add(const key_t& key, float cost) {
+    if (cost < 0.f) {
+      throw std::invalid_argument("expect non-negative cost");
+    }
+
+    if (entries_.find(key) != entries_.end()) {
+      throw std::invalid_argument("the key " + std::to_string(key) + " exists");
+    }
+
+    const auto idx = bucket_idx(cost);
+
+    if (idx < bucket_count_) {
+      auto& entry = entries_[key];
+      entry.cost = cost;
+      entry.idx = idx;
+      insert(key, entry);
+      return true;
+    }
+
+    return false;
+  }
+
+  bool decrease(const key_t& key, float cost)
+  {
+    if (cost < 0.f) {
+      throw std::invalid_argument("expect non-negative cost");
+    }
+
+    const auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      throw std::runtime_error("the key " + std::to_string(key) + " to decrease doesn't exists");
+    }
+
+    auto& entry = it->second;
+    if (cost < entry.cost) {
+      const auto idx = bucket_idx(cost);
+      if (idx > entry.idx) {
+        throw std::runtime_error("invalid cost: " + std::to_string(cost) + " (old value is " + std::to_string(entry.cost) + ")");
+      }
+      unlink(entry);
+      entry.cost = cost;
+      entry.idx = idx;
+      insert(key, entry);
+      return true;
+    }
+
+    return false;
+  }
+
+  float cost(const key_t& key)
+  {
+    const auto it = entries_.find(key);
+    return it == entries_.end()? -1.f : it->second.cost;
+  }
+
+  key_t pop() {
+    if (empty()) {
+      return invalid_key;
+    }
+
+    if (heads_[0] == invalid_key) {
+      pull();
+    }
+
+    const auto key = heads_[0];
+    const auto it = entries_.find(key);
+    assert(it != entries_.end());
+    unlink(it->second);
+    entries_.erase(it);
+    return key;
+  }
+
+  bool empty() const {
+    return entries_.empty();
+  }
+
+  size_type size() const {
+    return entries_.size();
+  }
+
+  void clear() {
+    entries_.clear();
+    std::fill(heads_, heads_ + kRadixCount, invalid_key);
+    last_ = 0;
+  }
+
+ private:
+  // Bucket 0 holds keys at the last popped index; bucket b (b > 0)
+  // holds keys whose highest bit different from the last popped index
+  // is bit b - 1
+  static constexpr size_type kRadixCount = 33;
+
+  struct Entry
+  {
+    float cost;
+    uint32_t idx;
+    uint8_t radix;
+    key_t prev;
+    key_t next;
+  };
+
+  size_type bucket_count_;
+
+  float bucket_size_;
+
+  // All keys are at this index or higher
+  uint32_t last_;
+
+  key_t heads_[kRadixCount];
+
+  std::unordered_map<key_t, Entry> entries_;
+
+  uint32_t bucket_idx(float cost) const {
+    return static_cast<uint32_t>(cost / bucket_size_);
+  }
+
+  uint8_t radix(uint32_t idx) const {
+    return idx == last_? 0 : 32 - __builtin_clz(idx ^ last_);
+  }
+
+  void link(const key_t& key, Entry& entry, uint8_t radix) {
+    entry.radix = radix;
+    entry.prev = invalid_key;
+    entry.next = heads_[radix];
+    if (entry.next != invalid_key) {
+      entries_.find(entry.next)->second.prev = key;
+    }
+    heads_[radix] = key;
+  }
+
+  void unlink(const Entry& entry) {
+    if (entry.prev != invalid_key) {
+      entries_.find(entry.prev)->second.next = entry.next;
+    } else {
+      heads_[entry.radix] = entry.next;
+    }
+    if (entry.next != invalid_key) {
+      entries_.find(entry.next)->second.prev = entry.prev;
+    }
+  }
+
+  void insert(const key_t& key, Entry& entry) {
+    // Clamp lower keys into bucket 0 rather than rebasing all buckets
+    // on them, which would take all entries. They are lower than any
+    // other key anyway
+    if (entry.idx < last_) {
+      entry.idx = last_;
+    }
+    link(key, entry, radix(entry.idx));
+  }
+
+  // Move the lowest non-empty bucket to bucket 0 and the buckets in
+  // between, based at its minimum index
+  void pull() {
+    size_type r = 1;
+    while (heads_[r] == invalid_key) {
+      r++;
+      assert(r < kRadixCount);
+    }
+
+    auto min_idx = std::numeric_limits<uint32_t>::max();
+    for (auto key = heads_[r]; key != invalid_key;) {
+      const auto& entry = entries_.find(key)->second;
+      min_idx = std::min(min_idx, entry.idx);
+      key = entry.next;
+    }
+    last_ = min_idx;
+
+    auto key = heads_[r];
+    heads_[r] = invalid_key;
+    while (key != invalid_key) {
+      auto& entry = entries_.find(key)->second;
+      const auto next = entry.next;
+      link(key, entry, radix(entry.idx));
+      assert(entry.radix < r);
+      key = next;
+    }
+  }
+};
+
+
+// The priority queue used by LabelSet. Configure with
+// --enable-radix-queue to route with RadixQueue
+#ifdef MMP_RADIX_QUEUE
+template<typename key_t, key_t invalid_key>
+using RoutingQueue = RadixQueue<key_t, invalid_key>;
+#else
+template<typename key_t, key_t invalid_key>
+using RoutingQueue = BucketQueue<key_t, invalid_key>;
+#endif
+
+
 struct Label
 {
   Label() = delete;
@@ -274,10 +522,16 @@ struct Status
 };
 
 
+// A resumable label set keeps its settled labels and its frontier
+// after a search, so that a later search from the same origin (and
+// towards the same measurement) can continue from where the previous
+// one stopped instead of starting over
 class LabelSet
 {
  public:
-  LabelSet(typename BucketQueue<uint32_t, kInvalidLabelIndex>::size_type count, float size = 1.f);
+  using size_type = typename RoutingQueue<uint32_t, kInvalidLabelIndex>::size_type;
+
+  LabelSet(size_type count, float size = 1.f, bool resumable = false);
 
   bool put(const baldr::GraphId& nodeid, sif::TravelMode travelmode,
            std::shared_ptr<const sif::EdgeLabel> edgelabel);
@@ -320,14 +574,86 @@ class LabelSet
     dest_status_.clear();
   }
 
+  bool resumable() const
+  { return resumable_; }
+
+  // Number of labels popped (settled) from the queue so far
+  size_t settled_count() const
+  { return settled_count_; }
+
+  // Whether any label has been put since the status was cleared
+  bool has_status() const
+  { return !node_status_.empty() || !dest_status_.empty(); }
+
+  const Status* node_status(const baldr::GraphId& nodeid) const;
+
+  const Status* dest_status(uint16_t dest) const;
+
+  // Raise the cost limit. Labels whose successors were rejected by
+  // the old limit get suspended for expanding again
+  void set_bucket_count(size_type count);
+
+  // Remember a settled label whose successors are not (all) in the
+  // queue yet. It is ignored unless the label set is resumable
+  void suspend(uint32_t label_idx);
+
+  // Give back all suspended labels and forget them
+  std::vector<uint32_t> release_suspended();
+
  private:
-  BucketQueue<uint32_t, kInvalidLabelIndex> queue_;
+  RoutingQueue<uint32_t, kInvalidLabelIndex> queue_;
   std::unordered_map<baldr::GraphId, Status> node_status_;
   std::unordered_map<uint16_t, Status> dest_status_;
   std::vector<Label> labels_;
+
+  bool resumable_;
+
+  size_t settled_count_;
+
+  // Labels that had successors rejected since the queue was full
+  std::unordered_set<uint32_t> overflowed_;
+
+  // Settled labels to expand when the search is resumed
+  std::unordered_set<uint32_t> suspended_;
 };
 
 
+// Costings' verdicts on whether edges are allowed regardless of their
+// predecessors, cached in a bitset per tile and travel mode. The
+// verdicts only depend on edge attributes so they can be shared among
+// routes
+class EdgeAccessCache
+{
+ public:
+  bool Allowed(const sif::DynamicCost& costing,
+               const baldr::DirectedEdge* edge,
+               const baldr::GraphId& edgeid,
+               const baldr::GraphTile* tile);
+
+  // Whether the costing still has to check an edge allowed here from
+  // the actual predecessor: turn restrictions, u-turns and entering
+  // destination-only edges depend on it
+  static bool DependsOnPredecessor(const baldr::DirectedEdge* edge,
+                                   const sif::EdgeLabel& pred);
+
+  std::unordered_map<uint64_t, std::vector<bool>>::size_type
+  size() const
+  { return bits_.size(); }
+
+  void Clear()
+  { bits_.clear(); }
+
+ private:
+  // Two bits for each edge: whether the verdict is known, and the
+  // verdict itself
+  std::unordered_map<uint64_t, std::vector<bool>> bits_;
+};
+
+
+// If the label set is resumable and has been searched before, the
+// search resumes from its frontier. In that case destinations must
+// keep the indexes they had in the previous searches (new ones can be
+// appended), and approximator and search radius must not change
 std::unordered_map<uint16_t, uint32_t>
 find_shortest_path(baldr::GraphReader& reader,
                    const std::vector<baldr::PathLocation>& destinations,
@@ -337,7 +663,166 @@ find_shortest_path(baldr::GraphReader& reader,
                    float search_radius,
                    sif::cost_ptr_t costing = nullptr,
                    std::shared_ptr<const sif::EdgeLabel> edgelabel = nullptr,
-                   const float turn_cost_table[181] = nullptr);
+                   const float turn_cost_table[181] = nullptr,
+                   EdgeAccessCache* access_cache = nullptr,
+                   ShapeCache* shape_cache = nullptr);
+
+
+// A step of a route path, copied from its label without the
+// predecessor and the edge label
+struct RouteStep
+{
+  baldr::GraphId nodeid;
+
+  baldr::GraphId edgeid;
+
+  float source;
+  float target;
+
+  float cost;
+
+  float turn_cost;
+};
+
+
+// Where a route path is stored in a RouteArena
+struct RoutePath
+{
+  uint32_t offset;
+
+  // Number of steps (0 if the destination is not reachable)
+  uint32_t size;
+
+  // The edge label of the destination label, which is needed for
+  // routing further from the destination
+  std::shared_ptr<const sif::EdgeLabel> edgelabel;
+};
+
+
+// Route paths copied out of many label sets, so that a label set can
+// be released once its search is done. Paths are stored from the
+// destination back to the origin, in the order RoutePathIterator
+// walks them. Appending is thread-safe
+class RouteArena
+{
+ public:
+  using size_type = std::vector<RouteStep>::size_type;
+
+  // Copy the path that ends at the label
+  RoutePath Append(const LabelSet& labelset, uint32_t label_idx);
+
+  const RouteStep& step(uint32_t idx) const
+  { return steps_[idx]; }
+
+  size_type size() const
+  { return steps_.size(); }
+
+  void Clear()
+  { steps_.clear(); }
+
+ private:
+  std::vector<RouteStep> steps_;
+
+  std::mutex mutex_;
+};
+
+
+// Iterate the steps of a route path in a RouteArena
+class RouteStepIterator:
+      public std::iterator<std::forward_iterator_tag, const RouteStep>
+{
+ public:
+  RouteStepIterator(const RouteArena* arena,
+                    const RoutePath& path)
+      : arena_(arena),
+        idx_(path.offset),
+        remaining_(path.size) {}
+
+  // Construct a tail iterator
+  RouteStepIterator()
+      : arena_(nullptr),
+        idx_(0),
+        remaining_(0) {}
+
+  // Postfix increment
+  RouteStepIterator operator++(int)
+  {
+    auto clone = *this;
+    ++(*this);
+    return clone;
+  }
+
+  // Prefix increment
+  RouteStepIterator& operator++()
+  {
+    if (remaining_) {
+      idx_++;
+      remaining_--;
+    }
+    return *this;
+  }
+
+  // All tail iterators are equal
+  bool operator==(const RouteStepIterator& other) const
+  {
+    return remaining_ == other.remaining_
+        && (!remaining_ || (arena_ == other.arena_ && idx_ == other.idx_));
+  }
+
+  bool operator!=(const RouteStepIterator& other) const
+  { return !(*this == other); }
+
+  reference operator*() const
+  { return arena_->step(idx_); }
+
+  pointer operator->() const
+  { return &(arena_->step(idx_)); }
+
+ private:
+  const RouteArena* arena_;
+  uint32_t idx_;
+  uint32_t remaining_;
+};
+
+
+// Worker threads for running many searches at once (e.g. from all
+// states of a column). GraphReader caches tiles without locking, so
+// each worker reads tiles through its own GraphReader, and keeps its
+// own EdgeAccessCache and ShapeCache likewise. Labels found by a worker point into
+// tiles of its reader, so clear caches only between searches
+class RoutePool
+{
+ public:
+  using task_t = std::function<void(baldr::GraphReader&, EdgeAccessCache&, ShapeCache&)>;
+
+  RoutePool(const boost::property_tree::ptree& mjolnir_config, size_t thread_count);
+
+  size_t size() const
+  { return pool_.size(); }
+
+  // Run the tasks on the workers and wait until all of them are
+  // done. The first exception thrown by a task is rethrown
+  void Run(const std::vector<task_t>& tasks);
+
+  // Clear workers' caches that go beyond their limits
+  void ClearFullCache();
+
+  void ClearCache();
+
+  // Summed over the workers
+  ShapeCacheStats shape_cache_stats() const;
+
+  void ResetShapeCacheStats();
+
+ private:
+  std::vector<std::unique_ptr<baldr::GraphReader>> graphreaders_;
+
+  std::vector<EdgeAccessCache> access_caches_;
+
+  std::vector<ShapeCache> shape_caches_;
+
+  ThreadPool pool_;
+};
 
 
 class RoutePathIterator:
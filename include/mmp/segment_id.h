@@ -0,0 +1,71 @@
+// -*- mode: c++ -*-
+#ifndef MMP_SEGMENT_ID_H_
+#define MMP_SEGMENT_ID_H_
+
+#include <cstdint>
+#include <functional>
+
+#include <valhalla/baldr/graphid.h>
+
+
+namespace mmp {
+
+using namespace valhalla;
+
+
+// A line segment of an edge's shape packed in 64 bits: the edge id
+// (which takes 46 bits of a GraphId) in the upper bits and the index
+// of the segment in the lower bits, so that segments of the same
+// edge are sorted together
+class SegmentId
+{
+ public:
+  static constexpr uint32_t kIndexBits = 18;
+
+  // Segments at and after this index of a long shape share it
+  static constexpr uint32_t kMaxIndex = (1 << kIndexBits) - 1;
+
+  SegmentId() : value_(0) {}
+
+  SegmentId(baldr::GraphId edgeid, uint32_t index)
+      : value_((static_cast<uint64_t>(edgeid) << kIndexBits)
+               | (index < kMaxIndex? index : kMaxIndex)) {}
+
+  baldr::GraphId edgeid() const
+  { return baldr::GraphId(value_ >> kIndexBits); }
+
+  uint32_t index() const
+  { return value_ & kMaxIndex; }
+
+  uint64_t value() const
+  { return value_; }
+
+  bool operator==(const SegmentId& rhs) const
+  { return value_ == rhs.value_; }
+
+  bool operator!=(const SegmentId& rhs) const
+  { return value_ != rhs.value_; }
+
+  bool operator<(const SegmentId& rhs) const
+  { return value_ < rhs.value_; }
+
+ private:
+  uint64_t value_;
+};
+
+}
+
+
+namespace std {
+
+template <>
+struct hash<mmp::SegmentId>
+{
+  size_t operator()(const mmp::SegmentId& segment) const
+  { return hash<uint64_t>()(segment.value()); }
+};
+
+}
+
+
+#endif // MMP_SEGMENT_ID_H_
@@ -0,0 +1,122 @@
+// -*- mode: c++ -*-
+#ifndef MMP_SHAPE_CACHE_H_
+#define MMP_SHAPE_CACHE_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <valhalla/midgard/pointll.h>
+#include <valhalla/baldr/directededge.h>
+#include <valhalla/baldr/graphtile.h>
+
+
+namespace mmp {
+
+using namespace valhalla;
+
+
+struct ShapeCacheStats
+{
+  // Shapes found in the cache
+  size_t hits = 0;
+
+  // Shapes decoded from edge infos
+  size_t decodes = 0;
+
+  ShapeCacheStats& operator+=(const ShapeCacheStats& other)
+  {
+    hits += other.hits;
+    decodes += other.decodes;
+    return *this;
+  }
+};
+
+
+// Decoded edge shapes, kept per tile by edge info offsets (an edge
+// and its opposite share one). Shapes of a tile are dropped once the
+// graph reader hands out another object of the tile, so that they
+// never outlive the tile they are decoded from, and the tiles cached
+// first are dropped once more than max_size shapes are kept. It's
+// meant to be used along with one GraphReader, and is not thread-safe
+// either
+class ShapeCache
+{
+ public:
+  // Shapes stay valid as long as they are held, even if evicted
+  using Shape = std::shared_ptr<const std::vector<midgard::PointLL>>;
+
+  static constexpr size_t kDefaultMaxSize = 1 << 16;
+
+  explicit ShapeCache(size_t max_size = kDefaultMaxSize);
+
+  // The shape of the edge, which must be in the tile
+  Shape Get(const baldr::GraphTile* tile, const baldr::DirectedEdge* edge);
+
+  // Number of cached shapes
+  size_t size() const
+  { return size_; }
+
+  size_t max_size() const
+  { return max_size_; }
+
+  // Evict tiles right away if they don't fit
+  void set_max_size(size_t max_size);
+
+  const ShapeCacheStats& stats() const
+  { return stats_; }
+
+  void ResetStats()
+  { stats_ = ShapeCacheStats(); }
+
+  void Clear();
+
+ private:
+  struct TileShapes
+  {
+    const baldr::GraphTile* tile;
+
+    std::unordered_map<uint32_t, Shape> shapes;
+  };
+
+  // Drop the tiles cached first (but the kept one) until the shapes
+  // fit in max_size_
+  void Evict(uint32_t keep);
+
+  size_t max_size_;
+
+  size_t size_;
+
+  // Keyed by tile ids and levels
+  std::unordered_map<uint32_t, TileShapes> tiles_;
+
+  // Keys of the tiles in the order they are cached
+  std::deque<uint32_t> order_;
+
+  ShapeCacheStats stats_;
+};
+
+
+namespace helpers {
+
+// Get the shape from the cache, or decode it if there is no cache
+inline ShapeCache::Shape
+edge_shape(const baldr::GraphTile* tile,
+           const baldr::DirectedEdge* edge,
+           ShapeCache* cache)
+{
+  if (cache) {
+    return cache->Get(tile, edge);
+  }
+  const auto edgeinfo = tile->edgeinfo(edge->edgeinfo_offset());
+  return std::make_shared<const std::vector<midgard::PointLL>>(edgeinfo->shape());
+}
+
+}
+
+}
+
+
+#endif // MMP_SHAPE_CACHE_H_
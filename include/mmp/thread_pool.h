@@ -0,0 +1,56 @@
+// -*- mode: c++ -*-
+#ifndef MMP_THREAD_POOL_H_
+#define MMP_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+namespace mmp {
+
+// A fixed number of worker threads that run submitted tasks in FIFO
+// order. Each task is given the index of the worker that runs it, so
+// that callers can keep per-worker resources that aren't thread-safe
+class ThreadPool
+{
+ public:
+  using task_t = std::function<void(size_t)>;
+
+  explicit ThreadPool(size_t count);
+
+  // Finish all queued tasks and join the workers
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t size() const
+  { return workers_.size(); }
+
+  // Queue a task; the future rethrows whatever the task throws
+  std::future<void> Submit(task_t task);
+
+ private:
+  std::vector<std::thread> workers_;
+
+  std::queue<std::packaged_task<void(size_t)>> tasks_;
+
+  std::mutex mutex_;
+
+  std::condition_variable condition_;
+
+  bool stopped_;
+
+  void work(size_t worker);
+};
+
+}
+
+
+#endif // MMP_THREAD_POOL_H_
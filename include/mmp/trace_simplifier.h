@@ -0,0 +1,89 @@
+// -*- mode: c++ -*-
+#ifndef MMP_TRACE_SIMPLIFIER_H_
+#define MMP_TRACE_SIMPLIFIER_H_
+
+#include <memory>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <valhalla/midgard/pointll.h>
+
+
+namespace mmp {
+
+using namespace valhalla;
+
+
+// Decide which locations of a trace are matched as states (columns
+// of the Viterbi search) before candidates are searched. The others
+// are interpolated into the route matched between them
+class TraceSimplifier
+{
+ public:
+  virtual ~TraceSimplifier() {}
+
+  // Indexes of the locations to match in ascending order. The first
+  // and the last location are always matched
+  virtual std::vector<size_t>
+  Simplify(const std::vector<midgard::PointLL>& locations) const = 0;
+};
+
+
+// Match a location if it's at least min_distance (in meters) away
+// from the last matched one
+class DistanceSimplifier: public TraceSimplifier
+{
+ public:
+  explicit DistanceSimplifier(float min_distance);
+
+  std::vector<size_t>
+  Simplify(const std::vector<midgard::PointLL>& locations) const override;
+
+ private:
+  float min_distance_;
+};
+
+
+// Douglas-Peucker simplification of the locations picked by distance
+// as above: a location is matched if it's farther than tolerance (in
+// meters) from the line between the locations matched around it, so
+// that straight runs collapse to their ends while turns are kept.
+// Runs longer than max_distance (in meters) are still split in the
+// middle, to keep routes between states short
+class DouglasPeuckerSimplifier: public TraceSimplifier
+{
+ public:
+  DouglasPeuckerSimplifier(float tolerance, float min_distance, float max_distance);
+
+  std::vector<size_t>
+  Simplify(const std::vector<midgard::PointLL>& locations) const override;
+
+ private:
+  float tolerance_;
+
+  DistanceSimplifier decimator_;
+
+  float max_distance_;
+};
+
+
+// Simplify the locations with the simplifier, and check that it keeps
+// its contract: the indexes are ascending and unique, and include the
+// first and the last location. Throw std::logic_error otherwise
+std::vector<size_t>
+simplify_trace(const TraceSimplifier& simplifier,
+               const std::vector<midgard::PointLL>& locations);
+
+
+// Create the simplifier named by "simplification" in a (mode merged)
+// matcher configuration: "distance" (the default) or
+// "douglas_peucker", whose tolerance is "simplification_tolerance"
+// times sigma_z
+std::unique_ptr<TraceSimplifier>
+create_trace_simplifier(const boost::property_tree::ptree& config);
+
+}
+
+
+#endif // MMP_TRACE_SIMPLIFIER_H_
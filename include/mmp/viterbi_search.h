@@ -465,6 +465,10 @@ class ViterbiSearch: public IViterbiSearch<T>
 
   std::vector<std::vector<const T*>> unreached_states_;
 
+  // Whether the state is waiting in the queue to be scanned. If so,
+  // predecessor is set to the predecessor of its best label so far
+  bool IsQueued(StateId id, StateId& predecessor) const;
+
   virtual float TransitionCost(const T& left, const T& right) const override = 0;
 
   virtual float EmissionCost(const T& state) const override = 0;
@@ -539,6 +543,19 @@ ViterbiSearch<T>::predecessor(StateId id) const
 }
 
 
+template <typename T>
+bool
+ViterbiSearch<T>::IsQueued(StateId id, StateId& predecessor) const
+{
+  const auto label = queue_.find(id);
+  if (label) {
+    predecessor = label->predecessor? label->predecessor->id() : kInvalidStateId;
+    return true;
+  }
+  return false;
+}
+
+
 template <typename T>
 inline bool
 ViterbiSearch<T>::IsInvalidCost(double cost) const
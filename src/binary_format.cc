@@ -0,0 +1,472 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <valhalla/midgard/distanceapproximator.h>
+
+#include "mmp/binary_format.h"
+#include "mmp/geometry_helpers.h"
+#include "mmp/graph_helpers.h"
+#include "mmp/shape_cache.h"
+
+using namespace valhalla;
+
+
+namespace {
+
+constexpr size_t kAlignment = 8;
+
+constexpr double kFixedPointScale = 1e7;
+
+// As GeoJSON accuracies are clamped
+constexpr float kMinAccuracy = 0.01f;
+
+constexpr uint32_t kTraceFlags = mmp::kHasTimes | mmp::kHasAccuracies | mmp::kHasHeadings | mmp::kFixedPoint;
+
+static_assert(sizeof(mmp::BinaryFileHeader) % kAlignment == 0, "Records are expected to be aligned");
+static_assert(sizeof(mmp::BinaryRecordHeader) % kAlignment == 0, "Columns are expected to be aligned");
+
+
+inline size_t Padded(size_t size)
+{ return (size + kAlignment - 1) / kAlignment * kAlignment; }
+
+
+template <typename T>
+void AppendColumn(std::string& out, const std::vector<T>& column)
+{
+  out.append(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(T));
+}
+
+
+// Reserve the record header, and fill it in once the columns are
+// appended
+class RecordAppender
+{
+ public:
+  RecordAppender(std::string& out, uint32_t count, uint32_t flags)
+      : out_(out), start_(out.size())
+  {
+    const mmp::BinaryRecordHeader header{0, count, flags};
+    out_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+
+  ~RecordAppender()
+  {
+    out_.append(Padded(out_.size() - start_) - (out_.size() - start_), '\0');
+    const uint64_t length = out_.size() - start_;
+    std::memcpy(&out_[start_], &length, sizeof(length));
+  }
+
+ private:
+  std::string& out_;
+
+  size_t start_;
+};
+
+
+// Column views into a record, in the order of the columns
+class ColumnReader
+{
+ public:
+  ColumnReader(const char* data, size_t length)
+      : data_(data), end_(data + length) {}
+
+  template <typename T>
+  const T* Next(size_t count)
+  {
+    if (static_cast<size_t>(end_ - data_) < count * sizeof(T)) {
+      throw std::runtime_error("Invalid binary record: columns go beyond its length");
+    }
+    const auto column = reinterpret_cast<const T*>(data_);
+    data_ += count * sizeof(T);
+    return column;
+  }
+
+ private:
+  const char* data_;
+
+  const char* end_;
+};
+
+
+const mmp::BinaryRecordHeader&
+ReadRecordHeader(const char* data, size_t length)
+{
+  if (length < sizeof(mmp::BinaryRecordHeader)) {
+    throw std::runtime_error("Invalid binary record: truncated header");
+  }
+  const auto& header = *reinterpret_cast<const mmp::BinaryRecordHeader*>(data);
+  if (header.length < sizeof(header) || header.length % kAlignment || header.length > length) {
+    throw std::runtime_error("Invalid binary record: length " + std::to_string(header.length)
+                             + " out of " + std::to_string(length) + " bytes");
+  }
+  return header;
+}
+
+
+// Whether the optional value is known (not negative, as in
+// Measurement). Known values must be in [0, max) as those of GeoJSON
+// properties are, which rules out NaNs too
+template <typename T>
+bool Known(T value, double max, const char* column, size_t idx)
+{
+  if (value < 0) {
+    return false;
+  }
+  if (!(value < max)) {
+    throw std::runtime_error(std::string("Invalid binary trace: ") + column + " at "
+                             + std::to_string(idx) + " is not a number in the range");
+  }
+  return true;
+}
+
+
+// Offset of the result along its edge, or negative if unknown
+float ResultOffset(const mmp::MatchResult& result, const mmp::MapMatching& mm)
+{
+  if (result.graphtype() != mmp::GraphType::kEdge) {
+    return -1.f;
+  }
+
+  if (result.state()) {
+    for (const auto& edge : result.state()->candidate().edges()) {
+      if (edge.id == result.graphid()) {
+        return edge.dist;
+      }
+    }
+  }
+
+  // Interpolated ones are located on the shape
+  const auto tile = mm.graphreader().GetGraphTile(result.graphid());
+  if (!tile) {
+    return -1.f;
+  }
+  const auto edge = tile->directededge(result.graphid());
+  const auto shape = mmp::helpers::edge_shape(tile, edge, mm.shape_cache());
+  if (shape->empty()) {
+    return -1.f;
+  }
+  float offset;
+  std::tie(std::ignore, std::ignore, std::ignore, offset)
+      = mmp::helpers::Project(result.lnglat(), *shape, midgard::DistanceApproximator(result.lnglat()));
+  // As the offsets of states, along the directed edge
+  return mmp::helpers::edge_offset(edge, offset);
+}
+
+}
+
+
+namespace mmp {
+
+void AppendBinaryHeader(std::string& out, const char (&magic)[8])
+{
+  BinaryFileHeader header{};
+  std::copy(magic, magic + sizeof(header.magic), header.magic);
+  header.version = kBinaryFormatVersion;
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+
+void AppendBinaryTrace(std::string& out,
+                       const std::vector<Measurement>& trace,
+                       bool fixed_point)
+{
+  uint32_t flags = fixed_point? kFixedPoint : 0;
+  for (const auto& measurement : trace) {
+    flags |= (measurement.has_time()? kHasTimes : 0)
+             | (measurement.has_accuracy()? kHasAccuracies : 0)
+             | (measurement.has_heading()? kHasHeadings : 0);
+  }
+
+  RecordAppender record(out, trace.size(), flags);
+
+  if (fixed_point) {
+    std::vector<int32_t> coordinates;
+    coordinates.reserve(trace.size() * 2);
+    for (const auto& measurement : trace) {
+      coordinates.push_back(std::round(measurement.lnglat().lng() * kFixedPointScale));
+      coordinates.push_back(std::round(measurement.lnglat().lat() * kFixedPointScale));
+    }
+    AppendColumn(out, coordinates);
+  } else {
+    std::vector<float> coordinates;
+    coordinates.reserve(trace.size() * 2);
+    for (const auto& measurement : trace) {
+      coordinates.push_back(measurement.lnglat().lng());
+      coordinates.push_back(measurement.lnglat().lat());
+    }
+    AppendColumn(out, coordinates);
+  }
+
+  if (flags & kHasTimes) {
+    std::vector<double> times;
+    times.reserve(trace.size());
+    for (const auto& measurement : trace) {
+      times.push_back(measurement.time());
+    }
+    AppendColumn(out, times);
+  }
+
+  std::vector<float> column;
+  column.reserve(trace.size());
+  if (flags & kHasAccuracies) {
+    for (const auto& measurement : trace) {
+      column.push_back(measurement.accuracy());
+    }
+    AppendColumn(out, column);
+  }
+  if (flags & kHasHeadings) {
+    column.clear();
+    for (const auto& measurement : trace) {
+      column.push_back(measurement.heading());
+    }
+    AppendColumn(out, column);
+  }
+}
+
+
+void AppendBinaryResults(std::string& out,
+                         const std::vector<MatchResult>& results,
+                         const MapMatching* mm)
+{
+  RecordAppender record(out, results.size(), 0);
+
+  std::vector<float> floats;
+  floats.reserve(results.size() * 2);
+  for (const auto& result : results) {
+    floats.push_back(result.lnglat().lng());
+    floats.push_back(result.lnglat().lat());
+  }
+  AppendColumn(out, floats);
+
+  std::vector<uint64_t> graphids;
+  graphids.reserve(results.size());
+  for (const auto& result : results) {
+    graphids.push_back(result.graphid().value);
+  }
+  AppendColumn(out, graphids);
+
+  floats.clear();
+  for (const auto& result : results) {
+    floats.push_back(result.distance());
+  }
+  AppendColumn(out, floats);
+
+  floats.clear();
+  for (const auto& result : results) {
+    floats.push_back(mm? ResultOffset(result, *mm) : -1.f);
+  }
+  AppendColumn(out, floats);
+
+  std::vector<uint8_t> graphtypes;
+  graphtypes.reserve(results.size());
+  for (const auto& result : results) {
+    graphtypes.push_back(static_cast<uint8_t>(result.graphtype()));
+  }
+  AppendColumn(out, graphtypes);
+}
+
+
+void AppendBinaryError(std::string& out, const std::string& message)
+{
+  RecordAppender record(out, message.size(), kError);
+  out.append(message);
+}
+
+
+size_t ReadBinaryHeader(const char* data, size_t length, const char (&magic)[8])
+{
+  if (length < sizeof(BinaryFileHeader)) {
+    throw std::runtime_error("Invalid binary file: truncated header");
+  }
+  const auto& header = *reinterpret_cast<const BinaryFileHeader*>(data);
+  if (std::memcmp(header.magic, magic, sizeof(header.magic))) {
+    throw std::runtime_error(std::string("Invalid binary file: expect ") + magic);
+  }
+  if (header.version != kBinaryFormatVersion) {
+    throw std::runtime_error("Invalid binary file: unsupported version " + std::to_string(header.version));
+  }
+  return sizeof(header);
+}
+
+
+size_t ReadBinaryTrace(const char* data, size_t length, std::vector<Measurement>& trace)
+{
+  const auto& header = ReadRecordHeader(data, length);
+  if (header.flags & ~kTraceFlags) {
+    throw std::runtime_error("Invalid binary trace: unknown flags " + std::to_string(header.flags));
+  }
+
+  const size_t count = header.count;
+  ColumnReader columns(data + sizeof(header), header.length - sizeof(header));
+  trace.clear();
+  trace.reserve(count);
+  if (header.flags & kFixedPoint) {
+    const auto coordinates = columns.Next<int32_t>(count * 2);
+    for (size_t idx = 0; idx < count; idx++) {
+      trace.emplace_back(midgard::PointLL(coordinates[idx * 2] / kFixedPointScale,
+                                          coordinates[idx * 2 + 1] / kFixedPointScale));
+    }
+  } else {
+    const auto coordinates = columns.Next<float>(count * 2);
+    for (size_t idx = 0; idx < count; idx++) {
+      if (!std::isfinite(coordinates[idx * 2]) || !std::isfinite(coordinates[idx * 2 + 1])) {
+        throw std::runtime_error("Invalid binary trace: coordinate at " + std::to_string(idx) + " is not finite");
+      }
+      trace.emplace_back(midgard::PointLL(coordinates[idx * 2], coordinates[idx * 2 + 1]));
+    }
+  }
+
+  // Validate the optional columns as GeoJSON properties are
+  if (header.flags & kHasTimes) {
+    const auto times = columns.Next<double>(count);
+    double last_time = -1.0;
+    for (size_t idx = 0; idx < count; idx++) {
+      if (Known(times[idx], std::numeric_limits<double>::infinity(), "time", idx)) {
+        if (times[idx] < last_time) {
+          throw std::runtime_error("Invalid binary trace: time at " + std::to_string(idx)
+                                   + " is earlier than the previous one");
+        }
+        last_time = times[idx];
+        trace[idx].set_time(times[idx]);
+      }
+    }
+  }
+  if (header.flags & kHasAccuracies) {
+    const auto accuracies = columns.Next<float>(count);
+    for (size_t idx = 0; idx < count; idx++) {
+      if (Known(accuracies[idx], std::numeric_limits<double>::infinity(), "accuracy", idx)) {
+        // Zero accuracy would make emission costs infinite
+        trace[idx].set_accuracy(std::max(accuracies[idx], kMinAccuracy));
+      }
+    }
+  }
+  if (header.flags & kHasHeadings) {
+    const auto headings = columns.Next<float>(count);
+    for (size_t idx = 0; idx < count; idx++) {
+      if (Known(headings[idx], 360.0, "heading", idx)) {
+        trace[idx].set_heading(headings[idx]);
+      }
+    }
+  }
+
+  return header.length;
+}
+
+
+size_t ReadBinaryResults(const char* data, size_t length,
+                         std::vector<BinaryResult>& results, std::string& error)
+{
+  const auto& header = ReadRecordHeader(data, length);
+  if (header.flags & ~kError) {
+    throw std::runtime_error("Invalid binary results: unknown flags " + std::to_string(header.flags));
+  }
+
+  const size_t count = header.count;
+  ColumnReader columns(data + sizeof(header), header.length - sizeof(header));
+  results.clear();
+  error.clear();
+  if (header.flags & kError) {
+    error.assign(columns.Next<char>(count), count);
+    return header.length;
+  }
+
+  const auto coordinates = columns.Next<float>(count * 2);
+  const auto graphids = columns.Next<uint64_t>(count);
+  const auto distances = columns.Next<float>(count);
+  const auto offsets = columns.Next<float>(count);
+  const auto graphtypes = columns.Next<uint8_t>(count);
+  results.reserve(count);
+  for (size_t idx = 0; idx < count; idx++) {
+    if (graphtypes[idx] > static_cast<uint8_t>(GraphType::kNode)) {
+      throw std::runtime_error("Invalid binary results: unknown graph type at " + std::to_string(idx));
+    }
+    results.push_back({midgard::PointLL(coordinates[idx * 2], coordinates[idx * 2 + 1]),
+                       baldr::GraphId(graphids[idx]),
+                       distances[idx],
+                       offsets[idx],
+                       static_cast<GraphType>(graphtypes[idx])});
+  }
+
+  return header.length;
+}
+
+
+bool ReadBinaryTrace(std::istream& in, std::string& buffer, std::vector<Measurement>& trace)
+{
+  BinaryRecordHeader header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    if (in.gcount() == 0) {
+      return false;
+    }
+    throw std::runtime_error("Invalid binary record: truncated header");
+  }
+  // Check the length before allocating for it
+  if (header.length < sizeof(header) || header.length % kAlignment || header.length > kMaxBinaryRecordLength) {
+    throw std::runtime_error("Invalid binary record: length " + std::to_string(header.length));
+  }
+
+  buffer.resize(header.length);
+  std::memcpy(&buffer[0], &header, sizeof(header));
+  if (!in.read(&buffer[sizeof(header)], header.length - sizeof(header))) {
+    throw std::runtime_error("Invalid binary record: truncated columns");
+  }
+
+  ReadBinaryTrace(buffer.data(), buffer.size(), trace);
+  return true;
+}
+
+
+BinaryTraceFile::BinaryTraceFile(const std::string& path)
+    : mapping_(),
+      length_(0),
+      position_(0)
+{
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open binary traces " + path);
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) < 0 || static_cast<size_t>(status.st_size) < sizeof(BinaryFileHeader)) {
+    close(fd);
+    throw std::runtime_error("Invalid binary traces " + path);
+  }
+  length_ = status.st_size;
+
+  void* address = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    throw std::runtime_error("Failed to map binary traces " + path);
+  }
+  const auto length = length_;
+  mapping_.reset(static_cast<const char*>(address), [length](const char* data) {
+      munmap(const_cast<char*>(data), length);
+    });
+
+  position_ = ReadBinaryHeader(mapping_.get(), length_, kBinaryTraceMagic);
+}
+
+
+BinaryTraceFile::~BinaryTraceFile() {}
+
+
+bool
+BinaryTraceFile::Next(std::vector<Measurement>& trace)
+{
+  if (position_ >= length_) {
+    return false;
+  }
+  position_ += ReadBinaryTrace(mapping_.get() + position_, length_ - position_, trace);
+  return true;
+}
+
+}
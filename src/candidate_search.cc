@@ -3,140 +3,274 @@
 using namespace valhalla;
 
 
-namespace mmp {
+namespace {
 
+// Bulk queries don't split locations into smaller tasks than this
+constexpr size_t kMinBulkChunkSize = 64;
 
-std::vector<Candidate>
-CandidateQuery::Query(const midgard::PointLL& location,
-                      float sq_search_radius,
-                      sif::EdgeFilter filter) const
+
+// Keep the reader pinned in the scope
+class PinGuard
 {
-  const baldr::GraphTile* tile = reader_.GetGraphTile(location);
-  if (tile && tile->header()->directededgecount() > 0) {
-    // TODO it doesn't work since it is not the right to increase
-    // graphids :(
-    const auto edgeid_begin = boost::counting_iterator<uint64_t>(tile->id()),
-                 edgeid_end = boost::counting_iterator<uint64_t>(static_cast<uint64_t>(tile->id())
-                                                                 + tile->header()->directededgecount());
-    return WithinSquaredDistance(location, sq_search_radius,
-                                 edgeid_begin, edgeid_end, filter, true);
-  }
-  return {};
+ public:
+  PinGuard(const mmp::GridCache& cache, mmp::GridCache::Reader* reader)
+      : cache_(cache), reader_(reader)
+  { cache_.Pin(reader_); }
+
+  ~PinGuard()
+  { cache_.Unpin(reader_); }
+
+ private:
+  const mmp::GridCache& cache_;
+
+  mmp::GridCache::Reader* reader_;
+};
+
+
+// Whether the range is strictly inside the bounding box
+template <typename range_t, typename bbox_t>
+inline bool Inside(const range_t& range, const bbox_t& bbox)
+{
+  return bbox.minx() < range.minx() && range.maxx() < bbox.maxx()
+      && bbox.miny() < range.miny() && range.maxy() < bbox.maxy();
 }
 
 
-std::vector<std::vector<Candidate>>
-CandidateQuery::QueryBulk(const std::vector<midgard::PointLL>& locations,
-                          float radius,
-                          sif::EdgeFilter filter)
+// Whether the directed edge heads within the heading filter at the
+// segment of its shape (shapes go along edges that are forward)
+inline bool HeadingAllowed(const mmp::HeadingFilter& heading_filter,
+                           const baldr::DirectedEdge* edge,
+                           const std::vector<midgard::PointLL>& shape,
+                           size_t segment)
 {
-  std::vector<std::vector<Candidate>> results;
-  results.reserve(locations.size());
-  for (const auto& location : locations) {
-    results.push_back(Query(location, radius, filter));
+  if (!heading_filter.enabled() || segment + 1 >= shape.size() || shape[segment] == shape[segment + 1]) {
+    return true;
   }
-  return results;
+  const float heading = shape[segment].Heading(shape[segment + 1]);
+  return heading_filter.Allowed(edge->forward()? heading : heading + 180.f);
 }
 
 
-template <typename edgeid_iterator_t>
-std::vector<Candidate>
-CandidateQuery::WithinSquaredDistance(const midgard::PointLL& location,
-                                      float sq_search_radius,
-                                      edgeid_iterator_t edgeid_begin,
-                                      edgeid_iterator_t edgeid_end,
-                                      sif::EdgeFilter filter,
-                                      bool directed) const
+// Correlate the edge and its opposite edge (those not filtered out)
+// with the projection of the location, and add it to the candidates.
+// Projections that snap to a node already added are merged into its
+// candidate, so that each node is one candidate with all its edges
+void AddCandidate(const midgard::PointLL& location,
+                  float sq_search_radius,
+                  const midgard::PointLL& point,
+                  float sq_distance,
+                  float offset,
+                  baldr::GraphId edgeid,
+                  const baldr::DirectedEdge* edge,
+                  bool edge_included,
+                  baldr::GraphId opp_edgeid,
+                  const baldr::DirectedEdge* opp_edge,
+                  bool opp_edge_included,
+                  std::unordered_map<baldr::GraphId, size_t>& node_candidates,
+                  std::vector<mmp::Candidate>& candidates)
 {
-  std::vector<Candidate> candidates;
-  std::unordered_set<baldr::GraphId> visited_nodes, visited_edges;
-  DistanceApproximator approximator(location);
-  const baldr::GraphTile* tile = nullptr;
+  if (sq_distance > sq_search_radius) {
+    return;
+  }
 
-  for (auto it = edgeid_begin; it != edgeid_end; it++) {
-    // Do a explict cast here as the iterator is probably of type
-    // uint64_t
-    const auto edgeid = static_cast<baldr::GraphId>(*it);
-    if (!edgeid.Is_Valid()) continue;
+  baldr::GraphId snapped_node;
+  mmp::Candidate correlated(baldr::Location(location, baldr::Location::StopType::BREAK));
 
-    // Skip if it's visited
-    if (directed) {
-      if (!visited_edges.insert(edgeid).second) continue;
+  if (edge_included) {
+    const float dist = mmp::helpers::edge_offset(edge, offset);
+    if (dist == 1.f) {
+      snapped_node = edge->endnode();
+    } else if (dist == 0.f) {
+      snapped_node = opp_edge->endnode();
     }
+    correlated.CorrelateEdge(mmp::Candidate::PathEdge(edgeid, dist));
+    correlated.CorrelateVertex(point);
+  }
 
-    const auto opp_edgeid = helpers::edge_opp_edgeid(reader_, edgeid, tile);
-    if (!opp_edgeid.Is_Valid()) continue;
-    const auto opp_edge = tile->directededge(opp_edgeid);
-    assert(opp_edge);
-    // Make sure it's the last one since we need the tile of this edge
-    const auto edge = helpers::edge_directededge(reader_, edgeid, tile);
-    if (!edge) continue;
-
-    if (directed) {
-      visited_edges.insert(opp_edgeid);
+  // Correlate its opp edge
+  if (opp_edge_included) {
+    const float dist = mmp::helpers::edge_offset(opp_edge, offset);
+    if (dist == 1.f) {
+      snapped_node = opp_edge->endnode();
+    } else if (dist == 0.f) {
+      snapped_node = edge->endnode();
     }
+    correlated.CorrelateEdge(mmp::Candidate::PathEdge(opp_edgeid, dist));
+    correlated.CorrelateVertex(point);
+  }
 
-    // NOTE a pointer to edgeinfo is needed here because it returns
-    // an unique ptr
-    const auto edgeinfo = tile->edgeinfo(edge->edgeinfo_offset());
-    const auto& shape = edgeinfo->shape();
-    if (shape.empty()) {
-      // Otherwise Project will fail
-      continue;
+  if (!correlated.IsCorrelated()) {
+    return;
+  }
+
+  correlated.set_sq_distance(sq_distance);
+  mmp::MergeNodeCandidate(correlated, snapped_node, node_candidates, candidates);
+}
+
+
+// Visit each road linestring's line segments of the tile by their
+// segment ids. Only one side of directed edges is visited
+template <typename visitor_t>
+void VisitTileSegments(const baldr::GraphTile& tile, visitor_t visit)
+{
+  auto edgecount = tile.header()->directededgecount();
+  if (edgecount <= 0) {
+    return;
+  }
+
+  std::unordered_set<uint32_t> visited(edgecount);
+  auto edgeid = tile.header()->graphid();
+  auto directededge = tile.directededge(0);
+  for (size_t idx = 0; idx < edgecount; edgeid++, directededge++, idx++) {
+    const auto offset = directededge->edgeinfo_offset();
+    if (visited.insert(offset).second) {
+      const auto edgeinfo = tile.edgeinfo(offset);
+      const auto& shape = edgeinfo->shape();
+      for (decltype(shape.size()) j = 1; j < shape.size(); ++j) {
+        visit(mmp::SegmentId(edgeid, j - 1), mmp::LineSegment(shape[j - 1], shape[j]));
+      }
     }
+  }
+}
 
-    // Projection information
-    midgard::PointLL point;
-    float sq_distance = 0.f;
-    decltype(shape.size()) segment;
-    float offset;
+}
 
-    baldr::GraphId snapped_node;
-    Candidate correlated(baldr::Location(location, baldr::Location::StopType::BREAK));
 
-    // Flag for avoiding recomputing projection later
-    bool included = !filter || !filter(edge);
+namespace mmp {
 
-    if (included) {
-      std::tie(point, sq_distance, segment, offset) = helpers::Project(location, shape, approximator);
+void SnapToEnds(const midgard::PointLL& location,
+                float sq_search_radius,
+                float snap_distance,
+                const std::vector<midgard::PointLL>& shape,
+                float partial_length,
+                float total_length,
+                midgard::PointLL& point,
+                float& sq_distance,
+                float& offset)
+{
+  if (snap_distance <= 0.f || offset == 0.f || offset == 1.f) {
+    return;
+  }
 
-      if (sq_distance <= sq_search_radius) {
-        float dist = edge->forward()? offset : 1.f - offset;
-        if (dist == 1.f) {
-          snapped_node = edge->endnode();
-        } else if (dist == 0.f) {
-          snapped_node = opp_edge->endnode();
+  const bool to_front = partial_length <= snap_distance,
+              to_back = total_length - partial_length <= snap_distance;
+  if (!to_front && !to_back) {
+    return;
+  }
+
+  // The nearer end if both are
+  const bool front = to_front && (!to_back || partial_length <= total_length - partial_length);
+  const auto& end = front? shape.front() : shape.back();
+  const auto sq_end_distance = midgard::DistanceApproximator(location).DistanceSquared(end);
+  if (sq_end_distance <= sq_search_radius) {
+    point = end;
+    sq_distance = sq_end_distance;
+    offset = front? 0.f : 1.f;
+  }
+}
+
+
+void MergeNodeCandidate(const Candidate& candidate,
+                        const baldr::GraphId& snapped_node,
+                        std::unordered_map<baldr::GraphId, size_t>& node_candidates,
+                        std::vector<Candidate>& candidates)
+{
+  if (snapped_node.Is_Valid()) {
+    const auto inserted = node_candidates.emplace(snapped_node, candidates.size());
+    if (!inserted.second) {
+      // Add the edges to the node's candidate
+      auto& node_candidate = candidates[inserted.first->second];
+      for (const auto& edge : candidate.edges()) {
+        if (std::none_of(node_candidate.edges().begin(), node_candidate.edges().end(),
+                         [&edge](const Candidate::PathEdge& other) { return other.id == edge.id; })) {
+          node_candidate.CorrelateEdge(edge);
         }
-        correlated.CorrelateEdge(Candidate::PathEdge(edgeid, dist));
-        correlated.CorrelateVertex(point);
       }
+      return;
     }
+  }
+
+  candidates.push_back(candidate);
+}
+
 
-    // Correlate its opp edge
-    if (!filter || !filter(opp_edge)) {
-      if (!included) {
-        std::tie(point, sq_distance, segment, offset) = helpers::Project(location, shape, approximator);
+
+std::vector<Candidate>
+CandidateQuery::Query(const midgard::PointLL& location,
+                      float sq_search_radius,
+                      sif::EdgeFilter filter,
+                      const HeadingFilter& heading_filter) const
+{
+  const auto& local_level = reader_.GetTileHierarchy().levels().rbegin()->second;
+  const float radius = std::sqrt(sq_search_radius);
+  const DistanceApproximator approximator(location);
+
+  std::vector<Candidate> candidates;
+  // Opposite edges in other tiles of visited edges
+  std::unordered_set<baldr::GraphId> visited_edges;
+  std::unordered_map<baldr::GraphId, size_t> node_candidates;
+  for (const auto tileid : local_level.tiles.TileList(helpers::ExpandMeters(location, radius))) {
+    const auto tile = reader_.GetGraphTile(baldr::GraphId(tileid, local_level.level, 0));
+    if (!tile || !tile->header()->directededgecount()) {
+      continue;
+    }
+
+    // Both edges of a road in the tile share one edge info, so decode
+    // shapes by edge info offsets once
+    const auto edgecount = tile->header()->directededgecount();
+    std::unordered_set<uint32_t> visited_offsets(edgecount);
+    auto edgeid = tile->header()->graphid();
+    auto edge = tile->directededge(0);
+    for (uint32_t idx = 0; idx < edgecount; idx++, edgeid++, edge++) {
+      if (!visited_offsets.insert(edge->edgeinfo_offset()).second
+          || visited_edges.erase(edgeid)) {
+        continue;
       }
 
-      if (sq_distance <= sq_search_radius) {
-        float dist = opp_edge->forward()? offset : 1.f - offset;
-        if (dist == 1.f) {
-          snapped_node = opp_edge->endnode();
-        } else if (dist == 0.f) {
-          snapped_node = edge->endnode();
-        }
-        correlated.CorrelateEdge(Candidate::PathEdge(opp_edgeid, dist));
-        correlated.CorrelateVertex(point);
+      const baldr::GraphTile* end_tile = tile;
+      const auto opp_edgeid = helpers::edge_opp_edgeid(reader_, edge, end_tile);
+      if (!opp_edgeid.Is_Valid()) continue;
+      const auto opp_edge = end_tile->directededge(opp_edgeid);
+      if (opp_edgeid.Tile_Base() != edgeid.Tile_Base()) {
+        visited_edges.insert(opp_edgeid);
+      }
+
+      // No point of the shape is farther from the end node than the
+      // edge length. Leave some slack for approximated distances and
+      // rounded lengths
+      const float reach = 1.05f * (edge->length() + radius) + 1.f;
+      if (approximator.DistanceSquared(end_tile->node(edge->endnode())->latlng()) > reach * reach) {
+        continue;
       }
-    }
 
-    if (correlated.IsCorrelated()) {
-      // Add back if it is an edge correlated or it's a node correlated
-      // but it's not added yet
-      if (!snapped_node.Is_Valid() || visited_nodes.insert(snapped_node).second) {
-        correlated.set_sq_distance(sq_distance);
-        candidates.push_back(correlated);
+      const bool included = !filter || !filter(edge),
+             opp_included = !filter || !filter(opp_edge);
+      if (!included && !opp_included) continue;
+
+      // NOTE a pointer to edgeinfo is needed here because it returns
+      // an unique ptr
+      const auto edgeinfo = tile->edgeinfo(edge->edgeinfo_offset());
+      const auto& shape = edgeinfo->shape();
+      if (shape.empty()) {
+        // Otherwise Project will fail
+        continue;
       }
+
+      midgard::PointLL point;
+      float sq_distance;
+      decltype(shape.size()) segment;
+      float offset;
+      std::tie(point, sq_distance, segment, offset) = helpers::Project(location, shape, approximator);
+      if (snap_distance_ > 0.f) {
+        const float total_length = helpers::LineStringLength(shape.begin(), shape.end());
+        SnapToEnds(location, sq_search_radius, snap_distance_, shape,
+                   offset * total_length, total_length, point, sq_distance, offset);
+      }
+
+      AddCandidate(location, sq_search_radius, point, sq_distance, offset,
+                   edgeid, edge, included && HeadingAllowed(heading_filter, edge, shape, segment),
+                   opp_edgeid, opp_edge, opp_included && HeadingAllowed(heading_filter, opp_edge, shape, segment),
+                   node_candidates, candidates);
     }
   }
 
@@ -144,70 +278,186 @@ CandidateQuery::WithinSquaredDistance(const midgard::PointLL& location,
 }
 
 
-// Add each road linestring's line segments into grid. Only one side
-// of directed edges is added
-void IndexTile(const baldr::GraphTile& tile, GridRangeQuery<baldr::GraphId>& grid)
+std::vector<std::vector<Candidate>>
+CandidateQuery::QueryBulk(const std::vector<midgard::PointLL>& locations,
+                          float radius,
+                          sif::EdgeFilter filter)
 {
-  auto edgecount = tile.header()->directededgecount();
-  if (edgecount <= 0) {
-    return;
+  std::vector<std::vector<Candidate>> results;
+  results.reserve(locations.size());
+  for (const auto& location : locations) {
+    results.push_back(Query(location, radius, filter));
   }
+  return results;
+}
 
-  std::unordered_set<uint32_t> visited(edgecount);
-  auto edgeid = tile.header()->graphid();
-  auto directededge = tile.directededge(0);
-  for (size_t idx = 0; idx < edgecount; edgeid++, directededge++, idx++) {
-    const auto offset = directededge->edgeinfo_offset();
-    if (visited.insert(offset).second) {
-      const auto edgeinfo = tile.edgeinfo(offset);
-      const auto& shape = edgeinfo->shape();
-      for (decltype(shape.size()) j = 1; j < shape.size(); ++j) {
-        grid.AddLineSegment(edgeid, LineSegment(shape[j - 1], shape[j]));
-      }
-    }
+
+void
+CandidateQuery::QueryBulk(const std::vector<midgard::PointLL>& locations,
+                          float sq_search_radius,
+                          sif::EdgeFilter filter,
+                          BulkCandidates& results,
+                          const std::vector<HeadingFilter>& heading_filters,
+                          const std::vector<float>& sq_search_radii) const
+{
+  results.candidates.clear();
+  results.offsets.assign(1, 0);
+  for (size_t idx = 0; idx < locations.size(); idx++) {
+    const auto candidates = Query(locations[idx], sq_search_radii.empty()? sq_search_radius : sq_search_radii[idx], filter,
+                                  heading_filters.empty()? HeadingFilter() : heading_filters[idx]);
+    results.candidates.insert(results.candidates.end(), candidates.begin(), candidates.end());
+    results.offsets.push_back(results.candidates.size());
   }
 }
 
 
+// Only one side of directed edges is added
+void IndexTile(const baldr::GraphTile& tile, GridRangeQueryBuilder<SegmentId>& grid)
+{
+  VisitTileSegments(tile, [&grid](const SegmentId& segment_id, const LineSegment& segment) {
+      grid.AddLineSegment(segment_id, segment);
+    });
+}
 
-CandidateGridQuery::CandidateGridQuery(baldr::GraphReader& reader, float cell_width, float cell_height)
+
+GridRangeQuery<SegmentId>
+BuildTileGrid(const baldr::GraphTile& tile,
+              const midgard::AABB2<midgard::PointLL>& bbox,
+              float cell_width,
+              float cell_height,
+              float cell_items)
+{
+  GridRangeQueryBuilder<SegmentId> builder(bbox, cell_width, cell_height);
+  if (cell_items <= 0.f) {
+    IndexTile(tile, builder);
+    return builder.Build();
+  }
+
+  // Keep the segments so that shapes are decoded only once if the
+  // cells are scaled
+  std::vector<std::pair<SegmentId, LineSegment>> segments;
+  VisitTileSegments(tile, [&builder, &segments](const SegmentId& segment_id, const LineSegment& segment) {
+      segments.emplace_back(segment_id, segment);
+      builder.AddLineSegment(segment_id, segment);
+    });
+  if (!builder.size()) {
+    return builder.Build();
+  }
+  const float density = static_cast<float>(builder.size()) / builder.occupied_cell_count();
+
+  // Items of a cell grow with its area in dense road networks, hence
+  // the square root. Round the scale to a power of two
+  const float scale = std::min(std::max(std::exp2(std::round(std::log2(std::sqrt(cell_items / density)))),
+                                        kMinCellScale),
+                               kMaxCellScale);
+  if (scale == 1.f) {
+    return builder.Build();
+  }
+
+  GridRangeQueryBuilder<SegmentId> scaled(bbox, cell_width * scale, cell_height * scale);
+  scaled.reserve(builder.size());
+  for (const auto& segment : segments) {
+    scaled.AddLineSegment(segment.first, segment.second);
+  }
+  return scaled.Build();
+}
+
+
+CandidateGridQuery::CandidateGridQuery(baldr::GraphReader& reader, float cell_width, float cell_height,
+                                       size_t max_memory_size)
+    : CandidateGridQuery(reader, std::make_shared<GridCache>(cell_width, cell_height, max_memory_size)) {}
+
+
+CandidateGridQuery::CandidateGridQuery(baldr::GraphReader& reader, std::shared_ptr<GridCache> cache)
     : CandidateQuery(reader),
       hierarchy_(reader.GetTileHierarchy()),
-      cell_width_(cell_width),
-      cell_height_(cell_height),
-      grid_cache_() {}
+      cache_(cache),
+      cache_reader_(cache->Register()),
+      hits_(0),
+      misses_(0),
+      evictions_base_(cache->evictions()),
+      shape_cache_(),
+      range_buffer_(),
+      segment_buffer_(),
+      pool_() {}
 
 
-CandidateGridQuery::~CandidateGridQuery() {}
+CandidateGridQuery::~CandidateGridQuery()
+{ cache_->Unregister(cache_reader_); }
 
 
-inline const GridRangeQuery<baldr::GraphId>*
+GridCacheStats
+CandidateGridQuery::stats() const
+{
+  GridCacheStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = cache_->evictions() - evictions_base_;
+  return stats;
+}
+
+
+void
+CandidateGridQuery::ResetStats()
+{
+  hits_ = 0;
+  misses_ = 0;
+  evictions_base_ = cache_->evictions();
+}
+
+
+const GridRangeQuery<SegmentId>*
 CandidateGridQuery::GetGrid(baldr::GraphId tile_id) const
 { return GetGrid(reader_.GetGraphTile(tile_id)); }
 
 
-const GridRangeQuery<baldr::GraphId>*
+// Keep the reader pinned until the next call so that the grid stays
+// valid
+const GridRangeQuery<SegmentId>*
 CandidateGridQuery::GetGrid(const baldr::GraphTile* tile_ptr) const
+{
+  cache_->Pin(cache_reader_);
+  return FindGrid(tile_ptr);
+}
+
+
+const GridRangeQuery<SegmentId>*
+CandidateGridQuery::FindGrid(const baldr::GraphTile* tile_ptr) const
 {
   if (!tile_ptr) {
     return nullptr;
   }
 
-  auto tile_id = tile_ptr->id();
-  auto cached = grid_cache_.find(tile_id);
-  if (cached != grid_cache_.end()) {
-    return &(cached->second);
+  bool hit;
+  const auto edge_count = tile_ptr->header()->directededgecount();
+  const auto grid = cache_->Get(cache_reader_, tile_ptr->id(), edge_count, [this, tile_ptr]() {
+      return BuildTileGrid(*tile_ptr, tile_ptr->BoundingBox(hierarchy_),
+                           cache_->cell_width(), cache_->cell_height(), cache_->cell_items());
+    }, hit);
+  if (hit) {
+    hits_++;
+  } else {
+    misses_++;
   }
+  return grid;
+}
+
 
-  auto inserted = grid_cache_.emplace(tile_id, GridRangeQuery<baldr::GraphId>(tile_ptr->BoundingBox(hierarchy_), cell_width_, cell_height_));
-  IndexTile(*tile_ptr, inserted.first->second);
-  return &(inserted.first->second);
+Span<SegmentId>
+CandidateGridQuery::RangeQuery(const AABB2<midgard::PointLL>& range,
+                               std::vector<SegmentId>& buffer) const
+{
+  PinGuard pin(*cache_, cache_reader_);
+  return CollectRange(range, buffer);
 }
 
 
-std::unordered_set<baldr::GraphId>
-CandidateGridQuery::RangeQuery(const AABB2<midgard::PointLL>& range) const
+Span<SegmentId>
+CandidateGridQuery::CollectRange(const AABB2<midgard::PointLL>& range,
+                                 std::vector<SegmentId>& buffer) const
 {
+  buffer.clear();
+
   auto tile_of_minpt = reader_.GetGraphTile(range.minpt()),
        tile_of_maxpt = reader_.GetGraphTile(range.maxpt());
 
@@ -222,18 +472,12 @@ CandidateGridQuery::RangeQuery(const AABB2<midgard::PointLL>& range) const
   // +--------+---------+
   if (tile_of_minpt == tile_of_maxpt) {
     if (tile_of_minpt) {
-      auto grid = GetGrid(tile_of_minpt);
+      auto grid = FindGrid(tile_of_minpt);
       if (grid) {
-        return grid->Query(range);
-      } else {
-        // g++-4.9 can't convert {} to empty unordered_set
-        // return {};
-        return std::unordered_set<baldr::GraphId>();
+        return grid->Query(range, buffer);
       }
     }
-    // g++-4.9 can't convert {} to empty unordered_set
-    // return {};
-    return std::unordered_set<baldr::GraphId>();
+    return {buffer.data(), buffer.data()};
   }
 
   // Otherwise this range intersects with multiple tiles:
@@ -249,21 +493,17 @@ CandidateGridQuery::RangeQuery(const AABB2<midgard::PointLL>& range) const
   // |      |  |     |     |  |       |         |  | +---+ +       |
   // |      +--+-----+     |  |       |         |  |       |       |
   // +---------+-----------+  +-------+---------+  +-------+-------+
-  std::unordered_set<baldr::GraphId> result;
-
   if (tile_of_minpt) {
-    auto grid = GetGrid(tile_of_minpt);
+    auto grid = FindGrid(tile_of_minpt);
     if (grid) {
-      const auto& set = grid->Query(range);
-      result.insert(set.begin(), set.end());
+      grid->CollectItems(range, buffer);
     }
   }
 
   if (tile_of_maxpt) {
-    auto grid = GetGrid(tile_of_maxpt);
+    auto grid = FindGrid(tile_of_maxpt);
     if (grid) {
-      const auto& set = grid->Query(range);
-      result.insert(set.begin(), set.end());
+      grid->CollectItems(range, buffer);
     }
   }
 
@@ -271,10 +511,9 @@ CandidateGridQuery::RangeQuery(const AABB2<midgard::PointLL>& range) const
   if (tile_of_lefttop
       && tile_of_lefttop != tile_of_minpt
       && tile_of_lefttop != tile_of_maxpt) {
-    auto grid = GetGrid(tile_of_lefttop);
+    auto grid = FindGrid(tile_of_lefttop);
     if (grid) {
-      const auto& set = grid->Query(range);
-      result.insert(set.begin(), set.end());
+      grid->CollectItems(range, buffer);
     }
   }
 
@@ -283,26 +522,283 @@ CandidateGridQuery::RangeQuery(const AABB2<midgard::PointLL>& range) const
       && tile_of_rightbottom != tile_of_minpt
       && tile_of_rightbottom != tile_of_maxpt) {
     assert(tile_of_rightbottom != tile_of_lefttop);
-    auto grid = GetGrid(tile_of_rightbottom);
+    auto grid = FindGrid(tile_of_rightbottom);
     if (grid) {
-      const auto& set = grid->Query(range);
-      result.insert(set.begin(), set.end());
+      grid->CollectItems(range, buffer);
+    }
+  }
+
+  SortUnique(buffer);
+  return {buffer.data(), buffer.data() + buffer.size()};
+}
+
+
+std::unordered_set<baldr::GraphId>
+CandidateGridQuery::RangeQuery(const AABB2<midgard::PointLL>& range) const
+{
+  std::vector<SegmentId> buffer;
+  std::unordered_set<baldr::GraphId> edgeids;
+  for (const auto& segment : RangeQuery(range, buffer)) {
+    edgeids.insert(segment.edgeid());
+  }
+  return edgeids;
+}
+
+
+void
+CandidateGridQuery::ResolveEdges(Span<SegmentId> segments,
+                                 sif::EdgeFilter filter,
+                                 std::vector<NearEdge>& edges,
+                                 std::vector<uint32_t>& segment_indexes) const
+{
+  const baldr::GraphTile* tile = nullptr;
+
+  // Segments are sorted by edge ids
+  for (auto it = segments.begin(); it != segments.end();) {
+    const auto edgeid = it->edgeid();
+    const auto first = it;
+    while (it != segments.end() && it->edgeid() == edgeid) {
+      it++;
     }
+    if (!edgeid.Is_Valid()) continue;
+
+    // Only one side of directed edges is indexed
+    const auto opp_edgeid = helpers::edge_opp_edgeid(reader_, edgeid, tile);
+    if (!opp_edgeid.Is_Valid()) continue;
+    const auto opp_edge = tile->directededge(opp_edgeid);
+    assert(opp_edge);
+    // Make sure it's the last one since we need the tile of this edge
+    const auto edge = helpers::edge_directededge(reader_, edgeid, tile);
+    if (!edge) continue;
+
+    const bool included = !filter || !filter(edge),
+           opp_included = !filter || !filter(opp_edge);
+    if (!included && !opp_included) continue;
+
+    auto shape_ptr = shape_cache_.Get(tile, edge);
+    const auto& shape = *shape_ptr;
+    if (shape.size() < 2) continue;
+
+    const uint32_t segments_begin = segment_indexes.size();
+    for (auto segment = first; segment != it; segment++) {
+      // The last index stands for all segments after it as well
+      const auto end = segment->index() == SegmentId::kMaxIndex? shape.size() - 1 : segment->index() + 1;
+      for (uint32_t index = segment->index(); index < end && index + 1 < shape.size(); index++) {
+        segment_indexes.push_back(index);
+      }
+    }
+    if (segments_begin == segment_indexes.size()) continue;
+
+    edges.push_back({edgeid, edge, included, opp_edgeid, opp_edge, opp_included,
+                     std::move(shape_ptr), segments_begin, static_cast<uint32_t>(segment_indexes.size())});
+  }
+}
+
+
+void
+CandidateGridQuery::ProjectEdges(const midgard::PointLL& location,
+                                 float sq_search_radius,
+                                 const HeadingFilter& heading_filter,
+                                 float snap_distance,
+                                 const NearEdge* edges_begin,
+                                 const NearEdge* edges_end,
+                                 const std::vector<uint32_t>& segment_indexes,
+                                 helpers::SegmentBuffer& buffer,
+                                 std::vector<Candidate>& candidates)
+{
+  if (edges_begin == edges_end) {
+    return;
   }
 
-  return result;
+  // Segments of the edges are consecutive in segment_indexes, so
+  // project the location onto all of them in one pass
+  const auto segments_base = edges_begin->segments_begin;
+  buffer.Reset(location);
+  for (auto near_edge = edges_begin; near_edge != edges_end; near_edge++) {
+    assert(near_edge->segments_begin == segments_base + buffer.size());
+    const auto& shape = *near_edge->shape;
+    for (auto idx = near_edge->segments_begin; idx < near_edge->segments_end; idx++) {
+      const auto index = segment_indexes[idx];
+      buffer.Append(shape[index], shape[index + 1]);
+    }
+  }
+  buffer.Project();
+
+  std::unordered_map<baldr::GraphId, size_t> node_candidates;
+
+  for (auto near_edge = edges_begin; near_edge != edges_end; near_edge++) {
+    const auto& shape = *near_edge->shape;
+    float sq_distance, scale;
+    const auto closest = segment_indexes[segments_base + buffer.Closest(near_edge->segments_begin - segments_base,
+                                                                        near_edge->segments_end - segments_base,
+                                                                        sq_distance, scale)];
+    if (sq_distance > sq_search_radius) continue;
+
+    // Locate the projection along the whole shape only for edges in
+    // the radius
+    auto point = helpers::LocateAlong(shape[closest], shape[closest + 1], scale);
+    const float partial_length = helpers::LineStringLength(shape.begin(), shape.begin() + closest + 1)
+                                 + shape[closest].Distance(point),
+                total_length = partial_length + point.Distance(shape[closest + 1])
+                               + helpers::LineStringLength(shape.begin() + closest + 1, shape.end());
+    float offset = total_length > 0.f? std::min(std::max(partial_length / total_length, 0.f), 1.f) : 0.f;
+    SnapToEnds(location, sq_search_radius, snap_distance, shape,
+               partial_length, total_length, point, sq_distance, offset);
+
+    AddCandidate(location, sq_search_radius, point, sq_distance, offset,
+                 near_edge->edgeid, near_edge->edge,
+                 near_edge->included && HeadingAllowed(heading_filter, near_edge->edge, shape, closest),
+                 near_edge->opp_edgeid, near_edge->opp_edge,
+                 near_edge->opp_included && HeadingAllowed(heading_filter, near_edge->opp_edge, shape, closest),
+                 node_candidates, candidates);
+  }
 }
 
 
 std::vector<Candidate>
 CandidateGridQuery::Query(const midgard::PointLL& location,
                           float sq_search_radius,
-                          sif::EdgeFilter filter) const
+                          sif::EdgeFilter filter,
+                          const HeadingFilter& heading_filter) const
 {
+  PinGuard pin(*cache_, cache_reader_);
   const auto& range = helpers::ExpandMeters(location, std::sqrt(sq_search_radius));
-  const auto& edgeids = RangeQuery(range);
-  return WithinSquaredDistance(location, sq_search_radius,
-                               edgeids.begin(), edgeids.end(), filter, false);
+  const auto segments = CollectRange(range, range_buffer_);
+
+  std::vector<NearEdge> edges;
+  std::vector<uint32_t> segment_indexes;
+  ResolveEdges(segments, filter, edges, segment_indexes);
+
+  std::vector<Candidate> candidates;
+  ProjectEdges(location, sq_search_radius, heading_filter, snap_distance_, edges.data(), edges.data() + edges.size(),
+               segment_indexes, segment_buffer_, candidates);
+  return candidates;
+}
+
+
+void
+CandidateGridQuery::set_thread_count(size_t count)
+{ pool_.reset(count? new ThreadPool(count) : nullptr); }
+
+
+void
+CandidateGridQuery::QueryBulk(const std::vector<midgard::PointLL>& locations,
+                              float sq_search_radius,
+                              sif::EdgeFilter filter,
+                              BulkCandidates& results,
+                              const std::vector<HeadingFilter>& heading_filters,
+                              const std::vector<float>& sq_search_radii) const
+{
+  results.candidates.clear();
+  results.offsets.assign(1, 0);
+  const size_t count = locations.size();
+  if (!count) {
+    return;
+  }
+
+  // Grids stay valid in the call
+  PinGuard pin(*cache_, cache_reader_);
+
+  // Visit locations tile by tile, and cell by cell in each tile:
+  // (tile id, row, column, location index)
+  const auto local_level = hierarchy_.levels().rbegin()->first;
+  std::vector<std::tuple<uint64_t, int32_t, int32_t, uint32_t>> order;
+  order.reserve(count);
+  for (uint32_t idx = 0; idx < count; idx++) {
+    const auto& location = locations[idx];
+    order.emplace_back(static_cast<uint64_t>(hierarchy_.GetGraphId(location, local_level)),
+                       static_cast<int32_t>(std::floor(location.lat() / cache_->cell_height())),
+                       static_cast<int32_t>(std::floor(location.lng() / cache_->cell_width())),
+                       idx);
+  }
+  std::sort(order.begin(), order.end());
+
+  // Resolve edges near each location in that order. Edges of
+  // location at position p are at [edge_offsets[p], edge_offsets[p + 1])
+  const auto sq_radius_of = [sq_search_radius, &sq_search_radii](uint32_t idx) {
+    return sq_search_radii.empty()? sq_search_radius : sq_search_radii[idx];
+  };
+  std::vector<NearEdge> edges;
+  std::vector<uint32_t> edge_offsets{0}, segment_indexes;
+  edge_offsets.reserve(count + 1);
+  const GridRangeQuery<SegmentId>* grid = nullptr;
+  for (const auto& item : order) {
+    const auto& location = locations[std::get<3>(item)];
+    const auto range = helpers::ExpandMeters(location, std::sqrt(sq_radius_of(std::get<3>(item))));
+
+    // Query the grid of the previous location as long as the range
+    // stays inside its tile
+    if (!grid || !Inside(range, grid->bbox())) {
+      grid = FindGrid(reader_.GetGraphTile(location));
+    }
+    if (grid && Inside(range, grid->bbox())) {
+      ResolveEdges(grid->Query(range, range_buffer_), filter, edges, segment_indexes);
+    } else {
+      ResolveEdges(CollectRange(range, range_buffer_), filter, edges, segment_indexes);
+    }
+    edge_offsets.push_back(edges.size());
+  }
+
+  // Project locations in chunks of positions, one chunk per task.
+  // Candidates of location at position p are at [begins[p], ends[p])
+  // of its chunk's candidates
+  const size_t chunk_size = pool_? std::max<size_t>(kMinBulkChunkSize, (count - 1) / (pool_->size() * 4) + 1) : count;
+  std::vector<std::vector<Candidate>> chunks((count - 1) / chunk_size + 1);
+  std::vector<uint32_t> begins(count), ends(count);
+  const auto project = [&](size_t chunk, helpers::SegmentBuffer& buffer) {
+    auto& candidates = chunks[chunk];
+    const auto end = std::min(count, (chunk + 1) * chunk_size);
+    for (auto p = chunk * chunk_size; p < end; p++) {
+      begins[p] = candidates.size();
+      const auto idx = std::get<3>(order[p]);
+      ProjectEdges(locations[idx], sq_radius_of(idx),
+                   heading_filters.empty()? HeadingFilter() : heading_filters[idx],
+                   snap_distance_,
+                   edges.data() + edge_offsets[p], edges.data() + edge_offsets[p + 1],
+                   segment_indexes, buffer, candidates);
+      ends[p] = candidates.size();
+    }
+  };
+
+  if (pool_ && chunks.size() > 1) {
+    std::vector<std::future<void>> futures;
+    futures.reserve(chunks.size());
+    for (size_t chunk = 0; chunk < chunks.size(); chunk++) {
+      futures.push_back(pool_->Submit([&project, chunk](size_t worker) {
+            helpers::SegmentBuffer buffer;
+            project(chunk, buffer);
+          }));
+    }
+    // Tasks refer to the locals here, so wait for all of them before
+    // rethrowing
+    for (auto& future : futures) {
+      future.wait();
+    }
+    for (auto& future : futures) {
+      future.get();
+    }
+  } else {
+    for (size_t chunk = 0; chunk < chunks.size(); chunk++) {
+      project(chunk, segment_buffer_);
+    }
+  }
+
+  // Gather candidates in the order of locations
+  std::vector<uint32_t> positions(count);
+  size_t candidate_count = 0;
+  for (size_t p = 0; p < count; p++) {
+    positions[std::get<3>(order[p])] = p;
+    candidate_count += ends[p] - begins[p];
+  }
+  results.candidates.reserve(candidate_count);
+  results.offsets.reserve(count + 1);
+  for (const auto p : positions) {
+    const auto& candidates = chunks[p / chunk_size];
+    results.candidates.insert(results.candidates.end(),
+                              candidates.begin() + begins[p],
+                              candidates.begin() + ends[p]);
+    results.offsets.push_back(results.candidates.size());
+  }
 }
 
 
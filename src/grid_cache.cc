@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+#include "mmp/grid_cache.h"
+
+using namespace valhalla;
+
+
+namespace mmp {
+
+struct GridCache::Entry
+{
+  Entry(GridRangeQuery<SegmentId>&& grid, baldr::GraphId tile_id)
+      : grid(std::move(grid)),
+        tile_id(tile_id),
+        referenced(true),
+        retired_epoch(0) {}
+
+  GridRangeQuery<SegmentId> grid;
+
+  baldr::GraphId tile_id;
+
+  // Set when it's read, and cleared when the clock hand passes it
+  std::atomic<bool> referenced;
+
+  // The epoch when it's unpublished
+  uint64_t retired_epoch;
+};
+
+
+struct GridCache::Chunk
+{
+  std::atomic<Entry*> slots[1 << kChunkBits];
+};
+
+
+GridCache::GridCache(float cell_width, float cell_height, size_t max_memory_size)
+    : cell_width_(cell_width),
+      cell_height_(cell_height),
+      cell_items_(0.f),
+      max_memory_size_(max_memory_size),
+      index_(),
+      chunks_(new std::atomic<Chunk*>[kChunkCount]()),
+      size_(0),
+      memory_size_(0),
+      evictions_(0),
+      stale_index_grids_(0),
+      epoch_(1),
+      mutex_(),
+      built_(),
+      building_(),
+      published_(),
+      hand_(0),
+      retired_(),
+      readers_() {}
+
+
+GridCache::~GridCache()
+{
+  for (const auto entry : published_) {
+    delete entry;
+  }
+  for (const auto entry : retired_) {
+    delete entry;
+  }
+  for (uint32_t idx = 0; idx < kChunkCount; idx++) {
+    delete chunks_[idx].load();
+  }
+}
+
+
+void
+GridCache::set_cell_items(float cell_items)
+{
+  cell_items_ = cell_items;
+  Clear();
+}
+
+
+void
+GridCache::LoadIndex(const std::string& path)
+{
+  std::unique_ptr<GridIndex> index(new GridIndex(path));
+  // The index is built from the same config, so the cell sizes are
+  // expected to be computed equally
+  if (index->cell_width() != cell_width_ || index->cell_height() != cell_height_
+      || index->cell_items() != cell_items_) {
+    throw std::runtime_error("The grid index " + path + " is built with different grid parameters");
+  }
+  index_ = std::move(index);
+  Clear();
+}
+
+
+void
+GridCache::set_max_memory_size(size_t max_memory_size)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_memory_size_ = max_memory_size;
+  Evict(nullptr);
+  Reclaim();
+}
+
+
+void
+GridCache::Clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto entry : published_) {
+    Retire(entry);
+  }
+  published_.clear();
+  hand_ = 0;
+  Reclaim();
+}
+
+
+GridCache::Reader*
+GridCache::Register()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  readers_.emplace_back();
+  return &readers_.back();
+}
+
+
+void
+GridCache::Unregister(Reader* reader)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  readers_.remove_if([reader](const Reader& registered) {
+      return &registered == reader;
+    });
+  Reclaim();
+}
+
+
+void
+GridCache::Pin(Reader* reader) const
+{
+  // Sequentially consistent, so that once the epoch is stored, slots
+  // read after it are no older than the epoch
+  reader->epoch_.store(epoch_.load());
+}
+
+
+void
+GridCache::Unpin(Reader* reader) const
+{ reader->epoch_.store(0); }
+
+
+std::atomic<GridCache::Entry*>&
+GridCache::Slot(baldr::GraphId tile_id)
+{
+  const uint32_t idx = (tile_id.tileid() << 3) | tile_id.level();
+  auto& chunk = chunks_[idx >> kChunkBits];
+  if (!chunk.load()) {
+    // Only created when publishing, which is done in the mutex
+    chunk.store(new Chunk());
+  }
+  return chunk.load()->slots[idx & ((1 << kChunkBits) - 1)];
+}
+
+
+GridCache::Entry*
+GridCache::Find(baldr::GraphId tile_id) const
+{
+  const uint32_t idx = (tile_id.tileid() << 3) | tile_id.level();
+  const auto chunk = chunks_[idx >> kChunkBits].load();
+  return chunk? chunk->slots[idx & ((1 << kChunkBits) - 1)].load() : nullptr;
+}
+
+
+const GridRangeQuery<SegmentId>*
+GridCache::Get(Reader* reader,
+               baldr::GraphId tile_id,
+               uint32_t edge_count,
+               const Builder& builder,
+               bool& hit)
+{
+  assert(reader->epoch_.load());
+  tile_id = tile_id.Tile_Base();
+
+  auto entry = Find(tile_id);
+  hit = entry != nullptr;
+  if (entry) {
+    // Only write it when it changes, to keep the cache line shared
+    if (!entry->referenced.load(std::memory_order_relaxed)) {
+      entry->referenced.store(true, std::memory_order_relaxed);
+    }
+    return &(entry->grid);
+  }
+
+  // Wait for the thread that is building it, or build it here
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!(entry = Find(tile_id)) && !building_.insert(tile_id).second) {
+      built_.wait(lock);
+    }
+    if (entry) {
+      return &(entry->grid);
+    }
+  }
+
+  std::unique_ptr<Entry> built;
+  try {
+    auto indexed = index_? index_->Find(tile_id) : nullptr;
+    // The tile has changed since the index is built
+    if (indexed && indexed->edge_count != edge_count) {
+      stale_index_grids_.fetch_add(1);
+      indexed = nullptr;
+    }
+    built.reset(new Entry(indexed? index_->Grid(*indexed) : builder(), tile_id));
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      building_.erase(tile_id);
+    }
+    // Let a waiting thread try it
+    built_.notify_all();
+    throw;
+  }
+
+  entry = built.release();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot(tile_id).store(entry);
+    published_.push_back(entry);
+    size_.fetch_add(1);
+    memory_size_.fetch_add(entry->grid.memory_size());
+    building_.erase(tile_id);
+    Evict(entry);
+    Reclaim();
+  }
+  built_.notify_all();
+
+  return &(entry->grid);
+}
+
+
+void
+GridCache::Evict(const Entry* keep)
+{
+  const size_t min_size = keep? 1 : 0;
+  while (memory_size_.load() > max_memory_size_ && published_.size() > min_size) {
+    if (hand_ >= published_.size()) {
+      hand_ = 0;
+    }
+    const auto entry = published_[hand_];
+    // Give entries read since the last sweep a second chance
+    if (entry == keep || entry->referenced.exchange(false, std::memory_order_relaxed)) {
+      hand_++;
+      continue;
+    }
+    published_[hand_] = published_.back();
+    published_.pop_back();
+    Retire(entry);
+    evictions_.fetch_add(1);
+  }
+}
+
+
+void
+GridCache::Retire(Entry* entry)
+{
+  Slot(entry->tile_id).store(nullptr);
+  size_.fetch_sub(1);
+  memory_size_.fetch_sub(entry->grid.memory_size());
+  // Readers pinned after this can't find it anymore
+  entry->retired_epoch = epoch_.fetch_add(1);
+  retired_.push_back(entry);
+}
+
+
+void
+GridCache::Reclaim()
+{
+  if (retired_.empty()) {
+    return;
+  }
+
+  uint64_t min_epoch = std::numeric_limits<uint64_t>::max();
+  for (const auto& reader : readers_) {
+    const auto epoch = reader.epoch_.load();
+    if (epoch) {
+      min_epoch = std::min(min_epoch, epoch);
+    }
+  }
+
+  // Entries retired before all pinned readers are pinned can be freed
+  const auto freed = std::partition(retired_.begin(), retired_.end(), [min_epoch](const Entry* entry) {
+      return entry->retired_epoch >= min_epoch;
+    });
+  for (auto it = freed; it != retired_.end(); it++) {
+    delete *it;
+  }
+  retired_.erase(freed, retired_.end());
+}
+
+}
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mmp/grid_index.h"
+
+using namespace valhalla;
+
+
+namespace {
+
+// Items are copied into and viewed from the file as they are
+static_assert(sizeof(mmp::SegmentId) == sizeof(uint64_t), "SegmentId is expected to be 64 bits");
+
+constexpr size_t kAlignment = 8;
+
+inline bool TileIdLess(const mmp::GridIndexEntry& lhs, const mmp::GridIndexEntry& rhs)
+{ return lhs.tile_id < rhs.tile_id; }
+
+}
+
+
+namespace mmp {
+
+GridIndexWriter::GridIndexWriter(const std::string& path, float cell_width, float cell_height,
+                                 float cell_items)
+    : out_(path, std::ios::binary | std::ios::trunc),
+      cell_width_(cell_width),
+      cell_height_(cell_height),
+      cell_items_(cell_items),
+      entries_()
+{
+  if (!out_) {
+    throw std::runtime_error("Failed to open " + path + " for writing");
+  }
+
+  // Leave room for the header which is written at last
+  const GridIndexHeader header{};
+  out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+
+GridIndexWriter::~GridIndexWriter() {}
+
+
+void
+GridIndexWriter::Pad()
+{
+  static const char zeros[kAlignment] = {};
+  const auto remainder = static_cast<size_t>(out_.tellp()) % kAlignment;
+  if (remainder) {
+    out_.write(zeros, kAlignment - remainder);
+  }
+}
+
+
+void
+GridIndexWriter::Write(baldr::GraphId tile_id, uint32_t edge_count, const GridRangeQuery<SegmentId>& grid)
+{
+  if (!out_.is_open()) {
+    throw std::logic_error("Can't write tiles to a closed grid index");
+  }
+
+  GridIndexEntry entry{};
+  entry.tile_id = tile_id.value;
+  entry.minx = grid.bbox().minx();
+  entry.miny = grid.bbox().miny();
+  entry.maxx = grid.bbox().maxx();
+  entry.maxy = grid.bbox().maxy();
+  entry.cell_count = grid.cell_count();
+  entry.cell_width = grid.cell_width();
+  entry.cell_height = grid.cell_height();
+  entry.item_count = grid.size();
+  entry.edge_count = edge_count;
+
+  Pad();
+  entry.offsets_offset = out_.tellp();
+  if (grid.offsets()) {
+    out_.write(reinterpret_cast<const char*>(grid.offsets()),
+               (grid.cell_count() + 1) * sizeof(uint32_t));
+  } else {
+    const std::vector<uint32_t> zeros(grid.cell_count() + 1, 0);
+    out_.write(reinterpret_cast<const char*>(zeros.data()),
+               zeros.size() * sizeof(uint32_t));
+  }
+
+  Pad();
+  entry.items_offset = out_.tellp();
+  out_.write(reinterpret_cast<const char*>(grid.items()), grid.size() * sizeof(SegmentId));
+
+  if (!out_) {
+    throw std::runtime_error("Failed to write the grid of tile " + std::to_string(tile_id.value));
+  }
+  entries_.push_back(entry);
+}
+
+
+void
+GridIndexWriter::Close()
+{
+  if (!out_.is_open()) {
+    return;
+  }
+
+  std::sort(entries_.begin(), entries_.end(), TileIdLess);
+  const auto duplicate = std::adjacent_find(entries_.begin(), entries_.end(),
+                                            [](const GridIndexEntry& lhs, const GridIndexEntry& rhs) {
+                                              return lhs.tile_id == rhs.tile_id;
+                                            });
+  if (duplicate != entries_.end()) {
+    throw std::logic_error("Tile " + std::to_string(duplicate->tile_id) + " is written more than once");
+  }
+
+  Pad();
+  GridIndexHeader header{};
+  std::copy(kGridIndexMagic, kGridIndexMagic + sizeof(header.magic), header.magic);
+  header.version = kGridIndexVersion;
+  header.cell_width = cell_width_;
+  header.cell_height = cell_height_;
+  header.tile_count = entries_.size();
+  header.cell_items = cell_items_;
+  header.table_offset = out_.tellp();
+  out_.write(reinterpret_cast<const char*>(entries_.data()), entries_.size() * sizeof(GridIndexEntry));
+
+  out_.seekp(0);
+  out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out_.close();
+  if (!out_) {
+    throw std::runtime_error("Failed to write the grid index");
+  }
+}
+
+
+GridIndex::GridIndex(const std::string& path)
+    : mapping_(),
+      length_(0),
+      header_(nullptr),
+      entries_(nullptr)
+{
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open grid index " + path);
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) < 0 || static_cast<size_t>(status.st_size) < sizeof(GridIndexHeader)) {
+    close(fd);
+    throw std::runtime_error("Invalid grid index " + path);
+  }
+  length_ = status.st_size;
+
+  void* address = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    throw std::runtime_error("Failed to map grid index " + path);
+  }
+  const auto length = length_;
+  mapping_.reset(static_cast<const char*>(address), [length](const char* data) {
+      munmap(const_cast<char*>(data), length);
+    });
+
+  header_ = reinterpret_cast<const GridIndexHeader*>(mapping_.get());
+  if (std::memcmp(header_->magic, kGridIndexMagic, sizeof(header_->magic))
+      || header_->version != kGridIndexVersion
+      || header_->table_offset % kAlignment
+      || header_->table_offset + header_->tile_count * sizeof(GridIndexEntry) > length_) {
+    throw std::runtime_error("Invalid grid index " + path);
+  }
+  entries_ = reinterpret_cast<const GridIndexEntry*>(mapping_.get() + header_->table_offset);
+
+  // Validate all entries once so that grids can be read without checks
+  for (auto entry = entries_; entry != entries_ + header_->tile_count; entry++) {
+    const uint64_t offsets_end = entry->offsets_offset + (entry->cell_count + 1ull) * sizeof(uint32_t),
+                 items_end = entry->items_offset + entry->item_count * sizeof(SegmentId);
+    if (entry->offsets_offset % kAlignment || entry->items_offset % kAlignment
+        || offsets_end > length_ || items_end > length_
+        || !(entry->cell_width > 0.f) || !(entry->cell_height > 0.f)
+        || (entry != entries_ && !TileIdLess(*(entry - 1), *entry))) {
+      throw std::runtime_error("Invalid grid index " + path);
+    }
+  }
+}
+
+
+GridIndex::~GridIndex() {}
+
+
+const GridIndexEntry*
+GridIndex::Find(baldr::GraphId tile_id) const
+{
+  GridIndexEntry key{};
+  key.tile_id = tile_id.value;
+  const auto end = entries_ + header_->tile_count,
+            found = std::lower_bound(entries_, end, key, TileIdLess);
+  if (found != end && found->tile_id == key.tile_id) {
+    return found;
+  }
+  return nullptr;
+}
+
+
+GridRangeQuery<SegmentId>
+GridIndex::Grid(const GridIndexEntry& entry) const
+{
+  const auto offsets = reinterpret_cast<const uint32_t*>(mapping_.get() + entry.offsets_offset);
+  const auto items = reinterpret_cast<const SegmentId*>(mapping_.get() + entry.items_offset);
+  GridRangeQuery<SegmentId> grid(BoundingBox(entry.minx, entry.miny, entry.maxx, entry.maxy),
+                                      entry.cell_width, entry.cell_height,
+                                      offsets, items, entry.item_count, mapping_);
+  if (grid.cell_count() != entry.cell_count || offsets[entry.cell_count] != entry.item_count) {
+    throw std::runtime_error("Inconsistent grid of tile " + std::to_string(entry.tile_id));
+  }
+  return grid;
+}
+
+}
@@ -23,19 +23,23 @@ State::State(const StateId id,
     : id_(id),
       time_(time),
       candidate_(candidate),
-      labelset_(nullptr),
-      label_idx_() {}
+      routed_(false),
+      arena_(nullptr),
+      paths_() {}
 
 
-void
+size_t
 State::route(const std::vector<const State*>& states,
+             RouteArena& arena,
              baldr::GraphReader& graphreader,
              float max_route_distance,
              const midgard::DistanceApproximator& approximator,
              float search_radius,
              sif::cost_ptr_t costing,
              std::shared_ptr<const sif::EdgeLabel> edgelabel,
-             const float turn_cost_table[181]) const
+             const float turn_cost_table[181],
+             EdgeAccessCache* access_cache,
+             ShapeCache* shape_cache) const
 {
   // Prepare locations
   std::vector<baldr::PathLocation> locations;
@@ -46,32 +50,45 @@ State::route(const std::vector<const State*>& states,
   }
 
   // Route
-  labelset_ = std::make_shared<LabelSet>(std::ceil(max_route_distance));
-  // TODO pass labelset_ as shared_ptr
+  LabelSet labelset(std::ceil(max_route_distance));
   const auto& results = find_shortest_path(
-      graphreader, locations, 0, *labelset_,
+      graphreader, locations, 0, labelset,
       approximator, search_radius,
-      costing, edgelabel, turn_cost_table);
+      costing, edgelabel, turn_cost_table, access_cache, shape_cache);
 
-  // Cache results
-  label_idx_.clear();
-  uint16_t dest = 1;  // dest at 0 is remained for the origin
+  // Copy the paths out so that the labels can be released; dest at 0
+  // is remained for the origin
+  arena_ = &arena;
+  paths_.clear();
+  uint16_t dest = 1;
   for (const auto state : states) {
     const auto it = results.find(dest);
-    if (it != results.end()) {
-      label_idx_[state->id()] = it->second;
-    }
+    paths_[state->id()] = it != results.end()? arena.Append(labelset, it->second) : RoutePath{0, 0, nullptr};
     dest++;
   }
+  routed_ = true;
+
+  return labelset.settled_count();
 }
 
 
-const Label*
+const RouteStep*
 State::last_label(const State& state) const
 {
-  const auto it = label_idx_.find(state.id());
-  if (it != label_idx_.end()) {
-    return &labelset_->label(it->second);
+  const auto it = paths_.find(state.id());
+  if (it != paths_.end() && it->second.size) {
+    return &arena_->step(it->second.offset);
+  }
+  return nullptr;
+}
+
+
+std::shared_ptr<const sif::EdgeLabel>
+State::last_edgelabel(const State& state) const
+{
+  const auto it = paths_.find(state.id());
+  if (it != paths_.end()) {
+    return it->second.edgelabel;
   }
   return nullptr;
 }
@@ -117,7 +134,11 @@ MapMatching::MapMatching(baldr::GraphReader& graphreader,
                          float breakage_distance,
                          float max_route_distance_factor,
                          float search_radius,
-                         float turn_penalty_factor)
+                         float turn_penalty_factor,
+                         float max_speed,
+                         EdgeAccessCache* access_cache,
+                         RoutePool* route_pool,
+                         ShapeCache* shape_cache)
     : graphreader_(graphreader),
       mode_costing_(mode_costing),
       mode_(mode),
@@ -131,6 +152,13 @@ MapMatching::MapMatching(baldr::GraphReader& graphreader,
       max_route_distance_factor_(max_route_distance_factor),
       search_radius_(search_radius),
       turn_penalty_factor_(turn_penalty_factor),
+      max_speed_(max_speed),
+      access_cache_(access_cache),
+      route_pool_(route_pool),
+      shape_cache_(shape_cache),
+      arena_(),
+      settled_count_(0),
+      batch_predecessor_(),
       turn_cost_table_{0.f}
 {
   if (sigma_z_ <= 0.f) {
@@ -145,6 +173,10 @@ MapMatching::MapMatching(baldr::GraphReader& graphreader,
     throw std::invalid_argument("Expect search radius to be nonnegative");
   }
 
+  if (max_speed_ < 0.f) {
+    throw std::invalid_argument("Expect max speed to be nonnegative");
+  }
+
 #ifndef NDEBUG
   for (size_t i = 0; i <= 180; ++i) {
     assert(!turn_cost_table_[i]);
@@ -164,14 +196,21 @@ MapMatching::MapMatching(baldr::GraphReader& graphreader,
 MapMatching::MapMatching(baldr::GraphReader& graphreader,
                          const sif::cost_ptr_t* mode_costing,
                          const sif::TravelMode mode,
-                         const ptree& config)
+                         const ptree& config,
+                         EdgeAccessCache* access_cache,
+                         RoutePool* route_pool,
+                         ShapeCache* shape_cache)
     : MapMatching(graphreader, mode_costing, mode,
                   config.get<float>("sigma_z"),
                   config.get<float>("beta"),
                   config.get<float>("breakage_distance"),
                   config.get<float>("max_route_distance_factor"),
                   config.get<float>("search_radius"),
-                  config.get<float>("turn_penalty_factor")) {}
+                  config.get<float>("turn_penalty_factor"),
+                  config.get<float>("max_speed", 0.f),
+                  access_cache,
+                  route_pool,
+                  shape_cache) {}
 
 
 MapMatching::~MapMatching()
@@ -183,7 +222,10 @@ MapMatching::Clear()
 {
   measurements_.clear();
   states_.clear();
+  batch_predecessor_.clear();
   ViterbiSearch<State>::Clear();
+  arena_.Clear();
+  settled_count_ = 0;
 }
 
 
@@ -210,33 +252,108 @@ Time MapMatching::AppendState(const Measurement& measurement,
 }
 
 
-inline float
+// Candidates are appended from bulk query results
+template Time MapMatching::AppendState<const Candidate*>(const Measurement&, const Candidate*, const Candidate*);
+
+
+float
 MapMatching::MaxRouteDistance(const State& left, const State& right) const
 {
-  auto mmt_distance = GreatCircleDistance(measurement(left), measurement(right));
-  return std::min(mmt_distance * max_route_distance_factor_, breakage_distance_);
+  const auto &left_mmt = measurement(left), &right_mmt = measurement(right);
+  const auto mmt_distance = GreatCircleDistance(left_mmt, right_mmt);
+  const auto max_route_distance = std::min(mmt_distance * max_route_distance_factor_, breakage_distance_);
+
+  // No faster than the max speed in the elapsed time. Leave room for
+  // the GPS errors at both ends, and never cut below the distance
+  // between the measurements, so that jumps and timestamps of coarse
+  // resolution don't break the route
+  if (max_speed_ > 0.f && left_mmt.has_time() && right_mmt.has_time()) {
+    const float elapsed = std::max(right_mmt.time() - left_mmt.time(), 0.0);
+    const float error = (left_mmt.has_accuracy()? left_mmt.accuracy() : sigma_z_)
+                        + (right_mmt.has_accuracy()? right_mmt.accuracy() : sigma_z_);
+    return std::min(max_route_distance, std::max(max_speed_ * elapsed, mmt_distance) + error);
+  }
+
+  return max_route_distance;
+}
+
+
+void
+MapMatching::Route(const State& left,
+                   StateId prev_stateid,
+                   const State& right,
+                   baldr::GraphReader& graphreader,
+                   EdgeAccessCache* access_cache,
+                   ShapeCache* shape_cache) const
+{
+  std::shared_ptr<const sif::EdgeLabel> edgelabel;
+  if (prev_stateid != kInvalidStateId) {
+    const auto& prev_state = state(prev_stateid);
+    assert(prev_state.routed());
+    edgelabel = prev_state.last_edgelabel(left);
+  } else {
+    edgelabel = nullptr;
+  }
+  settled_count_ += left.route(unreached_states_[right.time()], arena_, graphreader,
+                               MaxRouteDistance(left, right),
+                               midgard::DistanceApproximator(measurement(right).lnglat()),
+                               search_radius_, costing(), edgelabel, turn_cost_table_,
+                               access_cache, shape_cache);
+}
+
+
+void
+MapMatching::RouteColumn(const State& left, const State& right) const
+{
+  // Each task routes a different state, and only reads the states in
+  // the previous column and the unreached states in the next column
+  std::vector<RoutePool::task_t> tasks;
+  const auto prev_stateid = predecessor(left.id());
+  tasks.push_back([this, &left, prev_stateid, &right]
+                  (baldr::GraphReader& graphreader, EdgeAccessCache& access_cache, ShapeCache& shape_cache) {
+                    Route(left, prev_stateid, right, graphreader, &access_cache, &shape_cache);
+                  });
+
+  // The scanned states have been routed, and states that are not
+  // queued are not reachable yet
+  for (const auto state : unreached_states_[left.time()]) {
+    StateId queued_prev_stateid;
+    if (!state->routed() && IsQueued(state->id(), queued_prev_stateid)) {
+      batch_predecessor_[state->id()] = queued_prev_stateid;
+      tasks.push_back([this, state, queued_prev_stateid, &right]
+                      (baldr::GraphReader& graphreader, EdgeAccessCache& access_cache, ShapeCache& shape_cache) {
+                        Route(*state, queued_prev_stateid, right, graphreader, &access_cache, &shape_cache);
+                      });
+    }
+  }
+
+  route_pool_->Run(tasks);
 }
 
 
 float
 MapMatching::TransitionCost(const State& left, const State& right) const
 {
+  const auto prev_stateid = predecessor(left.id());
+
+  // A state routed ahead in its column has been routed with the
+  // predecessor it had then; route it again if it has changed since
+  if (!batch_predecessor_.empty()) {
+    const auto it = batch_predecessor_.find(left.id());
+    if (it != batch_predecessor_.end()) {
+      if (it->second != prev_stateid) {
+        left.unroute();
+      }
+      batch_predecessor_.erase(it);
+    }
+  }
+
   if (!left.routed()) {
-    std::shared_ptr<const sif::EdgeLabel> edgelabel;
-    const auto prev_stateid = predecessor(left.id());
-    if (prev_stateid != kInvalidStateId) {
-      const auto& prev_state = state(prev_stateid);
-      assert(prev_state.routed());
-      const auto label = prev_state.last_label(left);
-      edgelabel = label? label->edgelabel : nullptr;
+    if (route_pool_) {
+      RouteColumn(left, right);
     } else {
-      edgelabel = nullptr;
+      Route(left, prev_stateid, right, graphreader_, access_cache_, shape_cache_);
     }
-    const midgard::DistanceApproximator approximator(measurement(right).lnglat());
-    left.route(unreached_states_[right.time()], graphreader_,
-               MaxRouteDistance(left, right),
-               approximator, search_radius_,
-               costing(), edgelabel, turn_cost_table_);
   }
   assert(left.routed());
 
@@ -253,7 +370,14 @@ MapMatching::TransitionCost(const State& left, const State& right) const
 
 inline float
 MapMatching::EmissionCost(const State& state) const
-{ return state.candidate().sq_distance() * inv_double_sq_sigma_z_; }
+{
+  // Weight by the measurement's own accuracy if it's known
+  const auto& mmt = measurement(state);
+  if (mmt.has_accuracy()) {
+    return state.candidate().sq_distance() / (2.f * mmt.accuracy() * mmt.accuracy());
+  }
+  return state.candidate().sq_distance() * inv_double_sq_sigma_z_;
+}
 
 
 inline double
@@ -278,13 +402,13 @@ EdgeSegment::EdgeSegment(baldr::GraphId the_edgeid,
 
 
 std::vector<midgard::PointLL>
-EdgeSegment::Shape(baldr::GraphReader& graphreader) const
+EdgeSegment::Shape(baldr::GraphReader& graphreader, ShapeCache* shape_cache) const
 {
   const baldr::GraphTile* tile = nullptr;
   const auto edge = helpers::edge_directededge(graphreader, edgeid, tile);
   if (edge) {
-    const auto edgeinfo = tile->edgeinfo(edge->edgeinfo_offset());
-    const auto& shape = edgeinfo->shape();
+    const auto shape_ptr = helpers::edge_shape(tile, edge, shape_cache);
+    const auto& shape = *shape_ptr;
     if (edge->forward()) {
       return helpers::ClipLineString(shape.cbegin(), shape.cend(), source, target);
     } else {
@@ -394,68 +518,36 @@ guess_target_result(const MapMatching::state_iterator source,
 }
 
 
-template <typename candidate_iterator_t>
-MatchResult
-interpolate(baldr::GraphReader& reader,
-            const std::unordered_set<baldr::GraphId>& graphset,
-            candidate_iterator_t begin,
-            candidate_iterator_t end,
-            const Measurement& measurement)
+// The shape of an edge, or the location of a node, on a matched route
+struct GraphGeometry
 {
-  auto closest_candidate = end;
-  float closest_sq_distance = std::numeric_limits<float>::infinity();
-  baldr::GraphId closest_graphid;
-  GraphType closest_graphtype = GraphType::kUnknown;
-
-  for (auto candidate = begin; candidate != end; candidate++) {
-    if (candidate->sq_distance() < closest_sq_distance) {
-      if (!candidate->IsNode()) {
-        for (const auto& edge : candidate->edges()) {
-          const auto it = graphset.find(edge.id);
-          if (it != graphset.end()) {
-            closest_candidate = candidate;
-            closest_sq_distance = candidate->sq_distance();
-            closest_graphid = edge.id;
-            closest_graphtype = GraphType::kEdge;
-          }
-        }
-      } else {
-        for (const auto nodeid : collect_nodes(reader, *candidate)) {
-          const auto it = graphset.find(nodeid);
-          if (it != graphset.end()) {
-            closest_candidate = candidate;
-            closest_sq_distance = candidate->sq_distance();
-            closest_graphid = nodeid;
-            closest_graphtype = GraphType::kNode;
-          }
-        }
-      }
-    }
-  }
+  baldr::GraphId graphid;
 
-  if (closest_candidate != end) {
-    return {closest_candidate->vertex(), closest_candidate->distance(), closest_graphid, closest_graphtype};
-  }
+  GraphType graphtype;
 
-  return {measurement.lnglat()};
-}
+  std::vector<midgard::PointLL> shape;
+};
 
 
-std::unordered_set<baldr::GraphId>
-collect_graphset(baldr::GraphReader& reader,
-                 const MapMatching::state_iterator source,
-                 const MapMatching::state_iterator target)
+// Collect geometries of edges and nodes of the route from the source
+// to the target (or of the source if there is no route), so that they
+// are decoded once for all measurements interpolated into the route
+std::vector<GraphGeometry>
+collect_geometries(baldr::GraphReader& reader,
+                   ShapeCache* shape_cache,
+                   const MapMatching::state_iterator source,
+                   const MapMatching::state_iterator target)
 {
-  std::unordered_set<baldr::GraphId> graphset;
+  std::unordered_set<baldr::GraphId> edgeids, nodeids;
   if (source.IsValid() && target.IsValid()) {
     for (auto label = source->RouteBegin(*target);
          label != source->RouteEnd();
          ++label) {
       if (label->edgeid.Is_Valid()) {
-        graphset.insert(label->edgeid);
+        edgeids.insert(label->edgeid);
       }
       if (label->nodeid.Is_Valid()) {
-        graphset.insert(label->nodeid);
+        nodeids.insert(label->nodeid);
       }
     }
   } else if (source.IsValid()) {
@@ -463,28 +555,98 @@ collect_graphset(baldr::GraphReader& reader,
     if (!location.IsNode()) {
       for (const auto& edge : location.edges()) {
         if (edge.id.Is_Valid()) {
-          graphset.insert(edge.id);
+          edgeids.insert(edge.id);
         }
       }
     } else {
       for (const auto nodeid : collect_nodes(reader, location)) {
         if (nodeid.Is_Valid()) {
-          graphset.insert(nodeid);
+          nodeids.insert(nodeid);
         }
       }
     }
   }
 
-  return graphset;
+  std::vector<GraphGeometry> geometries;
+  geometries.reserve(edgeids.size() + nodeids.size());
+  const baldr::GraphTile* tile = nullptr;
+
+  for (const auto edgeid : edgeids) {
+    const auto edge = helpers::edge_directededge(reader, edgeid, tile);
+    if (edge) {
+      const auto shape = helpers::edge_shape(tile, edge, shape_cache);
+      if (!shape->empty()) {
+        geometries.push_back({edgeid, GraphType::kEdge, *shape});
+      }
+    }
+  }
+
+  for (const auto nodeid : nodeids) {
+    if (!tile || tile->id().tileid() != nodeid.tileid() || tile->id().level() != nodeid.level()) {
+      tile = reader.GetGraphTile(nodeid);
+    }
+    const auto node = tile? tile->node(nodeid) : nullptr;
+    if (node) {
+      geometries.push_back({nodeid, GraphType::kNode, {node->latlng()}});
+    }
+  }
+
+  return geometries;
+}
+
+
+// Project the measurement directly onto the geometries of the route
+// it is interpolated into
+MatchResult
+interpolate(const std::vector<GraphGeometry>& geometries,
+            float sq_search_radius,
+            const Measurement& measurement)
+{
+  const midgard::DistanceApproximator approximator(measurement.lnglat());
+  const GraphGeometry* closest_geometry = nullptr;
+  midgard::PointLL closest_point;
+  float closest_sq_distance = std::numeric_limits<float>::infinity();
+
+  for (const auto& geometry : geometries) {
+    midgard::PointLL point;
+    float sq_distance;
+    std::tie(point, sq_distance, std::ignore, std::ignore) = helpers::Project(measurement.lnglat(), geometry.shape, approximator);
+    // Prefer nodes to the ends of their edges
+    if (sq_distance < closest_sq_distance
+        || (sq_distance == closest_sq_distance && geometry.graphtype == GraphType::kNode)) {
+      closest_geometry = &geometry;
+      closest_point = point;
+      closest_sq_distance = sq_distance;
+    }
+  }
+
+  if (closest_geometry && closest_sq_distance <= sq_search_radius) {
+    return {closest_point, std::sqrt(closest_sq_distance), closest_geometry->graphid, closest_geometry->graphtype};
+  }
+
+  return {measurement.lnglat()};
 }
 
 
+// Search radii derived from accuracies don't go below this (in
+// meters), since road geometries have errors of their own
+constexpr float kMinAccuracySearchRadius = 10.f;
+
+
+// Headings are only derived from neighbours at least this far apart
+// (in meters), since GPS noise dominates the direction of short spans
+constexpr float kMinHeadingDistance = 20.f;
+
+
 std::vector<MatchResult>
 OfflineMatch(MapMatching& mm,
              const CandidateQuery& cq,
              const std::vector<Measurement>& measurements,
              float sq_search_radius,
-             float interpolation_distance)
+             float max_search_radius,
+             const TraceSimplifier& simplifier,
+             float heading_tolerance,
+             bool derive_heading)
 {
   mm.Clear();
 
@@ -492,25 +654,78 @@ OfflineMatch(MapMatching& mm,
     return {};
   }
 
+  // Search around measurements of known accuracies in proportion to
+  // them, as the search radius is to sigma_z
+  const float search_radius = std::sqrt(sq_search_radius),
+          min_search_radius = std::min(search_radius, kMinAccuracySearchRadius);
+  const auto sq_radius_of = [&](const Measurement& measurement) {
+    if (!measurement.has_accuracy()) {
+      return sq_search_radius;
+    }
+    const float radius = std::min(std::max(search_radius * measurement.accuracy() / mm.sigma_z(),
+                                           min_search_radius),
+                                  max_search_radius);
+    return radius * radius;
+  };
+
   using mmt_size_t = std::vector<Measurement>::size_type;
   Time time = 0;
-  float sq_interpolation_distance = interpolation_distance * interpolation_distance;
   std::unordered_map<Time, std::vector<mmt_size_t>> proximate_measurements;
 
+  // Pick measurements to match. The others will be interpolated into
+  // the route matched between them
+  std::vector<midgard::PointLL> locations;
+  locations.reserve(measurements.size());
+  for (const auto& measurement : measurements) {
+    locations.push_back(measurement.lnglat());
+  }
+  const auto matched_indexes = simplify_trace(simplifier, locations);
+  std::vector<bool> matched(measurements.size(), false);
+  locations.clear();
+  for (const auto idx : matched_indexes) {
+    matched[idx] = true;
+    locations.push_back(measurements[idx].lnglat());
+  }
+
+  // Drop candidates of roads heading the wrong way, by the supplied
+  // headings of the measurements or the headings derived from their
+  // neighbours
+  std::vector<HeadingFilter> heading_filters;
+  if (heading_tolerance < 180.f) {
+    heading_filters.reserve(locations.size());
+    for (size_t idx = 0; idx < locations.size(); idx++) {
+      const auto& measurement = measurements[matched_indexes[idx]];
+      float heading = measurement.heading();
+      if (!measurement.has_heading() && derive_heading) {
+        const auto &prev = locations[idx > 0? idx - 1 : idx],
+                   &next = locations[idx + 1 < locations.size()? idx + 1 : idx];
+        if (kMinHeadingDistance <= prev.Distance(next)) {
+          heading = prev.Heading(next);
+        }
+      }
+      heading_filters.emplace_back(heading, heading_tolerance);
+    }
+  }
+
+  std::vector<float> sq_search_radii;
+  if (std::any_of(measurements.begin(), measurements.end(),
+                  [](const Measurement& measurement) { return measurement.has_accuracy(); })) {
+    sq_search_radii.reserve(locations.size());
+    for (const auto idx : matched_indexes) {
+      sq_search_radii.push_back(sq_radius_of(measurements[idx]));
+    }
+  }
+
+  // Search candidates of them at once
+  BulkCandidates bulk_candidates;
+  cq.QueryBulk(locations, sq_search_radius, mm.costing()->GetFilter(), bulk_candidates,
+               heading_filters, sq_search_radii);
+
   // Load states
-  for (mmt_size_t idx = 0,
-             last_idx = 0,
-              end_idx = measurements.size() - 1;
-       idx <= end_idx; idx++) {
-    const auto& measurement = measurements[idx];
-    auto sq_distance = GreatCircleDistanceSquared(measurements[last_idx], measurement);
-    // Always match the first and the last measurement
-    if (sq_interpolation_distance <= sq_distance || idx == 0 || idx == end_idx) {
-      const auto& candidates = cq.Query(measurement.lnglat(),
-                                        sq_search_radius,
-                                        mm.costing()->GetFilter());
-      time = mm.AppendState(measurement, candidates.begin(), candidates.end());
-      last_idx = idx;
+  for (mmt_size_t idx = 0, matched_idx = 0; idx < measurements.size(); idx++) {
+    if (matched[idx]) {
+      const auto candidates = bulk_candidates[matched_idx++];
+      time = mm.AppendState(measurements[idx], candidates.begin(), candidates.end());
     } else {
       proximate_measurements[time].push_back(idx);
     }
@@ -543,14 +758,9 @@ OfflineMatch(MapMatching& mm,
 
     auto it = proximate_measurements.find(time - 1);
     if (it != proximate_measurements.end()) {
-      const auto& graphset = collect_graphset(mm.graphreader(), source_state, target_state);
+      const auto& geometries = collect_geometries(mm.graphreader(), mm.shape_cache(), source_state, target_state);
       for (const auto idx : it->second) {
-        const auto& candidates = cq.Query(measurements[idx].lnglat(),
-                                          sq_search_radius,
-                                          mm.costing()->GetFilter());
-        results.push_back(interpolate(mm.graphreader(), graphset,
-                                      candidates.begin(), candidates.end(),
-                                      measurements[idx]));
+        results.push_back(interpolate(geometries, sq_radius_of(measurements[idx]), measurements[idx]));
       }
     }
 
@@ -566,13 +776,17 @@ MapMatcher::MapMatcher(const ptree& config,
                        baldr::GraphReader& graphreader,
                        CandidateGridQuery& rangequery,
                        const sif::cost_ptr_t* mode_costing,
-                       sif::TravelMode travelmode)
+                       sif::TravelMode travelmode,
+                       EdgeAccessCache* access_cache,
+                       RoutePool* route_pool)
     : config_(config),
       graphreader_(graphreader),
       rangequery_(rangequery),
       mode_costing_(mode_costing),
       travelmode_(travelmode),
-      mapmatching_(graphreader_, mode_costing_, travelmode_, config_) {}
+      mapmatching_(graphreader_, mode_costing_, travelmode_, config_, access_cache, route_pool,
+                   &rangequery_.shape_cache()),
+      simplifier_(create_trace_simplifier(config_)) {}
 
 
 MapMatcher::~MapMatcher() {}
@@ -581,24 +795,53 @@ MapMatcher::~MapMatcher() {}
 std::vector<MatchResult>
 MapMatcher::OfflineMatch(const std::vector<Measurement>& measurements)
 {
-  float search_radius = std::min(config_.get<float>("search_radius"),
-                                 config_.get<float>("max_search_radius"));
-  float interpolation_distance = config_.get<float>("interpolation_distance");
+  float max_search_radius = config_.get<float>("max_search_radius");
+  float search_radius = std::min(config_.get<float>("search_radius"), max_search_radius);
   return mmp::OfflineMatch(mapmatching_, rangequery_, measurements,
                            search_radius * search_radius,
-                           interpolation_distance);
+                           max_search_radius,
+                           *simplifier_,
+                           config_.get<float>("heading_tolerance", 180.f),
+                           config_.get<bool>("derive_heading", false));
+}
+
+
+// Bytes of tile grids cached by default
+constexpr size_t kDefaultGridCacheMemory = 268435456;
+
+
+// The memory budget of the grid cache. The tile count grid.cache_size
+// it replaces can't be told in bytes (grids vary with the tiles), so
+// configurations still giving it get the default budget and a warning
+inline size_t
+grid_cache_memory(const ptree& root)
+{
+  const auto memory = root.get_optional<size_t>("grid.cache_memory");
+  if (memory) {
+    return *memory;
+  }
+  if (root.get_optional<std::string>("grid.cache_size")) {
+    LOG_WARN("grid.cache_size is no longer supported; set grid.cache_memory in bytes instead (default "
+             + std::to_string(kDefaultGridCacheMemory) + ")");
+  }
+  return kDefaultGridCacheMemory;
 }
 
 
 MapMatcherFactory::MapMatcherFactory(const ptree& root)
     : config_(root.get_child("mm")),
-      graphreader_(root.get_child("mjolnir")),
+      mjolnir_config_(root.get_child("mjolnir")),
+      graphreader_(mjolnir_config_),
       mode_costing_{nullptr},
       mode_name_(),
       rangequery_(graphreader_,
                   local_tile_size(graphreader_)/root.get<size_t>("grid.size"),
-                  local_tile_size(graphreader_)/root.get<size_t>("grid.size")),
-      max_grid_cache_size_(root.get<float>("grid.cache_size"))
+                  local_tile_size(graphreader_)/root.get<size_t>("grid.size"),
+                  grid_cache_memory(root)),
+      access_cache_(),
+      route_pool_(),
+      batch_workers_(),
+      batch_pool_()
       {
 #ifndef NDEBUG
         for (size_t idx = 0; idx < kModeCostingCount; idx++) {
@@ -608,6 +851,21 @@ MapMatcherFactory::MapMatcherFactory(const ptree& root)
 #endif
 
         init_costings(root);
+
+        rangequery_.set_thread_count(config_.get<size_t>("candidate_search_threads", 0));
+        rangequery_.set_snap_distance(config_.get<float>("candidate_snap_distance", 0.f));
+
+        const auto route_threads = config_.get<size_t>("route_threads", 0);
+        if (route_threads) {
+          route_pool_.reset(new RoutePool(mjolnir_config_, route_threads));
+        }
+
+        rangequery_.set_cell_items(root.get<float>("grid.cell_items", 0.f));
+
+        const auto grid_index = root.get<std::string>("grid.index", "");
+        if (!grid_index.empty()) {
+          rangequery_.LoadIndex(grid_index);
+        }
       }
 
 
@@ -654,7 +912,173 @@ MapMatcherFactory::Create(sif::TravelMode travelmode, const ptree& preferences)
 {
   const auto& config = MergeConfig(TravelModeToName(travelmode), preferences);
   // TODO investigate exception safety
-  return new MapMatcher(config, graphreader_, rangequery_, mode_costing_, travelmode);
+  return new MapMatcher(config, graphreader_, rangequery_, mode_costing_, travelmode,
+                        &access_cache_, route_pool_.get());
+}
+
+
+MapMatcherFactory::BatchWorker::BatchWorker(const ptree& mjolnir_config,
+                                            const std::shared_ptr<GridCache>& grid_cache,
+                                            float snap_distance)
+    : graphreader(mjolnir_config),
+      rangequery(graphreader, grid_cache),
+      access_cache()
+{
+  rangequery.set_snap_distance(snap_distance);
+}
+
+
+std::vector<BatchResult>
+MapMatcherFactory::MatchBatch(const std::vector<std::vector<Measurement>>& traces,
+                              const BatchOptions& options)
+{
+  std::vector<BatchResult> results(traces.size());
+  MatchBatch(traces, options, [&results](size_t idx, MapMatcher&, std::vector<MatchResult>& trace_results) {
+      // Drop the states since the matcher clears them for the next trace
+      for (auto& result : trace_results) {
+        result = MatchResult(result.lnglat(), result.distance(), result.graphid(), result.graphtype());
+      }
+      results[idx].results = std::move(trace_results);
+    }, [&results](size_t idx, std::exception_ptr error) {
+      results[idx].results.clear();
+      results[idx].error = error;
+    });
+  return results;
+}
+
+
+void
+MapMatcherFactory::MatchBatch(const std::vector<std::vector<Measurement>>& traces,
+                              const BatchOptions& options,
+                              const batch_callback_t& callback,
+                              const batch_error_callback_t& error_callback)
+{
+  auto batch = OpenBatch(options);
+
+  std::vector<std::future<void>> futures;
+  futures.reserve(traces.size());
+  for (size_t idx = 0; idx < traces.size(); idx++) {
+    Batch::error_callback_t trace_error_callback;
+    if (error_callback) {
+      trace_error_callback = [&error_callback, idx](std::exception_ptr error) {
+        error_callback(idx, error);
+      };
+    }
+    futures.push_back(batch->Submit(traces[idx], [&callback, idx](MapMatcher& matcher, std::vector<MatchResult>& results) {
+          callback(idx, matcher, results);
+        }, trace_error_callback));
+  }
+
+  // The batch waits for all traces if one of them is rethrown
+  for (auto& future : futures) {
+    future.get();
+  }
+}
+
+
+std::unique_ptr<MapMatcherFactory::Batch>
+MapMatcherFactory::OpenBatch(const BatchOptions& options)
+{ return std::unique_ptr<Batch>(new Batch(*this, options)); }
+
+
+MapMatcherFactory::Batch::Batch(MapMatcherFactory& factory, const BatchOptions& options)
+    : factory_(factory),
+      lock_(factory.batch_mutex_),
+      config_(),
+      travelmode_(),
+      matchers_(),
+      pending_(0),
+      mutex_(),
+      done_()
+{
+  // Validate the preferences before any work
+  const auto& name = options.preferences.get<std::string>("mode", factory_.config_.get<std::string>("mode"));
+  travelmode_ = factory_.NameToTravelMode(name);
+  config_ = factory_.MergeConfig(name, options.preferences);
+
+  const auto thread_count = options.thread_count?
+                            options.thread_count : std::max(std::thread::hardware_concurrency(), 1u);
+  auto& pool = factory_.batch_pool_;
+  auto& workers = factory_.batch_workers_;
+  if (!pool || pool->size() != thread_count) {
+    pool.reset();
+    workers.clear();
+    for (size_t worker = 0; worker < thread_count; worker++) {
+      workers.emplace_back(new BatchWorker(factory_.mjolnir_config_, factory_.grid_cache(),
+                                           factory_.rangequery_.snap_distance()));
+    }
+    pool.reset(new ThreadPool(thread_count));
+  }
+  matchers_.resize(thread_count);
+}
+
+
+MapMatcherFactory::Batch::~Batch()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() { return !pending_; });
+}
+
+
+std::future<void>
+MapMatcherFactory::Batch::Submit(const std::vector<Measurement>& trace,
+                                 const callback_t& callback,
+                                 const error_callback_t& error_callback)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_++;
+  }
+  return factory_.batch_pool_->Submit([this, &trace, callback, error_callback](size_t worker) {
+      std::exception_ptr error;
+      try {
+        Match(worker, trace, callback, error_callback);
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      // Notify while locked, since the batch may be gone right after
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_--;
+        done_.notify_all();
+      }
+
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    });
+}
+
+
+void
+MapMatcherFactory::Batch::Match(size_t worker,
+                                const std::vector<Measurement>& trace,
+                                const callback_t& callback,
+                                const error_callback_t& error_callback)
+{
+  auto& batch_worker = *factory_.batch_workers_[worker];
+  auto& matcher = matchers_[worker];
+  if (!matcher) {
+    matcher.reset(new MapMatcher(config_, batch_worker.graphreader, batch_worker.rangequery,
+                                 factory_.mode_costing_, travelmode_, &batch_worker.access_cache));
+  }
+
+  try {
+    auto results = matcher->OfflineMatch(trace);
+    callback(*matcher, results);
+  } catch (...) {
+    if (!error_callback) {
+      throw;
+    }
+    error_callback(std::current_exception());
+  }
+
+  if (batch_worker.graphreader.OverCommitted()) {
+    batch_worker.graphreader.Clear();
+    batch_worker.access_cache.Clear();
+    batch_worker.rangequery.shape_cache().Clear();
+  }
 }
 
 
@@ -737,22 +1161,61 @@ MapMatcherFactory::init_costings(const ptree& root)
 }
 
 
+ShapeCacheStats MapMatcherFactory::shape_cache_stats() const
+{
+  std::lock_guard<std::mutex> lock(batch_mutex_);
+  auto stats = rangequery_.shape_cache().stats();
+  if (route_pool_) {
+    stats += route_pool_->shape_cache_stats();
+  }
+  for (const auto& worker : batch_workers_) {
+    stats += worker->rangequery.shape_cache().stats();
+  }
+  return stats;
+}
+
+
+void MapMatcherFactory::ResetShapeCacheStats()
+{
+  std::lock_guard<std::mutex> lock(batch_mutex_);
+  rangequery_.shape_cache().ResetStats();
+  if (route_pool_) {
+    route_pool_->ResetShapeCacheStats();
+  }
+  for (auto& worker : batch_workers_) {
+    worker->rangequery.shape_cache().ResetStats();
+  }
+}
+
+
 void MapMatcherFactory::ClearFullCache()
 {
   if(graphreader_.OverCommitted()) {
     graphreader_.Clear();
+    access_cache_.Clear();
+    rangequery_.shape_cache().Clear();
   }
 
-  if (rangequery_.size() > max_grid_cache_size_) {
-    rangequery_.Clear();
+  if (route_pool_) {
+    route_pool_->ClearFullCache();
   }
 }
 
 
 void MapMatcherFactory::ClearCache()
 {
+  std::lock_guard<std::mutex> lock(batch_mutex_);
   graphreader_.Clear();
   rangequery_.Clear();
+  access_cache_.Clear();
+  if (route_pool_) {
+    route_pool_->ClearCache();
+  }
+  for (auto& worker : batch_workers_) {
+    worker->graphreader.Clear();
+    worker->rangequery.shape_cache().Clear();
+    worker->access_cache.Clear();
+  }
 }
 
 
@@ -19,8 +19,10 @@ using namespace valhalla;
 namespace mmp
 {
 
-LabelSet::LabelSet(typename BucketQueue<uint32_t, kInvalidLabelIndex>::size_type count, float size)
-    : queue_(count, size) {}
+LabelSet::LabelSet(size_type count, float size, bool resumable)
+    : queue_(count, size),
+      resumable_(resumable),
+      settled_count_(0) {}
 
 
 bool
@@ -62,6 +64,9 @@ LabelSet::put(const baldr::GraphId& nodeid,
       return true;
     }
     // !added -> rejected since queue's full
+    if (resumable_ && predecessor != kInvalidLabelIndex) {
+      overflowed_.insert(predecessor);
+    }
   } else {
     const auto& status = it->second;
     if (!status.permanent && sortcost < labels_[status.label_idx].sortcost) {
@@ -121,6 +126,9 @@ LabelSet::put(uint16_t dest,
       return true;
     }
     // !added -> rejected since queue's full
+    if (resumable_ && predecessor != kInvalidLabelIndex) {
+      overflowed_.insert(predecessor);
+    }
   } else {
     const auto& status = it->second;
     if (!status.permanent && sortcost < labels_[status.label_idx].sortcost) {
@@ -146,6 +154,7 @@ LabelSet::pop()
   const auto idx = queue_.pop();
 
   if (idx != kInvalidLabelIndex) {
+    settled_count_++;
     const auto& label = labels_[idx];
     if (label.nodeid.Is_Valid()) {
       assert(node_status_[label.nodeid].label_idx == idx);
@@ -163,13 +172,104 @@ LabelSet::pop()
 }
 
 
+const Status*
+LabelSet::node_status(const baldr::GraphId& nodeid) const
+{
+  const auto it = node_status_.find(nodeid);
+  return it == node_status_.end()? nullptr : &(it->second);
+}
+
+
+const Status*
+LabelSet::dest_status(uint16_t dest) const
+{
+  const auto it = dest_status_.find(dest);
+  return it == dest_status_.end()? nullptr : &(it->second);
+}
+
+
+void
+LabelSet::set_bucket_count(size_type count)
+{
+  if (queue_.bucket_count() < count) {
+    queue_.set_bucket_count(count);
+    // Their successors might fit in the queue now
+    suspended_.insert(overflowed_.begin(), overflowed_.end());
+    overflowed_.clear();
+  }
+}
+
+
+void
+LabelSet::suspend(uint32_t label_idx)
+{
+  if (resumable_) {
+    suspended_.insert(label_idx);
+  }
+}
+
+
+std::vector<uint32_t>
+LabelSet::release_suspended()
+{
+  std::vector<uint32_t> labels(suspended_.begin(), suspended_.end());
+  suspended_.clear();
+  return labels;
+}
+
+
+bool
+EdgeAccessCache::Allowed(const sif::DynamicCost& costing,
+                         const baldr::DirectedEdge* edge,
+                         const baldr::GraphId& edgeid,
+                         const baldr::GraphTile* tile)
+{
+  const auto key = static_cast<uint64_t>(baldr::GraphId(edgeid.tileid(), edgeid.level(), 0))
+                   | (static_cast<uint64_t>(costing.travelmode()) << 56);
+  auto& bits = bits_[key];
+
+  const size_t idx = 2 * edgeid.id();
+  if (bits.size() <= idx) {
+    bits.resize(std::max<size_t>(idx + 2, 2 * tile->header()->directededgecount()), false);
+  }
+
+  if (!bits[idx]) {
+    // A neutral predecessor which has no restrictions and doesn't
+    // make an u-turn onto this edge. It takes the destination-only
+    // state of the edge, so that is left to DependsOnPredecessor
+    const sif::EdgeLabel pred(kInvalidLabelIndex, baldr::GraphId(), edge,
+                              sif::Cost(0.f, 0.f), 0.f, 0.f,
+                              0, (edge->localedgeidx() + 1) % 8,
+                              costing.travelmode());
+    const baldr::GraphTile* edge_tile = tile;
+    bits[idx] = true;
+    bits[idx + 1] = costing.Allowed(edge, pred, edge_tile, edgeid);
+  }
+
+  return bits[idx + 1];
+}
+
+
+bool
+EdgeAccessCache::DependsOnPredecessor(const baldr::DirectedEdge* edge,
+                                      const sif::EdgeLabel& pred)
+{
+  // Costings reject a destination-only edge from a predecessor that
+  // isn't destination-only
+  return pred.restrictions()
+      || pred.opp_local_idx() == edge->localedgeidx()
+      || (edge->destonly() && !pred.destonly());
+}
+
+
 inline bool
 IsEdgeAllowed(const baldr::DirectedEdge* edge,
               const baldr::GraphId& edgeid,
               const sif::cost_ptr_t costing,
               const std::shared_ptr<const sif::EdgeLabel> pred_edgelabel,
               const sif::EdgeFilter edgefilter,
-              const baldr::GraphTile* tile)
+              const baldr::GraphTile* tile,
+              EdgeAccessCache* access_cache)
 {
   if (costing) {
     if (pred_edgelabel) {
@@ -177,8 +277,25 @@ IsEdgeAllowed(const baldr::DirectedEdge* edge,
       // means it was allowed so we give it a pass directly
 
       // TODO let sif do this?
-      return edgeid == pred_edgelabel->edgeid()
-          || costing->Allowed(edge, *pred_edgelabel, tile, edgeid);
+      if (edgeid == pred_edgelabel->edgeid()) {
+        return true;
+      }
+
+      if (access_cache) {
+        // Costings reject an edge if any of their checks fails, so
+        // it's not allowed from any predecessor if it's not allowed
+        // from the neutral one
+        if (!access_cache->Allowed(*costing, edge, edgeid, tile)) {
+          return false;
+        }
+        // Otherwise skip the costing unless the verdict depends on
+        // the predecessor
+        if (!EdgeAccessCache::DependsOnPredecessor(edge, *pred_edgelabel)) {
+          return true;
+        }
+      }
+
+      return costing->Allowed(edge, *pred_edgelabel, tile, edgeid);
     } else {
       if (edgefilter) {
         return !edgefilter(edge);
@@ -271,15 +388,16 @@ inline uint16_t
 get_inbound_edgelabel_heading(baldr::GraphReader& graphreader,
                               const baldr::GraphTile* tile,
                               const sif::EdgeLabel& edgelabel,
-                              const baldr::NodeInfo& nodeinfo)
+                              const baldr::NodeInfo& nodeinfo,
+                              ShapeCache* shape_cache)
 {
   const auto idx = edgelabel.opp_local_idx();
   if (idx < 8) {
     return nodeinfo.heading(idx);
   } else {
     const auto directededge = helpers::edge_directededge(graphreader, edgelabel.edgeid(), tile);
-    const auto edgeinfo = tile->edgeinfo(directededge->edgeinfo_offset());
-    const auto& shape = edgeinfo->shape();
+    const auto shape_ptr = helpers::edge_shape(tile, directededge, shape_cache);
+    const auto& shape = *shape_ptr;
     if (shape.size() >= 2) {
       float heading;
       if (directededge->forward()) {
@@ -298,14 +416,15 @@ get_inbound_edgelabel_heading(baldr::GraphReader& graphreader,
 inline uint16_t
 get_outbound_edge_heading(const baldr::GraphTile* tile,
                           const baldr::DirectedEdge* outbound_edge,
-                          const baldr::NodeInfo& nodeinfo)
+                          const baldr::NodeInfo& nodeinfo,
+                          ShapeCache* shape_cache)
 {
   const auto idx = outbound_edge->localedgeidx();
   if (idx < 8) {
     return nodeinfo.heading(idx);
   } else {
-    const auto edgeinfo = tile->edgeinfo(outbound_edge->edgeinfo_offset());
-    const auto& shape = edgeinfo->shape();
+    const auto shape_ptr = helpers::edge_shape(tile, outbound_edge, shape_cache);
+    const auto& shape = *shape_ptr;
     if (shape.size() >= 2) {
       float heading;
       if (outbound_edge->forward()) {
@@ -331,6 +450,251 @@ heuristic(const midgard::DistanceApproximator& approximator,
 }
 
 
+// Add successors of a settled node label to the queue
+void
+expand_node(baldr::GraphReader& reader,
+            const std::vector<baldr::PathLocation>& destinations,
+            const std::unordered_map<baldr::GraphId, std::unordered_set<uint16_t>>& edge_dests,
+            LabelSet& labelset,
+            uint32_t label_idx,
+            const midgard::DistanceApproximator& approximator,
+            float search_radius,
+            sif::TravelMode travelmode,
+            sif::cost_ptr_t costing,
+            const sif::EdgeFilter edgefilter,
+            const float turn_cost_table[181],
+            EdgeAccessCache* access_cache,
+            ShapeCache* shape_cache,
+            const baldr::GraphTile*& tile)
+{
+  // NOTE this refernce is possible to be invalid when you add
+  // labels to the set later (which causes the label list
+  // reallocated)
+  const auto& label = labelset.label(label_idx);
+
+  // So we cache the costs that will be used during expanding
+  const auto label_cost = label.cost;
+  const auto label_turn_cost = label.turn_cost;
+  // and edgelabel pointer for checking edge accessibility later
+  const auto pred_edgelabel = label.edgelabel;
+  const auto nodeid = label.nodeid;
+
+  const auto nodeinfo = helpers::edge_nodeinfo(reader, nodeid, tile);
+  if (!nodeinfo || nodeinfo->edge_count() <= 0) return;
+
+  if (costing && !costing->Allowed(nodeinfo)) return;
+
+  const auto inbound_heading = (pred_edgelabel && turn_cost_table)?
+                               get_inbound_edgelabel_heading(reader, tile, *pred_edgelabel, *nodeinfo, shape_cache) : 0;
+  assert(0 <= inbound_heading && inbound_heading < 360);
+
+  // Expand current node
+  baldr::GraphId other_edgeid(nodeid.tileid(), nodeid.level(), nodeinfo->edge_index());
+  auto other_edge = tile->directededge(nodeinfo->edge_index());
+  assert(other_edge);
+  for (size_t i = 0; i < nodeinfo->edge_count(); i++, other_edge++, other_edgeid++) {
+    // Disable shortcut TODO perhaps we should use
+    // other_edge->is_shortcut()? but it failed to guarantee same
+    // level
+    if (nodeid.level() != other_edge->endnode().level()) continue;
+
+    if (!IsEdgeAllowed(other_edge, other_edgeid, costing, pred_edgelabel, edgefilter, tile, access_cache)) continue;
+
+    // Turn cost
+    float turn_cost = 0.f;
+    if (pred_edgelabel && turn_cost_table) {
+      const auto other_heading = get_outbound_edge_heading(tile, other_edge, *nodeinfo, shape_cache);
+      assert(0 <= other_heading && other_heading < 360);
+      const auto turn_degree = helpers::get_turn_degree180(inbound_heading, other_heading);
+      assert(0 <= turn_degree && turn_degree <= 180);
+      turn_cost = label_turn_cost + turn_cost_table[turn_degree];
+    }
+
+    // If destinations found along the edge, add segments to each
+    // destination to the queue
+    const auto it = edge_dests.find(other_edgeid);
+    if (it != edge_dests.end()) {
+      for (const auto dest : it->second) {
+        for (const auto& edge : destinations[dest].edges()) {
+          if (edge.id == other_edgeid) {
+            const float cost = label_cost + other_edge->length() * edge.dist,
+                    sortcost = cost;
+            labelset.put(dest, other_edgeid,
+                         0.f, edge.dist,
+                         cost, turn_cost, sortcost,
+                         label_idx,
+                         other_edge, travelmode, nullptr);
+          }
+        }
+      }
+    }
+
+    const baldr::GraphTile* endtile = tile;
+    if (other_edge->endnode().tileid() != tile->id().tileid()) {
+      endtile = reader.GetGraphTile(other_edge->endnode());
+    }
+    const auto other_nodeinfo = endtile->node(other_edge->endnode());
+    const float cost = label_cost + other_edge->length(),
+            sortcost = cost + heuristic(approximator, other_nodeinfo->latlng(), search_radius);
+    labelset.put(other_edge->endnode(), other_edgeid,
+                 0.f, 1.f,
+                 cost, turn_cost, sortcost,
+                 label_idx,
+                 other_edge, travelmode, nullptr);
+  }
+}
+
+
+// Add segments from the settled origin label to destinations ahead at
+// the same edge, and to the end nodes of the origin edges, to the
+// queue
+void
+expand_origin(baldr::GraphReader& reader,
+              const std::vector<baldr::PathLocation>& destinations,
+              uint16_t origin_idx,
+              const std::unordered_map<baldr::GraphId, std::unordered_set<uint16_t>>& edge_dests,
+              LabelSet& labelset,
+              uint32_t label_idx,
+              const midgard::DistanceApproximator& approximator,
+              float search_radius,
+              sif::TravelMode travelmode,
+              sif::cost_ptr_t costing,
+              const sif::EdgeFilter edgefilter,
+              const float turn_cost_table[181],
+              EdgeAccessCache* access_cache,
+              const baldr::GraphTile*& tile)
+{
+  const auto& label = labelset.label(label_idx);
+  const auto label_cost = label.cost;
+  const auto label_turn_cost = label.turn_cost;
+  const auto pred_edgelabel = label.edgelabel;
+
+  for (const auto& origin_edge : destinations[origin_idx].edges()) {
+    const auto directededge = helpers::edge_directededge(reader, origin_edge.id, tile);
+    if (!directededge) continue;
+
+    if (!IsEdgeAllowed(directededge, origin_edge.id, costing, pred_edgelabel, edgefilter, tile, access_cache)) continue;
+
+    // U-turn cost
+    float turn_cost = 0.f;
+    if (pred_edgelabel && turn_cost_table
+        && pred_edgelabel->edgeid() != origin_edge.id
+        && pred_edgelabel->opp_local_idx() == directededge->localedgeidx()) {
+      turn_cost = label_turn_cost + turn_cost_table[0];
+    }
+
+    // All destinations on this origin edge
+    const auto it = edge_dests.find(origin_edge.id);
+    if (it != edge_dests.end()) {
+      for (const auto other_dest : it->second) {
+        // All edges of this destination
+        for (const auto& other_edge : destinations[other_dest].edges()) {
+          if (origin_edge.id == other_edge.id && origin_edge.dist <= other_edge.dist) {
+            const float cost = label_cost + directededge->length() * (other_edge.dist - origin_edge.dist),
+                    sortcost = cost;
+            labelset.put(other_dest, origin_edge.id,
+                         origin_edge.dist, other_edge.dist,
+                         cost, turn_cost, sortcost,
+                         label_idx,
+                         directededge, travelmode, nullptr);
+          }
+        }
+      }
+    }
+
+    const baldr::GraphTile* endtile = tile;
+    if (directededge->endnode().tileid() != tile->id().tileid()) {
+      endtile = reader.GetGraphTile(directededge->endnode());
+    }
+    const auto nodeinfo = endtile->node(directededge->endnode());
+    const float cost = label_cost + directededge->length() * (1.f - origin_edge.dist),
+            sortcost = cost + heuristic(approximator, nodeinfo->latlng(), search_radius);
+    labelset.put(directededge->endnode(), origin_edge.id,
+                 origin_edge.dist, 1.f,
+                 cost, turn_cost, sortcost,
+                 label_idx,
+                 directededge, travelmode, nullptr);
+  }
+}
+
+
+// Remove a destination from the list of destinations along edges
+inline void
+remove_edge_dest(const std::vector<baldr::PathLocation>& destinations,
+                 uint16_t dest,
+                 std::unordered_map<baldr::GraphId, std::unordered_set<uint16_t>>& edge_dests)
+{
+  for (const auto& edge : destinations[dest].edges()) {
+    const auto it = edge_dests.find(edge.id);
+    if (it != edge_dests.end()) {
+      it->second.erase(dest);
+      if (it->second.empty()) {
+        edge_dests.erase(it);
+      }
+    }
+  }
+}
+
+
+// Prepare a resumed search: collect destinations that were reached in
+// previous searches, and suspend settled labels that were expanded
+// before the other destinations were known
+void
+resume_destinations(baldr::GraphReader& reader,
+                    const std::vector<baldr::PathLocation>& destinations,
+                    uint16_t origin_idx,
+                    LabelSet& labelset,
+                    std::unordered_map<baldr::GraphId, std::unordered_set<uint16_t>>& node_dests,
+                    std::unordered_map<baldr::GraphId, std::unordered_set<uint16_t>>& edge_dests,
+                    std::unordered_map<uint16_t, uint32_t>& results)
+{
+  const baldr::GraphTile* tile = nullptr;
+
+  for (auto it = node_dests.begin(); it != node_dests.end();) {
+    const auto status = labelset.node_status(it->first);
+    if (status && status->permanent) {
+      for (const auto dest : it->second) {
+        results[dest] = status->label_idx;
+      }
+      it = node_dests.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  const auto origin_status = labelset.dest_status(origin_idx);
+  std::unordered_set<uint16_t> reached;
+  for (const auto& pair : edge_dests) {
+    for (const auto dest : pair.second) {
+      const auto status = labelset.dest_status(dest);
+      if (status && status->permanent) {
+        results[dest] = status->label_idx;
+        reached.insert(dest);
+      }
+    }
+
+    // The start node or the origin might have been expanded without
+    // knowing destinations along this edge
+    const auto startnodeid = helpers::edge_startnodeid(reader, pair.first, tile);
+    const auto status = startnodeid.Is_Valid()? labelset.node_status(startnodeid) : nullptr;
+    if (status && status->permanent) {
+      labelset.suspend(status->label_idx);
+    }
+    if (origin_status && origin_status->permanent) {
+      for (const auto& origin_edge : destinations[origin_idx].edges()) {
+        if (origin_edge.id == pair.first) {
+          labelset.suspend(origin_status->label_idx);
+        }
+      }
+    }
+  }
+
+  for (const auto dest : reached) {
+    remove_edge_dest(destinations, dest, edge_dests);
+  }
+}
+
+
 std::unordered_map<uint16_t, uint32_t>
 find_shortest_path(baldr::GraphReader& reader,
                    const std::vector<baldr::PathLocation>& destinations,
@@ -340,7 +704,9 @@ find_shortest_path(baldr::GraphReader& reader,
                    float search_radius,
                    sif::cost_ptr_t costing,
                    std::shared_ptr<const sif::EdgeLabel> edgelabel,
-                   const float turn_cost_table[181])
+                   const float turn_cost_table[181],
+                   EdgeAccessCache* access_cache,
+                   ShapeCache* shape_cache)
 {
   // Destinations at nodes
   std::unordered_map<baldr::GraphId, std::unordered_set<uint16_t>> node_dests;
@@ -353,28 +719,39 @@ find_shortest_path(baldr::GraphReader& reader,
 
   const sif::TravelMode travelmode = costing? costing->travelmode() : static_cast<sif::TravelMode>(0);
 
-  // Load origin to the queue of the labelset
-  set_origin(reader, destinations, origin_idx, labelset, travelmode, costing, edgelabel);
-
   std::unordered_map<uint16_t, uint32_t> results;
 
   const auto edgefilter = costing? costing->GetFilter() : nullptr;
 
   const baldr::GraphTile* tile = nullptr;
 
+  if (labelset.resumable() && labelset.has_status()) {
+    // Continue from the frontier of previous searches
+    resume_destinations(reader, destinations, origin_idx, labelset, node_dests, edge_dests, results);
+    if (node_dests.empty() && edge_dests.empty()) {
+      return results;
+    }
+
+    for (const auto label_idx : labelset.release_suspended()) {
+      if (labelset.label(label_idx).nodeid.Is_Valid()) {
+        expand_node(reader, destinations, edge_dests, labelset, label_idx,
+                    approximator, search_radius, travelmode,
+                    costing, edgefilter, turn_cost_table, access_cache, shape_cache, tile);
+      } else if (labelset.label(label_idx).dest == origin_idx) {
+        expand_origin(reader, destinations, origin_idx, edge_dests, labelset, label_idx,
+                      approximator, search_radius, travelmode,
+                      costing, edgefilter, turn_cost_table, access_cache, tile);
+      }
+    }
+  } else {
+    // Load origin to the queue of the labelset
+    set_origin(reader, destinations, origin_idx, labelset, travelmode, costing, edgelabel);
+  }
+
   while (!labelset.empty()) {
     const auto label_idx = labelset.pop();
-    // NOTE this refernce is possible to be invalid when you add
-    // labels to the set later (which causes the label list
-    // reallocated)
     const auto& label = labelset.label(label_idx);
 
-    // So we cache the costs that will be used during expanding
-    const auto label_cost = label.cost;
-    const auto label_turn_cost = label.turn_cost;
-    // and edgelabel pointer for checking edge accessibility later
-    const auto pred_edgelabel = label.edgelabel;
-
     if (label.nodeid.Is_Valid()) {
       const auto nodeid = label.nodeid;
 
@@ -391,72 +768,14 @@ find_shortest_path(baldr::GraphReader& reader,
 
       // Congrats!
       if (node_dests.empty() && edge_dests.empty()) {
+        // Not expanded yet
+        labelset.suspend(label_idx);
         break;
       }
 
-      const auto nodeinfo = helpers::edge_nodeinfo(reader, nodeid, tile);
-      if (!nodeinfo || nodeinfo->edge_count() <= 0) continue;
-
-      if (costing && !costing->Allowed(nodeinfo)) continue;
-
-      const auto inbound_heading = (pred_edgelabel && turn_cost_table)?
-                                   get_inbound_edgelabel_heading(reader, tile, *pred_edgelabel, *nodeinfo) : 0;
-      assert(0 <= inbound_heading && inbound_heading < 360);
-
-      // Expand current node
-      baldr::GraphId other_edgeid(nodeid.tileid(), nodeid.level(), nodeinfo->edge_index());
-      auto other_edge = tile->directededge(nodeinfo->edge_index());
-      assert(other_edge);
-      for (size_t i = 0; i < nodeinfo->edge_count(); i++, other_edge++, other_edgeid++) {
-        // Disable shortcut TODO perhaps we should use
-        // other_edge->is_shortcut()? but it failed to guarantee same
-        // level
-        if (nodeid.level() != other_edge->endnode().level()) continue;
-
-        if (!IsEdgeAllowed(other_edge, other_edgeid, costing, pred_edgelabel, edgefilter, tile)) continue;
-
-        // Turn cost
-        float turn_cost = 0.f;
-        if (pred_edgelabel && turn_cost_table) {
-          const auto other_heading = get_outbound_edge_heading(tile, other_edge, *nodeinfo);
-          assert(0 <= other_heading && other_heading < 360);
-          const auto turn_degree = helpers::get_turn_degree180(inbound_heading, other_heading);
-          assert(0 <= turn_degree && turn_degree <= 180);
-          turn_cost = label_turn_cost + turn_cost_table[turn_degree];
-        }
-
-        // If destinations found along the edge, add segments to each
-        // destination to the queue
-        const auto it = edge_dests.find(other_edgeid);
-        if (it != edge_dests.end()) {
-          for (const auto dest : it->second) {
-            for (const auto& edge : destinations[dest].edges()) {
-              if (edge.id == other_edgeid) {
-                const float cost = label_cost + other_edge->length() * edge.dist,
-                        sortcost = cost;
-                labelset.put(dest, other_edgeid,
-                             0.f, edge.dist,
-                             cost, turn_cost, sortcost,
-                             label_idx,
-                             other_edge, travelmode, nullptr);
-              }
-            }
-          }
-        }
-
-        const baldr::GraphTile* endtile = tile;
-        if (other_edge->endnode().tileid() != tile->id().tileid()) {
-          endtile = reader.GetGraphTile(other_edge->endnode());
-        }
-        const auto other_nodeinfo = endtile->node(other_edge->endnode());
-        const float cost = label_cost + other_edge->length(),
-                sortcost = cost + heuristic(approximator, other_nodeinfo->latlng(), search_radius);
-        labelset.put(other_edge->endnode(), other_edgeid,
-                     0.f, 1.f,
-                     cost, turn_cost, sortcost,
-                     label_idx,
-                     other_edge, travelmode, nullptr);
-      }
+      expand_node(reader, destinations, edge_dests, labelset, label_idx,
+                  approximator, search_radius, travelmode,
+                  costing, edgefilter, turn_cost_table, access_cache, shape_cache, tile);
     } else {
       assert(label.dest != kInvalidDestination);
       const auto dest = label.dest;
@@ -464,75 +783,135 @@ find_shortest_path(baldr::GraphReader& reader,
       // Path to a destination along an edge is found: remember it and
       // remove the destination from the destination list
       results[dest] = label_idx;
-      for (const auto& edge : destinations[dest].edges()) {
-        const auto it = edge_dests.find(edge.id);
-        if (it != edge_dests.end()) {
-          it->second.erase(dest);
-          if (it->second.empty()) {
-            edge_dests.erase(it);
-          }
-        }
-      }
+      remove_edge_dest(destinations, dest, edge_dests);
 
       // Congrats!
       if (edge_dests.empty() && node_dests.empty()) {
+        if (dest == origin_idx) {
+          // Not expanded yet
+          labelset.suspend(label_idx);
+        }
         break;
       }
 
       // Expand origin: add segments from origin to destinations ahead
       // at the same edge to the queue
       if (dest == origin_idx) {
-        for (const auto& origin_edge : destinations[origin_idx].edges()) {
-          const auto directededge = helpers::edge_directededge(reader, origin_edge.id, tile);
-          if (!directededge) continue;
-
-          if (!IsEdgeAllowed(directededge, origin_edge.id, costing, pred_edgelabel, edgefilter, tile)) continue;
-
-          // U-turn cost
-          float turn_cost = 0.f;
-          if (pred_edgelabel && turn_cost_table
-              && pred_edgelabel->edgeid() != origin_edge.id
-              && pred_edgelabel->opp_local_idx() == directededge->localedgeidx()) {
-            turn_cost = label_turn_cost + turn_cost_table[0];
-          }
-
-          // All destinations on this origin edge
-          for (const auto other_dest : edge_dests[origin_edge.id]) {
-            // All edges of this destination
-            for (const auto& other_edge : destinations[other_dest].edges()) {
-              if (origin_edge.id == other_edge.id && origin_edge.dist <= other_edge.dist) {
-                const float cost = label_cost + directededge->length() * (other_edge.dist - origin_edge.dist),
-                        sortcost = cost;
-                labelset.put(other_dest, origin_edge.id,
-                             origin_edge.dist, other_edge.dist,
-                             cost, turn_cost, sortcost,
-                             label_idx,
-                             directededge, travelmode, nullptr);
-              }
-            }
-          }
-
-          const baldr::GraphTile* endtile = tile;
-          if (directededge->endnode().tileid() != tile->id().tileid()) {
-            endtile = reader.GetGraphTile(directededge->endnode());
-          }
-          const auto nodeinfo = endtile->node(directededge->endnode());
-          const float cost = label_cost + directededge->length() * (1.f - origin_edge.dist),
-                  sortcost = cost + heuristic(approximator, nodeinfo->latlng(), search_radius);
-          labelset.put(directededge->endnode(), origin_edge.id,
-                       origin_edge.dist, 1.f,
-                       cost, turn_cost, sortcost,
-                       label_idx,
-                       directededge, travelmode, nullptr);
-        }
+        expand_origin(reader, destinations, origin_idx, edge_dests, labelset, label_idx,
+                      approximator, search_radius, travelmode,
+                      costing, edgefilter, turn_cost_table, access_cache, tile);
       }
     }
   }
 
-  labelset.clear_queue();
-  labelset.clear_status();
+  // Keep the frontier and the settled labels for resuming
+  if (!labelset.resumable()) {
+    labelset.clear_queue();
+    labelset.clear_status();
+  }
 
   return results;
 }
 
+
+RoutePool::RoutePool(const boost::property_tree::ptree& mjolnir_config,
+                     size_t thread_count)
+    : graphreaders_(),
+      access_caches_(thread_count),
+      shape_caches_(thread_count),
+      pool_(thread_count)
+{
+  graphreaders_.reserve(thread_count);
+  for (size_t worker = 0; worker < thread_count; worker++) {
+    graphreaders_.emplace_back(new baldr::GraphReader(mjolnir_config));
+  }
+}
+
+
+void
+RoutePool::Run(const std::vector<task_t>& tasks)
+{
+  std::vector<std::future<void>> futures;
+  futures.reserve(tasks.size());
+  for (const auto& task : tasks) {
+    futures.push_back(pool_.Submit([this, &task](size_t worker) {
+          task(*graphreaders_[worker], access_caches_[worker], shape_caches_[worker]);
+        }));
+  }
+
+  // Wait for all before rethrowing since tasks reference the caller's
+  // data
+  for (auto& future : futures) {
+    future.wait();
+  }
+  for (auto& future : futures) {
+    future.get();
+  }
+}
+
+
+void
+RoutePool::ClearFullCache()
+{
+  for (size_t worker = 0; worker < graphreaders_.size(); worker++) {
+    if (graphreaders_[worker]->OverCommitted()) {
+      graphreaders_[worker]->Clear();
+      access_caches_[worker].Clear();
+      shape_caches_[worker].Clear();
+    }
+  }
+}
+
+
+void
+RoutePool::ClearCache()
+{
+  for (size_t worker = 0; worker < graphreaders_.size(); worker++) {
+    graphreaders_[worker]->Clear();
+    access_caches_[worker].Clear();
+    shape_caches_[worker].Clear();
+  }
+}
+
+
+ShapeCacheStats
+RoutePool::shape_cache_stats() const
+{
+  ShapeCacheStats stats;
+  for (const auto& shape_cache : shape_caches_) {
+    stats += shape_cache.stats();
+  }
+  return stats;
+}
+
+
+void
+RoutePool::ResetShapeCacheStats()
+{
+  for (auto& shape_cache : shape_caches_) {
+    shape_cache.ResetStats();
+  }
+}
+
+
+RoutePath
+RouteArena::Append(const LabelSet& labelset, uint32_t label_idx)
+{
+  std::vector<RouteStep> steps;
+  for (auto idx = label_idx; idx != kInvalidLabelIndex;) {
+    const auto& label = labelset.label(idx);
+    steps.push_back({label.nodeid, label.edgeid,
+                     label.source, label.target,
+                     label.cost, label.turn_cost});
+    idx = label.predecessor;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const RoutePath path{static_cast<uint32_t>(steps_.size()),
+                       static_cast<uint32_t>(steps.size()),
+                       label_idx != kInvalidLabelIndex? labelset.label(label_idx).edgelabel : nullptr};
+  steps_.insert(steps_.end(), steps.begin(), steps.end());
+  return path;
+}
+
 }
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <limits>
 #include <string>
 #include <vector>
 #include <thread>
@@ -17,6 +21,8 @@
 
 #include "mmp/universal_cost.h"
 #include "mmp/map_matching.h"
+#include "mmp/binary_format.h"
+#include "mmp/geojson.h"
 
 using namespace prime_server;
 using namespace valhalla;
@@ -108,399 +114,23 @@ void init_http_status_codes()
 const headers_t::value_type CORS{"Access-Control-Allow-Origin", "*"};
 const headers_t::value_type JSON_MIME{"Content-type", "application/json;charset=utf-8"};
 const headers_t::value_type JS_MIME{"Content-type", "application/javascript;charset=utf-8"};
+const headers_t::value_type BINARY_RESULT_MIME{"Content-type", "application/x-mmp-result"};
 
+// Bodies of this content type are binary traces (see binary_format.h)
+// of which the first one is matched
+const std::string kBinaryTraceMime = "application/x-mmp-trace";
 
-class SequenceParseError: public std::runtime_error {
-  // Need its constructor
-  using std::runtime_error::runtime_error;
-};
-
-
-void parse_json(rapidjson::Document& document, const char* text)
-{
-  document.Parse(text);
-
-  if (document.HasParseError()) {
-    std::string message(GetParseError_En(document.GetParseError()));
-    throw SequenceParseError("Unable to parse JSON body: " + message);
-  }
-}
-
-
-inline bool
-is_geojson_geometry(const rapidjson::Value& geometry)
-{
-  return geometry.IsObject() && geometry.HasMember("coordinates");
-}
-
-
-std::vector<Measurement>
-read_geojson_geometry(const rapidjson::Value& geometry)
-{
-  if (!is_geojson_geometry(geometry)) {
-    throw SequenceParseError("Invalid GeoJSON geometry");
-  }
-
-  // Parse coordinates
-  if (!geometry.HasMember("coordinates")) {
-    throw SequenceParseError("Invalid GeoJSON geometry: coordinates not found");
-  }
-
-  const auto& coordinates = geometry["coordinates"];
-  if (!coordinates.IsArray()) {
-    throw SequenceParseError("Invalid GeoJSON geometry: coordindates is not an array of coordinates");
-  }
-
-  std::vector<Measurement> measurements;
-  for (rapidjson::SizeType i = 0; i < coordinates.Size(); i++) {
-    const auto& coordinate = coordinates[i];
-    if (!coordinate.IsArray()
-        || coordinate.Size() != 2
-        || !coordinate[0].IsNumber()
-        || !coordinate[1].IsNumber()) {
-      throw SequenceParseError("Invalid GeoJSON geometry: coordindate at "
-                               + std::to_string(i)
-                               + " is not a valid coordinate (a array of two numbers)");
-    }
-    auto lng = coordinate[0].GetDouble(),
-         lat = coordinate[1].GetDouble();
-    measurements.emplace_back(midgard::PointLL(lng, lat));
-  }
-
-  return measurements;
-}
-
-
-inline bool
-is_geojson_feature(const rapidjson::Value& object)
-{
-  // Strictly speak a GeoJSON feature must have "id" and "properties",
-  // but in our case they are optional. A full example is as folllows:
-  // {"id": 1, "type": "Feature", "geometry": GEOMETRY, "properties": {"times": [], "radius": []}}
-
-  // We follow Postel's Law: be liberal in what you accept
-  return object.IsObject()
-      // && object.HasMember("type")
-      // && std::string(object["type"].GetString()) == "Feature"
-      && object.HasMember("geometry");
-}
-
-
-std::vector<Measurement>
-read_geojson_feature(const rapidjson::Value& feature)
-{
-  if (!is_geojson_feature(feature)) {
-    throw SequenceParseError("Invalid GeoJSON feature");
-  }
-
-  auto measurements = read_geojson_geometry(feature["geometry"]);
-
-  if (feature.HasMember("properties")) {
-    // TODO add time and accuracy
-  }
-
-  return measurements;
-}
-
-
-std::vector<Measurement> read_geojson(const rapidjson::Value& object)
-{
-  if (is_geojson_feature(object)) {
-    return read_geojson_feature(object);
-  } else if (is_geojson_geometry(object)) {
-    return read_geojson_geometry(object);
-  } else {
-    throw SequenceParseError("Invalid GeoJSON object: expect either Feature or Geometry");
-  }
-}
-
-
-template <typename buffer_t>
-void serialize_coordinate(const midgard::PointLL& coord,
-                          rapidjson::Writer<buffer_t>& writer)
-{
-  writer.StartArray();
-  // TODO lower precision
-  writer.Double(coord.lng());
-  writer.Double(coord.lat());
-  writer.EndArray();
-}
-
-
-template <typename buffer_t>
-void serialize_graphid(const baldr::GraphId& graphid,
-                       rapidjson::Writer<buffer_t>& writer)
-{
-  if (graphid.Is_Valid()) {
-    writer.StartObject();
-
-    writer.String("id");
-    writer.Uint(graphid.id());
-
-    writer.String("level");
-    writer.Uint(graphid.level());
-
-    writer.String("tileid");
-    writer.Uint(graphid.tileid());
-
-    writer.EndObject();
-  } else {
-    writer.Null();
-  }
-}
-
-
-template <typename buffer_t>
-void serialize_geometry_matched_coordinates(const std::vector<MatchResult>& results,
-                                            rapidjson::Writer<buffer_t>& writer)
-{
-  writer.StartObject();
-
-  writer.String("type");
-  writer.String("MultiPoint");
-
-  writer.String("coordinates");
-  writer.StartArray();
-  for (const auto& result : results) {
-    serialize_coordinate(result.lnglat(), writer);
-  }
-  writer.EndArray();
-
-  writer.EndObject();
-}
-
-
-template <typename buffer_t>
-void serialize_geometry_route(const std::vector<MatchResult>& results,
-                              const MapMatching& mm,
-                              rapidjson::Writer<buffer_t>& writer)
-{
-  writer.StartObject();
-
-  writer.String("type");
-  writer.String("MultiLineString");
-
-  writer.String("coordinates");
-  writer.StartArray();
-  const auto& route = ConstructRoute(mm.graphreader(), results.cbegin(), results.cend());
-  bool open = false;
-  for (auto segment = route.cbegin(), prev_segment = route.cend();
-       segment != route.cend(); segment++) {
-    assert(segment->edgeid.Is_Valid());
-    const auto& shape = segment->Shape(mm.graphreader());
-    if (!shape.empty()) {
-      assert(shape.size() >= 2);
-      if (prev_segment != route.cend()
-          && prev_segment->Adjoined(mm.graphreader(), *segment)) {
-        for (auto vertex = std::next(shape.begin()); vertex != shape.end(); vertex++) {
-          serialize_coordinate(*vertex, writer);
-        }
-      } else {
-        if (open) {
-          writer.EndArray();
-          open = false;
-        }
-        writer.StartArray();
-        open = true;
-        for (auto vertex = shape.begin(); vertex != shape.end(); vertex++) {
-          serialize_coordinate(*vertex, writer);
-        }
-      }
-    }
-    prev_segment = segment;
-  }
-  if (open) {
-    writer.EndArray();
-    open = false;
-  }
-  writer.EndArray();
 
-  writer.EndObject();
-}
-
-
-template <typename buffer_t>
-void serialize_routes(const State& state,
-                      const MapMatching& mm,
-                      rapidjson::Writer<buffer_t>& writer)
+bool is_binary_request(const http_request_t& request)
 {
-  if (!state.routed()) {
-    writer.Null();
-    return;
-  }
-
-  writer.StartArray();
-  if (state.time() + 1 < mm.size()) {
-    for (const auto& next_state : mm.states(state.time() + 1)) {
-      auto label = state.RouteBegin(*next_state);
-      if (label != state.RouteEnd()) {
-        writer.StartObject();
-
-        writer.String("next_state");
-        writer.Uint(next_state->id());
-
-        writer.String("edgeid");
-        serialize_graphid(label->edgeid, writer);
-
-        const auto label = state.last_label(*next_state);
-        writer.String("route_distance");
-        writer.Double(label->cost);
-
-        writer.String("route_turn_cost");
-        writer.Double(label->turn_cost);
-
-        writer.String("route");
-        writer.StartArray();
-        for (auto label = state.RouteBegin(*next_state);
-             label != state.RouteEnd();
-             label++) {
-          writer.StartObject();
-
-          writer.String("edgeid");
-          serialize_graphid(label->edgeid, writer);
-
-          writer.String("nodeid");
-          serialize_graphid(label->nodeid, writer);
-
-          writer.String("source");
-          writer.Double(label->source);
-
-          writer.String("target");
-          writer.Double(label->target);
-
-          writer.String("route_distance");
-          writer.Double(label->cost);
-
-          writer.String("turn_cost");
-          writer.Double(label->turn_cost);
-
-          writer.EndObject();
-        }
-        writer.EndArray();
-
-        writer.EndObject();
-      }
+  for (const auto& header : request.headers) {
+    std::string name(header.first);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "content-type") {
+      return header.second.compare(0, kBinaryTraceMime.size(), kBinaryTraceMime) == 0;
     }
   }
-  writer.EndArray();
-}
-
-
-template <typename buffer_t>
-void serialize_state(const State& state,
-                     const MapMatching& mm,
-                     rapidjson::Writer<buffer_t>& writer)
-{
-  writer.StartObject();
-
-  writer.String("id");
-  writer.Uint(state.id());
-
-  writer.String("time");
-  writer.Uint(state.time());
-
-  writer.String("distance");
-  writer.Double(state.candidate().distance());
-
-  writer.String("coordinate");
-  serialize_coordinate(state.candidate().vertex(), writer);
-
-  writer.String("routes");
-  serialize_routes(state, mm, writer);
-
-  writer.EndObject();
-}
-
-
-template <typename buffer_t>
-void serialize_properties(const std::vector<MatchResult>& results,
-                          const MapMatching& mm,
-                          rapidjson::Writer<buffer_t>& writer,
-                          bool verbose)
-{
-  writer.StartObject();
-
-  writer.String("matched_coordinates");
-  writer.StartArray();
-  for (const auto& result : results) {
-    serialize_coordinate(result.lnglat(), writer);
-  }
-  writer.EndArray();
-
-  if (verbose) {
-    writer.String("distances");
-    writer.StartArray();
-    for (const auto& result : results) {
-      writer.Double(result.distance());
-    }
-    writer.EndArray();
-
-    writer.String("graphids");
-    writer.StartArray();
-    for (const auto& result : results) {
-      writer.Uint64(result.graphid().id());
-    }
-    writer.EndArray();
-
-    writer.String("states");
-    writer.StartArray();
-    for (const auto& result : results) {
-      writer.StartArray();
-      if (result.state()) {
-        for (const auto state : mm.states(result.state()->time())) {
-          serialize_state(*state, mm, writer);
-        }
-      }
-      writer.EndArray();
-    }
-    writer.EndArray();
-  }
-
-  writer.EndObject();
-}
-
-
-template <typename buffer_t>
-void serialize_results_as_feature(const std::vector<MatchResult>& results,
-                                  const MapMatching& mm,
-                                  rapidjson::Writer<buffer_t>& writer,
-                                  bool route,
-                                  bool verbose)
-{
-  writer.StartObject();
-
-  writer.String("type");
-  writer.String("Feature");
-
-  writer.String("geometry");
-  if (route) {
-    serialize_geometry_route(results, mm, writer);
-  } else {
-    serialize_geometry_matched_coordinates(results, writer);
-  }
-
-  writer.String("properties");
-  serialize_properties(results, mm, writer, verbose);
-
-  writer.EndObject();
-}
-
-
-template <typename buffer_t>
-void serialize_config(MapMatcher* matcher,
-                      rapidjson::Writer<buffer_t>& writer)
-{
-  // Property tree -> string
-  std::stringstream ss;
-  boost::property_tree::json_parser::write_json(ss, matcher->config());
-  const auto& str = ss.str();
-
-  // String -> JSON document
-  rapidjson::Document document;
-  document.Parse(str.c_str());
-
-  // JSON document -> writer stream
-  document.Accept(writer);
+  return false;
 }
 
 
@@ -653,12 +283,19 @@ class mm_worker_t {
     if (request.method == method_t::POST) {
       std::vector<Measurement> measurements;
       rapidjson::Document json;
+      const bool binary = is_binary_request(request);
 
       // Parse sequence
       try {
-        parse_json(json, request.body.c_str());
-        measurements = read_geojson(json);
-      } catch (const SequenceParseError& ex) {
+        if (binary) {
+          const auto& body = request.body;
+          const auto position = ReadBinaryHeader(body.data(), body.size(), kBinaryTraceMagic);
+          ReadBinaryTrace(body.data() + position, body.size() - position, measurements);
+        } else {
+          parse_json(json, request.body.c_str());
+          measurements = read_geojson(json);
+        }
+      } catch (const std::runtime_error& ex) {
         return jsonify_error(ex.what(), info);
       }
 
@@ -681,7 +318,28 @@ class mm_worker_t {
       }
 
       // Match
+      const auto start = std::chrono::steady_clock::now();
       const auto& results = matcher->OfflineMatch(measurements);
+      if (verbose_) {
+        const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        LOG_INFO("Matched " + std::to_string(matcher->mapmatching().size())
+                 + " states of " + std::to_string(measurements.size())
+                 + " measurements in " + std::to_string(elapsed) + " ms");
+        LOG_INFO("Route labels settled " + std::to_string(matcher->mapmatching().settled_count()));
+      }
+
+      worker_t::result_t result{false};
+      if (binary) {
+        std::string body;
+        AppendBinaryHeader(body, kBinaryResultMagic);
+        AppendBinaryResults(body, results, &matcher->mapmatching());
+        delete matcher;
+
+        http_response_t response(200, http_status_code(200), body, headers_t{CORS, BINARY_RESULT_MIME});
+        response.from_info(info);
+        result.messages.emplace_back(response.to_string());
+        return result;
+      }
 
       // Serialize results
       rapidjson::StringBuffer sb;
@@ -690,7 +348,6 @@ class mm_worker_t {
 
       delete matcher;
 
-      worker_t::result_t result{false};
       http_response_t response(200, http_status_code(200), sb.GetString(), headers_t{CORS, JS_MIME});
       response.from_info(info);
       result.messages.emplace_back(response.to_string());
@@ -702,7 +359,20 @@ class mm_worker_t {
   }
 
   void cleanup()
-  { matcher_factory_.ClearFullCache(); }
+  {
+    matcher_factory_.ClearFullCache();
+    if (verbose_) {
+      const auto& stats = matcher_factory_.grid_cache_stats();
+      LOG_INFO("Grid cache hits " + std::to_string(stats.hits)
+               + " misses " + std::to_string(stats.misses)
+               + " evictions " + std::to_string(stats.evictions));
+      // Shape stats are of this request only
+      const auto shape_stats = matcher_factory_.shape_cache_stats();
+      LOG_INFO("Shape decodes " + std::to_string(shape_stats.decodes)
+               + " cache hits " + std::to_string(shape_stats.hits));
+      matcher_factory_.ResetShapeCacheStats();
+    }
+  }
 
  protected:
   const boost::property_tree::ptree config_;
@@ -0,0 +1,91 @@
+#include "mmp/shape_cache.h"
+
+using namespace valhalla;
+
+
+namespace mmp {
+
+constexpr size_t ShapeCache::kDefaultMaxSize;
+
+
+ShapeCache::ShapeCache(size_t max_size)
+    : max_size_(max_size),
+      size_(0),
+      tiles_(),
+      order_(),
+      stats_() {}
+
+
+ShapeCache::Shape
+ShapeCache::Get(const baldr::GraphTile* tile, const baldr::DirectedEdge* edge)
+{
+  const auto tile_id = tile->id();
+  const uint32_t key = (tile_id.tileid() << 3) | tile_id.level();
+
+  auto it = tiles_.find(key);
+  if (it == tiles_.end()) {
+    it = tiles_.emplace(key, TileShapes{tile, {}}).first;
+    order_.push_back(key);
+  } else if (it->second.tile != tile) {
+    // The tile has been reloaded since
+    size_ -= it->second.shapes.size();
+    it->second.shapes.clear();
+    it->second.tile = tile;
+  }
+
+  auto& shape = it->second.shapes[edge->edgeinfo_offset()];
+  if (shape) {
+    stats_.hits++;
+    return shape;
+  }
+
+  const auto edgeinfo = tile->edgeinfo(edge->edgeinfo_offset());
+  shape = std::make_shared<const std::vector<midgard::PointLL>>(edgeinfo->shape());
+  stats_.decodes++;
+  size_++;
+
+  // Copy it before the entry may be erased by the eviction
+  const auto result = shape;
+  Evict(key);
+  return result;
+}
+
+
+void
+ShapeCache::set_max_size(size_t max_size)
+{
+  max_size_ = max_size;
+  // No key is kept since tile ids are far below it
+  Evict(~0u);
+}
+
+
+void
+ShapeCache::Evict(uint32_t keep)
+{
+  while (size_ > max_size_ && !order_.empty()) {
+    const auto key = order_.front();
+    order_.pop_front();
+    if (key == keep) {
+      order_.push_back(key);
+      if (order_.size() == 1) {
+        break;
+      }
+      continue;
+    }
+    const auto it = tiles_.find(key);
+    size_ -= it->second.shapes.size();
+    tiles_.erase(it);
+  }
+}
+
+
+void
+ShapeCache::Clear()
+{
+  tiles_.clear();
+  order_.clear();
+  size_ = 0;
+}
+
+}
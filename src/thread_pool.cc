@@ -0,0 +1,75 @@
+#include <stdexcept>
+
+#include "mmp/thread_pool.h"
+
+
+namespace mmp {
+
+ThreadPool::ThreadPool(size_t count)
+    : workers_(),
+      tasks_(),
+      mutex_(),
+      condition_(),
+      stopped_(false)
+{
+  if (!count) {
+    throw std::invalid_argument("Expect at least one worker thread");
+  }
+
+  workers_.reserve(count);
+  for (size_t worker = 0; worker < count; worker++) {
+    workers_.emplace_back(&ThreadPool::work, this, worker);
+  }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  condition_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+
+std::future<void>
+ThreadPool::Submit(task_t task)
+{
+  std::packaged_task<void(size_t)> packaged_task(std::move(task));
+  auto future = packaged_task.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_) {
+      throw std::runtime_error("Can't submit tasks to a stopped thread pool");
+    }
+    tasks_.push(std::move(packaged_task));
+  }
+  condition_.notify_one();
+  return future;
+}
+
+
+void
+ThreadPool::work(size_t worker)
+{
+  while (true) {
+    std::packaged_task<void(size_t)> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this] { return stopped_ || !tasks_.empty(); });
+      // Drain the queue before stopping
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop();
+    }
+    task(worker);
+  }
+}
+
+}
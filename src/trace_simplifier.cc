@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include <valhalla/midgard/distanceapproximator.h>
+
+#include "mmp/geometry_helpers.h"
+#include "mmp/trace_simplifier.h"
+
+using namespace valhalla;
+
+
+namespace mmp {
+
+DistanceSimplifier::DistanceSimplifier(float min_distance)
+    : min_distance_(min_distance)
+{
+  if (min_distance_ < 0.f) {
+    throw std::invalid_argument("Expect interpolation distance to be nonnegative");
+  }
+}
+
+
+std::vector<size_t>
+DistanceSimplifier::Simplify(const std::vector<midgard::PointLL>& locations) const
+{
+  std::vector<size_t> indexes;
+  if (locations.empty()) {
+    return indexes;
+  }
+
+  const float sq_min_distance = min_distance_ * min_distance_;
+  const size_t end_idx = locations.size() - 1;
+  for (size_t idx = 0, last_idx = 0; idx <= end_idx; idx++) {
+    if (idx == 0 || idx == end_idx
+        || sq_min_distance <= locations[last_idx].DistanceSquared(locations[idx])) {
+      indexes.push_back(idx);
+      last_idx = idx;
+    }
+  }
+  return indexes;
+}
+
+
+DouglasPeuckerSimplifier::DouglasPeuckerSimplifier(float tolerance, float min_distance, float max_distance)
+    : tolerance_(tolerance),
+      decimator_(min_distance),
+      max_distance_(max_distance)
+{
+  if (tolerance_ < 0.f) {
+    throw std::invalid_argument("Expect simplification tolerance to be nonnegative");
+  }
+  if (max_distance_ <= 0.f) {
+    throw std::invalid_argument("Expect simplification max distance to be positive");
+  }
+}
+
+
+std::vector<size_t>
+DouglasPeuckerSimplifier::Simplify(const std::vector<midgard::PointLL>& locations) const
+{
+  // Drop the clusters of noise first, e.g. at stops
+  const auto candidates = decimator_.Simplify(locations);
+  if (candidates.size() <= 2) {
+    return candidates;
+  }
+
+  std::vector<bool> kept(candidates.size(), false);
+  kept.front() = kept.back() = true;
+
+  const float sq_tolerance = tolerance_ * tolerance_,
+           sq_max_distance = max_distance_ * max_distance_;
+
+  // Ranges of the candidates to split, iteratively since traces can
+  // be long enough to overflow the stack
+  std::vector<std::pair<size_t, size_t>> ranges{{0, candidates.size() - 1}};
+  std::vector<midgard::PointLL> line(2);
+  while (!ranges.empty()) {
+    size_t first, last;
+    std::tie(first, last) = ranges.back();
+    ranges.pop_back();
+    if (last - first < 2) {
+      continue;
+    }
+
+    line[0] = locations[candidates[first]];
+    line[1] = locations[candidates[last]];
+    size_t farthest = first + 1;
+    float farthest_sq_distance = -1.f;
+    for (size_t idx = first + 1; idx < last; idx++) {
+      const auto& location = locations[candidates[idx]];
+      float sq_distance;
+      std::tie(std::ignore, sq_distance, std::ignore, std::ignore)
+          = helpers::Project(location, line, midgard::DistanceApproximator(location));
+      if (sq_distance > farthest_sq_distance) {
+        farthest = idx;
+        farthest_sq_distance = sq_distance;
+      }
+    }
+
+    // Split long straight runs in the middle to keep it linear
+    size_t split;
+    if (sq_tolerance < farthest_sq_distance) {
+      split = farthest;
+    } else if (sq_max_distance < line[0].DistanceSquared(line[1])) {
+      split = first + (last - first) / 2;
+    } else {
+      continue;
+    }
+    kept[split] = true;
+    ranges.emplace_back(first, split);
+    ranges.emplace_back(split, last);
+  }
+
+  std::vector<size_t> indexes;
+  for (size_t idx = 0; idx < candidates.size(); idx++) {
+    if (kept[idx]) {
+      indexes.push_back(candidates[idx]);
+    }
+  }
+  return indexes;
+}
+
+
+std::vector<size_t>
+simplify_trace(const TraceSimplifier& simplifier,
+               const std::vector<midgard::PointLL>& locations)
+{
+  auto indexes = simplifier.Simplify(locations);
+  if (locations.empty()) {
+    if (!indexes.empty()) {
+      throw std::logic_error("Expect no locations to be matched of an empty trace");
+    }
+    return indexes;
+  }
+
+  if (indexes.empty() || indexes.front() != 0 || indexes.back() != locations.size() - 1) {
+    throw std::logic_error("Expect the first and the last location to be matched");
+  }
+  if (std::adjacent_find(indexes.begin(), indexes.end(), std::greater_equal<size_t>()) != indexes.end()) {
+    throw std::logic_error("Expect the matched locations to be in ascending order without duplicates");
+  }
+  return indexes;
+}
+
+
+std::unique_ptr<TraceSimplifier>
+create_trace_simplifier(const boost::property_tree::ptree& config)
+{
+  const auto name = config.get<std::string>("simplification", "distance");
+  const auto interpolation_distance = config.get<float>("interpolation_distance");
+
+  if (name == "distance") {
+    return std::unique_ptr<TraceSimplifier>(new DistanceSimplifier(interpolation_distance));
+  }
+
+  if (name == "douglas_peucker") {
+    const auto tolerance = config.get<float>("simplification_tolerance", 1.f) * config.get<float>("sigma_z");
+    return std::unique_ptr<TraceSimplifier>(
+        new DouglasPeuckerSimplifier(tolerance, interpolation_distance,
+                                     config.get<float>("simplification_max_distance", 200.f)));
+  }
+
+  throw std::invalid_argument("Invalid simplification name: " + name);
+}
+
+}
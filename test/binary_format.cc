@@ -0,0 +1,263 @@
+// -*- mode: c++ -*-
+
+#undef NDEBUG
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mmp/binary_format.h"
+#include "mmp/graph_helpers.h"
+
+using namespace mmp;
+using namespace valhalla;
+
+
+std::vector<Measurement> MakeTrace(bool optional_columns)
+{
+  std::vector<Measurement> trace;
+  for (size_t idx = 0; idx < 5; idx++) {
+    trace.emplace_back(midgard::PointLL(13.4f + idx * 0.0001f, 52.5f - idx * 0.0001f));
+    if (optional_columns) {
+      trace.back().set_time(1475000000.0 + idx);
+      // Leave some unknown
+      if (idx % 2) {
+        trace.back().set_accuracy(5.f + idx);
+        trace.back().set_heading(idx * 45.f);
+      }
+    }
+  }
+  return trace;
+}
+
+
+bool SameTrace(const std::vector<Measurement>& lhs, const std::vector<Measurement>& rhs, float tolerance)
+{
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  for (size_t idx = 0; idx < lhs.size(); idx++) {
+    if (std::abs(lhs[idx].lnglat().lng() - rhs[idx].lnglat().lng()) > tolerance
+        || std::abs(lhs[idx].lnglat().lat() - rhs[idx].lnglat().lat()) > tolerance
+        || lhs[idx].has_time() != rhs[idx].has_time()
+        || (lhs[idx].has_time() && lhs[idx].time() != rhs[idx].time())
+        || lhs[idx].has_accuracy() != rhs[idx].has_accuracy()
+        || (lhs[idx].has_accuracy() && lhs[idx].accuracy() != rhs[idx].accuracy())
+        || lhs[idx].has_heading() != rhs[idx].has_heading()
+        || (lhs[idx].has_heading() && lhs[idx].heading() != rhs[idx].heading())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void TestTraces()
+{
+  std::string out;
+  AppendBinaryHeader(out, kBinaryTraceMagic);
+  AppendBinaryTrace(out, MakeTrace(false));
+  AppendBinaryTrace(out, MakeTrace(true));
+  AppendBinaryTrace(out, MakeTrace(true), true);
+  AppendBinaryTrace(out, {});
+  assert(out.size() % 8 == 0);
+
+  size_t position = ReadBinaryHeader(out.data(), out.size(), kBinaryTraceMagic);
+  std::vector<Measurement> trace;
+  position += ReadBinaryTrace(out.data() + position, out.size() - position, trace);
+  assert(SameTrace(trace, MakeTrace(false), 0.f));
+  position += ReadBinaryTrace(out.data() + position, out.size() - position, trace);
+  assert(SameTrace(trace, MakeTrace(true), 0.f));
+  // Fixed-point coordinates are accurate to 1e-7 degrees
+  position += ReadBinaryTrace(out.data() + position, out.size() - position, trace);
+  assert(SameTrace(trace, MakeTrace(true), 1e-6f));
+  position += ReadBinaryTrace(out.data() + position, out.size() - position, trace);
+  assert(trace.empty());
+  assert(position == out.size());
+
+  // The same from a stream
+  std::istringstream in(out.substr(sizeof(BinaryFileHeader)));
+  std::string buffer;
+  size_t count = 0;
+  while (ReadBinaryTrace(in, buffer, trace)) {
+    count++;
+  }
+  assert(count == 4);
+}
+
+
+void TestResults()
+{
+  const std::vector<MatchResult> results{
+    MatchResult(midgard::PointLL(13.4f, 52.5f)),
+    MatchResult(midgard::PointLL(13.5f, 52.6f), 3.5f, baldr::GraphId(123, 2, 45), GraphType::kEdge),
+    MatchResult(midgard::PointLL(13.6f, 52.7f), 1.f, baldr::GraphId(124, 2, 6), GraphType::kNode)};
+
+  std::string out;
+  AppendBinaryHeader(out, kBinaryResultMagic);
+  AppendBinaryResults(out, results);
+  AppendBinaryError(out, "Invalid GeoJSON object");
+
+  size_t position = ReadBinaryHeader(out.data(), out.size(), kBinaryResultMagic);
+  std::vector<BinaryResult> read;
+  std::string error;
+  position += ReadBinaryResults(out.data() + position, out.size() - position, read, error);
+  assert(error.empty() && read.size() == results.size());
+  for (size_t idx = 0; idx < results.size(); idx++) {
+    assert(read[idx].lnglat == results[idx].lnglat());
+    assert(read[idx].graphid == results[idx].graphid());
+    assert(read[idx].distance == results[idx].distance());
+    assert(read[idx].graphtype == results[idx].graphtype());
+    // Unknown without the matching
+    assert(read[idx].offset < 0.f);
+  }
+
+  position += ReadBinaryResults(out.data() + position, out.size() - position, read, error);
+  assert(read.empty() && error == "Invalid GeoJSON object");
+  assert(position == out.size());
+}
+
+
+template <typename function_t>
+bool Throws(function_t function)
+{
+  try {
+    function();
+  } catch (const std::runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+
+void TestInvalid()
+{
+  std::string out;
+  AppendBinaryHeader(out, kBinaryTraceMagic);
+  assert(Throws([&out]() { ReadBinaryHeader(out.data(), out.size(), kBinaryResultMagic); }));
+  assert(Throws([&out]() { ReadBinaryHeader(out.data(), out.size() - 1, kBinaryTraceMagic); }));
+
+  std::string record;
+  AppendBinaryTrace(record, MakeTrace(true));
+  std::vector<Measurement> trace;
+  assert(Throws([&]() { ReadBinaryTrace(record.data(), record.size() - 8, trace); }));
+  assert(Throws([&]() { ReadBinaryTrace(record.data(), 4, trace); }));
+
+  // Results aren't traces
+  std::string results;
+  AppendBinaryError(results, "error");
+  assert(Throws([&]() { ReadBinaryTrace(results.data(), results.size(), trace); }));
+
+  std::istringstream in(record.substr(0, record.size() - 8));
+  std::string buffer;
+  assert(Throws([&]() { ReadBinaryTrace(in, buffer, trace); }));
+}
+
+
+// A record of a measurement at the origin, and another one with the
+// values given
+std::string MakeRecord(const midgard::PointLL& lnglat, float heading, float accuracy, double time)
+{
+  std::string record;
+  AppendBinaryTrace(record, {Measurement(midgard::PointLL(0.f, 0.f), 0.f, 5.f, 10.0),
+                             Measurement(lnglat, heading, accuracy, time)});
+  return record;
+}
+
+
+void TestValidation()
+{
+  const midgard::PointLL origin(0.f, 0.f);
+  std::vector<Measurement> trace;
+
+  // As GeoJSON properties, out of the ranges
+  for (const auto& record : {MakeRecord(origin, 720.f, 5.f, 11.0),
+                             MakeRecord(origin, 360.f, 5.f, 11.0),
+                             MakeRecord(origin, NAN, 5.f, 11.0),
+                             MakeRecord(origin, 0.f, INFINITY, 11.0),
+                             MakeRecord(origin, 0.f, 5.f, 9.0),
+                             MakeRecord(midgard::PointLL(NAN, 0.f), 0.f, 5.f, 11.0),
+                             MakeRecord(midgard::PointLL(0.f, INFINITY), 0.f, 5.f, 11.0)}) {
+    assert(Throws([&]() { ReadBinaryTrace(record.data(), record.size(), trace); }));
+  }
+
+  // Tiny accuracies are raised, and negative values are unknown
+  auto record = MakeRecord(origin, 359.f, 0.f, 10.0);
+  ReadBinaryTrace(record.data(), record.size(), trace);
+  assert(trace[1].heading() == 359.f && trace[1].accuracy() == 0.01f && trace[1].time() == 10.0);
+  record = MakeRecord(origin, -2.f, -1.f, 11.0);
+  ReadBinaryTrace(record.data(), record.size(), trace);
+  assert(!trace[1].has_heading() && !trace[1].has_accuracy());
+
+  // Streams don't allocate for absurd lengths
+  BinaryRecordHeader header{uint64_t(1) << 40, 1, 0};
+  std::istringstream in(std::string(reinterpret_cast<const char*>(&header), sizeof(header)));
+  std::string buffer;
+  assert(Throws([&]() { ReadBinaryTrace(in, buffer, trace); }));
+  assert(buffer.empty());
+}
+
+
+void TestEdgeOffset()
+{
+  // Offsets of results are along the directed edges, as those of
+  // candidates are, whereas shapes go along the forward edges
+  baldr::DirectedEdge forward, backward;
+  forward.set_forward(true);
+  backward.set_forward(false);
+  assert(helpers::edge_offset(&forward, 0.25f) == 0.25f);
+  assert(helpers::edge_offset(&backward, 0.25f) == 0.75f);
+  assert(helpers::edge_offset(&backward, 0.f) == 1.f);
+}
+
+
+void TestFile()
+{
+  const std::string path = "test_binary_traces.bin";
+  std::string out;
+  AppendBinaryHeader(out, kBinaryTraceMagic);
+  for (size_t idx = 0; idx < 100; idx++) {
+    AppendBinaryTrace(out, MakeTrace(idx % 2));
+  }
+  std::ofstream(path, std::ios::binary).write(out.data(), out.size());
+
+  {
+    BinaryTraceFile file(path);
+    std::vector<Measurement> trace;
+    size_t count = 0;
+    while (file.Next(trace)) {
+      assert(SameTrace(trace, MakeTrace(count % 2), 0.f));
+      count++;
+    }
+    assert(count == 100);
+  }
+  std::remove(path.c_str());
+
+  assert(Throws([]() { BinaryTraceFile("not_a_binary_trace_file.bin"); }));
+}
+
+
+int main(int argc, char *argv[])
+{
+  TestTraces();
+
+  TestResults();
+
+  TestInvalid();
+
+  TestValidation();
+
+  TestEdgeOffset();
+
+  TestFile();
+
+  std::cout << "all tests passed" << std::endl;
+
+  return 0;
+}
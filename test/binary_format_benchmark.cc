@@ -0,0 +1,236 @@
+// -*- mode: c++ -*-
+
+// Compare the binary format with GeoJSON on synthetic random walk
+// traces (with times and accuracies): the time to write and to read
+// the traces, the time to write results of the same columns (matched
+// points, distances and graph ids, as in the verbose service response
+// but without states), and their sizes
+//
+// usage: binary_format_benchmark [TRACE_COUNT [TRACE_SIZE]]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+
+#include "mmp/binary_format.h"
+#include "mmp/geojson.h"
+
+using namespace mmp;
+using namespace valhalla;
+
+
+// About 10 meters in degrees
+constexpr float kStep = 0.0001f;
+
+
+std::vector<std::vector<Measurement>> MakeTraces(size_t trace_count, size_t trace_size)
+{
+  std::mt19937 generator(2016);
+  std::uniform_real_distribution<float> step(-kStep, kStep), accuracy(3.f, 20.f);
+  std::vector<std::vector<Measurement>> traces(trace_count);
+  for (auto& trace : traces) {
+    midgard::PointLL location(13.4f + step(generator) * 1000, 52.5f + step(generator) * 1000);
+    for (size_t idx = 0; idx < trace_size; idx++) {
+      location = midgard::PointLL(location.lng() + step(generator), location.lat() + step(generator));
+      trace.emplace_back(location, -1.f, accuracy(generator), 1475000000.0 + idx);
+    }
+  }
+  return traces;
+}
+
+
+std::vector<MatchResult> MakeResults(const std::vector<Measurement>& trace)
+{
+  std::vector<MatchResult> results;
+  results.reserve(trace.size());
+  for (size_t idx = 0; idx < trace.size(); idx++) {
+    results.emplace_back(trace[idx].lnglat(), 5.f, baldr::GraphId(123, 2, idx), GraphType::kEdge);
+  }
+  return results;
+}
+
+
+void WriteGeoJSON(const std::vector<Measurement>& trace, rapidjson::Writer<rapidjson::StringBuffer>& writer)
+{
+  writer.StartObject();
+  writer.String("type");
+  writer.String("Feature");
+  writer.String("geometry");
+  writer.StartObject();
+  writer.String("type");
+  writer.String("LineString");
+  writer.String("coordinates");
+  writer.StartArray();
+  for (const auto& measurement : trace) {
+    serialize_coordinate(measurement.lnglat(), writer);
+  }
+  writer.EndArray();
+  writer.EndObject();
+  writer.String("properties");
+  writer.StartObject();
+  writer.String("times");
+  writer.StartArray();
+  for (const auto& measurement : trace) {
+    writer.Double(measurement.time());
+  }
+  writer.EndArray();
+  writer.String("accuracies");
+  writer.StartArray();
+  for (const auto& measurement : trace) {
+    writer.Double(measurement.accuracy());
+  }
+  writer.EndArray();
+  writer.EndObject();
+  writer.EndObject();
+}
+
+
+void WriteGeoJSON(const std::vector<MatchResult>& results, rapidjson::Writer<rapidjson::StringBuffer>& writer)
+{
+  writer.StartObject();
+  writer.String("type");
+  writer.String("Feature");
+  writer.String("geometry");
+  serialize_geometry_matched_coordinates(results, writer);
+  writer.String("properties");
+  writer.StartObject();
+  writer.String("distances");
+  writer.StartArray();
+  for (const auto& result : results) {
+    writer.Double(result.distance());
+  }
+  writer.EndArray();
+  writer.String("graphids");
+  writer.StartArray();
+  for (const auto& result : results) {
+    writer.Uint64(result.graphid().value);
+  }
+  writer.EndArray();
+  writer.EndObject();
+  writer.EndObject();
+}
+
+
+template <typename function_t>
+double Seconds(function_t function)
+{
+  const auto start = std::chrono::steady_clock::now();
+  function();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+void Print(const std::string& name, size_t trace_count, double seconds, size_t bytes)
+{
+  std::cout << name << ": " << seconds * 1e6 / trace_count << " us per trace, "
+            << static_cast<size_t>(trace_count / seconds) << " traces/s";
+  if (bytes) {
+    std::cout << ", " << bytes / trace_count << " bytes per trace";
+  }
+  std::cout << std::endl;
+}
+
+
+int main(int argc, char *argv[])
+{
+  const size_t trace_count = argc > 1? std::atoi(argv[1]) : 10000,
+                trace_size = argc > 2? std::atoi(argv[2]) : 100;
+  if (!trace_count) {
+    std::cerr << "Expect a positive trace count" << std::endl;
+    return 1;
+  }
+
+  const auto traces = MakeTraces(trace_count, trace_size);
+  std::vector<std::vector<MatchResult>> results;
+  results.reserve(traces.size());
+  for (const auto& trace : traces) {
+    results.push_back(MakeResults(trace));
+  }
+
+  // GeoJSON, a line per trace
+  std::vector<std::string> lines;
+  lines.reserve(traces.size());
+  size_t geojson_size = 0;
+  const auto geojson_write = Seconds([&]() {
+      for (const auto& trace : traces) {
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+        WriteGeoJSON(trace, writer);
+        lines.emplace_back(sb.GetString());
+        geojson_size += lines.back().size() + 1;
+      }
+    });
+
+  size_t measurement_count = 0;
+  const auto geojson_read = Seconds([&]() {
+      for (const auto& line : lines) {
+        rapidjson::Document json;
+        parse_json(json, line.c_str());
+        measurement_count += read_geojson(json).size();
+      }
+    });
+
+  size_t geojson_results_size = 0;
+  const auto geojson_results = Seconds([&]() {
+      for (const auto& trace_results : results) {
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+        WriteGeoJSON(trace_results, writer);
+        geojson_results_size += sb.GetSize() + 1;
+      }
+    });
+
+  // Binary, of float and of fixed-point coordinates
+  size_t binary_count = 0;
+  for (const bool fixed_point : {false, true}) {
+    std::string out;
+    const auto binary_write = Seconds([&]() {
+        AppendBinaryHeader(out, kBinaryTraceMagic);
+        for (const auto& trace : traces) {
+          AppendBinaryTrace(out, trace, fixed_point);
+        }
+      });
+
+    const auto binary_read = Seconds([&]() {
+        std::vector<Measurement> trace;
+        auto position = ReadBinaryHeader(out.data(), out.size(), kBinaryTraceMagic);
+        while (position < out.size()) {
+          position += ReadBinaryTrace(out.data() + position, out.size() - position, trace);
+          binary_count += trace.size();
+        }
+      });
+
+    const std::string name = fixed_point? "binary (fixed point)" : "binary";
+    Print(name + " traces written", trace_count, binary_write, out.size());
+    Print(name + " traces read", trace_count, binary_read, 0);
+  }
+
+  std::string binary_results;
+  const auto binary_results_write = Seconds([&]() {
+      AppendBinaryHeader(binary_results, kBinaryResultMagic);
+      for (const auto& trace_results : results) {
+        AppendBinaryResults(binary_results, trace_results);
+      }
+    });
+
+  Print("GeoJSON traces written", trace_count, geojson_write, geojson_size);
+  Print("GeoJSON traces read", trace_count, geojson_read, 0);
+  Print("GeoJSON results written", trace_count, geojson_results, geojson_results_size);
+  Print("binary results written", trace_count, binary_results_write, binary_results.size());
+
+  if (measurement_count * 2 != binary_count) {
+    std::cerr << "Read " << binary_count << " measurements from binary but "
+              << measurement_count * 2 << " expected" << std::endl;
+    return 2;
+  }
+
+  return 0;
+}
@@ -0,0 +1,117 @@
+// -*- mode: c++ -*-
+
+#undef NDEBUG
+
+#include <cassert>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "mmp/candidate_search.h"
+
+using namespace mmp;
+using namespace valhalla;
+
+
+void TestSnapToEnds()
+{
+  const midgard::PointLL location(13.40001f, 52.50001f);
+  const std::vector<midgard::PointLL> shape{{13.4f, 52.5f}, {13.4001f, 52.5f}, {13.4002f, 52.5f}};
+  const midgard::PointLL projection(13.40001f, 52.5f);
+  const float sq_radius = 100.f * 100.f;
+
+  // Near the front
+  auto point = projection;
+  float sq_distance = 1.f, offset = 0.05f;
+  SnapToEnds(location, sq_radius, 2.f, shape, 1.f, 20.f, point, sq_distance, offset);
+  assert(point == shape.front() && offset == 0.f);
+  assert(sq_distance == midgard::DistanceApproximator(location).DistanceSquared(shape.front()));
+
+  // Near the back
+  point = projection;
+  sq_distance = 1.f;
+  offset = 0.95f;
+  SnapToEnds(location, sq_radius, 2.f, shape, 19.f, 20.f, point, sq_distance, offset);
+  assert(point == shape.back() && offset == 1.f);
+
+  // Both ends are within the snap distance of a short shape: the
+  // nearer one is taken
+  point = projection;
+  offset = 0.3f;
+  SnapToEnds(location, sq_radius, 2.f, shape, 1.f, 3.f, point, sq_distance, offset);
+  assert(point == shape.front() && offset == 0.f);
+  point = projection;
+  offset = 0.7f;
+  SnapToEnds(location, sq_radius, 2.f, shape, 2.f, 3.f, point, sq_distance, offset);
+  assert(point == shape.back() && offset == 1.f);
+
+  // Too far along the shape, or no snapping
+  for (const float snap_distance : {0.5f, 0.f}) {
+    point = projection;
+    sq_distance = 1.f;
+    offset = 0.05f;
+    SnapToEnds(location, sq_radius, snap_distance, shape, 1.f, 20.f, point, sq_distance, offset);
+    assert(point == projection && sq_distance == 1.f && offset == 0.05f);
+  }
+
+  // The end is out of the radius
+  point = projection;
+  sq_distance = 0.f;
+  offset = 0.05f;
+  SnapToEnds(location, 0.5f, 2.f, shape, 1.f, 20.f, point, sq_distance, offset);
+  assert(point == projection && offset == 0.05f);
+}
+
+
+Candidate MakeCandidate(const std::vector<baldr::GraphId>& edgeids, float dist, float sq_distance)
+{
+  Candidate candidate(baldr::Location(midgard::PointLL(13.4f, 52.5f), baldr::Location::StopType::BREAK));
+  for (const auto& edgeid : edgeids) {
+    candidate.CorrelateEdge(Candidate::PathEdge(edgeid, dist));
+  }
+  candidate.set_sq_distance(sq_distance);
+  return candidate;
+}
+
+
+void TestMergeNodeCandidate()
+{
+  const baldr::GraphId node(123, 2, 1), other_node(123, 2, 2),
+                     edge1(123, 2, 10), edge2(123, 2, 11), edge3(123, 2, 12);
+  std::unordered_map<baldr::GraphId, size_t> node_candidates;
+  std::vector<Candidate> candidates;
+
+  // Edges of a node that are found again are not added twice
+  MergeNodeCandidate(MakeCandidate({edge1}, 1.f, 4.f), node, node_candidates, candidates);
+  MergeNodeCandidate(MakeCandidate({edge2, edge1}, 0.f, 9.f), node, node_candidates, candidates);
+  MergeNodeCandidate(MakeCandidate({edge2}, 0.f, 9.f), node, node_candidates, candidates);
+  assert(candidates.size() == 1);
+  const auto& edges = candidates.front().edges();
+  assert(edges.size() == 2 && edges[0].id == edge1 && edges[1].id == edge2);
+  assert(edges[0].dist == 1.f && edges[1].dist == 0.f);
+  // The first one found keeps its distance
+  assert(candidates.front().sq_distance() == 4.f);
+
+  // Candidates of another node, or of none, are added
+  MergeNodeCandidate(MakeCandidate({edge3}, 1.f, 1.f), other_node, node_candidates, candidates);
+  MergeNodeCandidate(MakeCandidate({edge1}, 0.5f, 1.f), baldr::GraphId(), node_candidates, candidates);
+  MergeNodeCandidate(MakeCandidate({edge1}, 0.5f, 1.f), baldr::GraphId(), node_candidates, candidates);
+  assert(candidates.size() == 4);
+  assert(node_candidates.size() == 2 && node_candidates[node] == 0 && node_candidates[other_node] == 1);
+
+  // Later edges of the other node go to its candidate
+  MergeNodeCandidate(MakeCandidate({edge1}, 0.f, 1.f), other_node, node_candidates, candidates);
+  assert(candidates.size() == 4 && candidates[1].edges().size() == 2);
+}
+
+
+int main(int argc, char *argv[])
+{
+  TestSnapToEnds();
+
+  TestMergeNodeCandidate();
+
+  std::cout << "all tests passed" << std::endl;
+
+  return 0;
+}
@@ -7,6 +7,8 @@
 #include <iostream>
 
 #include <valhalla/midgard/point2.h>
+#include <valhalla/midgard/pointll.h>
+#include <valhalla/midgard/distanceapproximator.h>
 
 #include "mmp/geometry_helpers.h"
 
@@ -54,10 +56,84 @@ void TestClipLineString()
 }
 
 
+void TestSegmentBufferClosest()
+{
+  using valhalla::midgard::PointLL;
+  using valhalla::midgard::DistanceApproximator;
+
+  const std::vector<PointLL> shape{{13.40, 52.50}, {13.401, 52.5005}, {13.402, 52.5001}, {13.4025, 52.501}, {13.4025, 52.501}};
+  const std::vector<PointLL> points{{13.4012, 52.5001}, {13.3990, 52.4995}, {13.4030, 52.5020}, {13.4021, 52.5004}};
+
+  SegmentBuffer buffer;
+  bool thrown = false;
+  try {
+    float sq_distance, scale;
+    buffer.Closest(sq_distance, scale);
+  } catch (const std::logic_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  for (const auto& point : points) {
+    buffer.Reset(point);
+    for (size_t i = 1; i < shape.size(); i++) {
+      buffer.Append(shape[i - 1], shape[i]);
+    }
+    assert(buffer.size() == shape.size() - 1);
+
+    float sq_distance, scale;
+    const auto closest = buffer.Closest(sq_distance, scale);
+    assert(0.f <= scale && scale <= 1.f);
+
+    // Up to the float precision of coordinates
+    const DistanceApproximator approximator(point);
+    const auto located = LocateAlong(shape[closest], shape[closest + 1], scale);
+    assert(approximate(std::sqrt(approximator.DistanceSquared(located)), std::sqrt(sq_distance), 0.5f));
+
+    // Project projects in degrees, so it can only be as close
+    const auto projection = Project(point, shape, approximator);
+    assert(std::sqrt(sq_distance) <= std::sqrt(std::get<1>(projection)) + 0.5f);
+    assert(std::sqrt(std::get<1>(projection)) - std::sqrt(sq_distance) < 2.f);
+
+    // Closest of a range of the projected segments
+    for (size_t begin = 0; begin < buffer.size(); begin++) {
+      float range_sq_distance, range_scale;
+      const auto range_closest = buffer.Closest(begin, buffer.size(), range_sq_distance, range_scale);
+      assert(begin <= range_closest && range_closest < buffer.size());
+      assert(range_sq_distance >= sq_distance);
+      if (begin <= closest) {
+        assert(range_closest == closest && range_sq_distance == sq_distance && range_scale == scale);
+      }
+    }
+  }
+
+  // Empty ranges and segments not projected yet
+  thrown = false;
+  try {
+    float sq_distance, scale;
+    buffer.Closest(1, 1, sq_distance, scale);
+  } catch (const std::logic_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+  buffer.Append(shape[0], shape[1]);
+  thrown = false;
+  try {
+    float sq_distance, scale;
+    buffer.Closest(0, buffer.size(), sq_distance, scale);
+  } catch (const std::logic_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+
 int main(int argc, char *argv[])
 {
   TestClipLineString();
 
+  TestSegmentBufferClosest();
+
   std::cout << "all tests passed" << std::endl;
   return 0;
 }
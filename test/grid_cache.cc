@@ -0,0 +1,254 @@
+// -*- mode: c++ -*-
+
+#undef NDEBUG
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mmp/grid_cache.h"
+
+using namespace mmp;
+using namespace valhalla;
+
+
+// A grid of one cell with one segment of the tile, placed at x = tileid
+GridRangeQuery<SegmentId> MakeGrid(uint32_t tileid, std::weak_ptr<const void>* storage_ref = nullptr)
+{
+  auto storage = std::make_shared<std::pair<std::vector<uint32_t>, std::vector<SegmentId>>>();
+  storage->first = {0, 1};
+  storage->second = {SegmentId(baldr::GraphId(tileid, 2, 0), 0)};
+  if (storage_ref) {
+    *storage_ref = storage;
+  }
+  return GridRangeQuery<SegmentId>(BoundingBox(tileid, 0, tileid + 1, 1), 1.f, 1.f,
+                                   storage->first.data(), storage->second.data(), 1, storage);
+}
+
+
+bool IsGridOf(const GridRangeQuery<SegmentId>* grid, uint32_t tileid)
+{
+  return grid
+      && grid->bbox().minx() == tileid
+      && grid->size() == 1
+      && grid->items()[0].edgeid() == baldr::GraphId(tileid, 2, 0);
+}
+
+
+void TestGet()
+{
+  GridCache cache(1.f, 1.f);
+  auto reader = cache.Register();
+  cache.Pin(reader);
+
+  size_t build_count = 0;
+  const auto build = [&build_count]() {
+    build_count++;
+    return MakeGrid(7);
+  };
+
+  bool hit;
+  const auto grid = cache.Get(reader, baldr::GraphId(7, 2, 0), 1, build, hit);
+  assert(!hit && build_count == 1);
+  assert(IsGridOf(grid, 7));
+  assert(cache.size() == 1 && cache.memory_size() == grid->memory_size());
+
+  // Any id in the tile finds it
+  assert(cache.Get(reader, baldr::GraphId(7, 2, 1234), 1, build, hit) == grid);
+  assert(hit && build_count == 1);
+
+  // Tiles of other levels are kept apart
+  cache.Get(reader, baldr::GraphId(7, 1, 0), 1, build, hit);
+  assert(!hit && build_count == 2 && cache.size() == 2);
+
+  cache.Unpin(reader);
+  cache.Clear();
+  assert(cache.size() == 0 && cache.memory_size() == 0);
+
+  cache.Pin(reader);
+  cache.Get(reader, baldr::GraphId(7, 2, 0), 1, build, hit);
+  assert(!hit && build_count == 3);
+  cache.Unpin(reader);
+
+  // Nothing is published if the build fails
+  cache.Pin(reader);
+  bool thrown = false;
+  try {
+    cache.Get(reader, baldr::GraphId(8, 2, 0), 1, []() -> GridRangeQuery<SegmentId> {
+        throw std::runtime_error("failed to build");
+      }, hit);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+  assert(IsGridOf(cache.Get(reader, baldr::GraphId(8, 2, 0), 1, []() { return MakeGrid(8); }, hit), 8));
+  assert(!hit);
+  cache.Unpin(reader);
+
+  cache.Unregister(reader);
+}
+
+
+void TestEviction()
+{
+  // Room for two grids
+  const size_t grid_memory_size = MakeGrid(0).memory_size();
+  GridCache cache(1.f, 1.f, grid_memory_size * 2);
+  auto reader = cache.Register(), other_reader = cache.Register();
+
+  std::weak_ptr<const void> first;
+  bool hit;
+  cache.Pin(reader);
+  const auto grid = cache.Get(reader, baldr::GraphId(1, 2, 0), 1, [&first]() { return MakeGrid(1, &first); }, hit);
+  for (uint32_t tileid = 2; tileid < 10; tileid++) {
+    cache.Get(reader, baldr::GraphId(tileid, 2, 0), 1, [tileid]() { return MakeGrid(tileid); }, hit);
+    assert(cache.memory_size() <= grid_memory_size * 2);
+  }
+  assert(cache.evictions() >= 7);
+  assert(cache.size() == 2);
+
+  // Evicted but still pinned
+  assert(!first.expired());
+  assert(IsGridOf(grid, 1));
+
+  // Freed once no reader is pinned before it's evicted
+  cache.Unpin(reader);
+  cache.Pin(other_reader);
+  cache.Get(other_reader, baldr::GraphId(20, 2, 0), 1, []() { return MakeGrid(20); }, hit);
+  assert(first.expired());
+  cache.Unpin(other_reader);
+
+  // A grid that is larger than the budget is still published
+  cache.set_max_memory_size(0);
+  assert(cache.size() == 0);
+  cache.Pin(reader);
+  assert(IsGridOf(cache.Get(reader, baldr::GraphId(30, 2, 0), 1, []() { return MakeGrid(30); }, hit), 30));
+  assert(cache.size() == 1);
+  cache.Unpin(reader);
+
+  cache.Unregister(reader);
+  cache.Unregister(other_reader);
+}
+
+
+void TestStaleIndex()
+{
+  const std::string path = "test_grid_cache_index.bin";
+  {
+    GridIndexWriter writer(path, 1.f, 1.f);
+    writer.Write(baldr::GraphId(7, 2, 0), 3, MakeGrid(7));
+    writer.Close();
+  }
+
+  GridCache cache(1.f, 1.f);
+  cache.LoadIndex(path);
+  auto reader = cache.Register();
+  size_t build_count = 0;
+  const auto build = [&build_count]() {
+    build_count++;
+    return MakeGrid(7);
+  };
+
+  // Read from the index while the tile has as many edges as indexed
+  bool hit;
+  cache.Pin(reader);
+  assert(IsGridOf(cache.Get(reader, baldr::GraphId(7, 2, 0), 3, build, hit), 7));
+  assert(!hit && build_count == 0 && cache.stale_index_grids() == 0);
+  cache.Unpin(reader);
+
+  // Built again once the tile has changed
+  cache.Clear();
+  cache.Pin(reader);
+  assert(IsGridOf(cache.Get(reader, baldr::GraphId(7, 2, 0), 4, build, hit), 7));
+  assert(!hit && build_count == 1 && cache.stale_index_grids() == 1);
+  cache.Unpin(reader);
+
+  cache.Unregister(reader);
+  std::remove(path.c_str());
+}
+
+
+void TestConcurrency(size_t max_memory_size)
+{
+  const uint32_t tile_count = 64;
+  GridCache cache(1.f, 1.f, max_memory_size);
+  std::vector<std::atomic<size_t>> build_counts(tile_count);
+  for (auto& count : build_counts) {
+    count = 0;
+  }
+  std::atomic<size_t> invalid_count(0), hit_count(0);
+
+  std::vector<std::thread> threads;
+  for (size_t idx = 0; idx < 8; idx++) {
+    threads.emplace_back([&, idx]() {
+        auto reader = cache.Register();
+        std::mt19937 generator(idx);
+        std::uniform_int_distribution<uint32_t> tileids(0, tile_count - 1);
+        const auto get = [&](uint32_t tileid, bool& hit) {
+          return cache.Get(reader, baldr::GraphId(tileid, 2, 0), 1, [&build_counts, tileid]() {
+              build_counts[tileid]++;
+              // Let others ask for it while it's being built
+              std::this_thread::sleep_for(std::chrono::microseconds(100));
+              return MakeGrid(tileid);
+            }, hit);
+        };
+        for (size_t query = 0; query < 5000; query++) {
+          cache.Pin(reader);
+          const auto tileid = tileids(generator);
+          bool hit;
+          const auto grid = get(tileid, hit);
+          hit_count += hit;
+          // Read another grid so that the first one may be evicted
+          // while it's still in use
+          get(tileids(generator), hit);
+          if (!IsGridOf(grid, tileid)) {
+            invalid_count++;
+          }
+          cache.Unpin(reader);
+        }
+        cache.Unregister(reader);
+      });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  assert(!invalid_count);
+  assert(hit_count > 0);
+  if (max_memory_size == std::numeric_limits<size_t>::max()) {
+    // Each tile is built only once
+    for (const auto& count : build_counts) {
+      assert(count <= 1);
+    }
+    assert(!cache.evictions());
+  } else {
+    assert(cache.evictions() > 0);
+    assert(cache.memory_size() <= max_memory_size);
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  TestGet();
+
+  TestEviction();
+
+  TestStaleIndex();
+
+  TestConcurrency(std::numeric_limits<size_t>::max());
+
+  TestConcurrency(MakeGrid(0).memory_size() * 8);
+
+  std::cout << "all tests passed" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,170 @@
+// -*- mode: c++ -*-
+
+#undef NDEBUG
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "mmp/grid_index.h"
+
+using namespace mmp;
+using namespace valhalla;
+
+
+GridRangeQuery<SegmentId> BuildGrid(const BoundingBox& bbox, uint32_t tileid, size_t count,
+                                    float cell_size = 1.f)
+{
+  GridRangeQueryBuilder<SegmentId> builder(bbox, cell_size, cell_size);
+  for (size_t i = 0; i < count; i++) {
+    const float y = bbox.miny() + i + 0.5f;
+    builder.AddLineSegment(SegmentId(baldr::GraphId(tileid, 2, i), 0), LineSegment({bbox.minx(), y}, {bbox.maxx(), y}));
+  }
+  return builder.Build();
+}
+
+
+void AssertSameGrid(const GridRangeQuery<SegmentId>& lhs, const GridRangeQuery<SegmentId>& rhs)
+{
+  assert(lhs.cell_width() == rhs.cell_width() && lhs.cell_height() == rhs.cell_height());
+  assert(lhs.num_cols() == rhs.num_cols() && lhs.num_rows() == rhs.num_rows());
+  assert(lhs.size() == rhs.size());
+  for (int i = 0; i < lhs.num_cols(); i++) {
+    for (int j = 0; j < lhs.num_rows(); j++) {
+      const auto litems = lhs.ItemsInCell(i, j), ritems = rhs.ItemsInCell(i, j);
+      assert(litems.size() == ritems.size());
+      assert(std::equal(litems.begin(), litems.end(), ritems.begin()));
+    }
+  }
+}
+
+
+void TestSegmentId()
+{
+  const baldr::GraphId edgeid(1234, 2, 56789);
+  const SegmentId segment(edgeid, 17);
+  assert(segment.edgeid() == edgeid && segment.index() == 17);
+
+  // Segments of an edge are sorted together
+  assert(SegmentId(edgeid, 17) < SegmentId(edgeid, 18));
+  assert(SegmentId(edgeid, 1000) < SegmentId(edgeid + 1, 0));
+
+  const SegmentId last(edgeid, SegmentId::kMaxIndex + 10);
+  assert(last.edgeid() == edgeid && last.index() == SegmentId::kMaxIndex);
+
+  const SegmentId invalid(baldr::GraphId(), 0);
+  assert(!invalid.edgeid().Is_Valid());
+}
+
+
+void TestRoundTrip()
+{
+  const std::string path = "test_grid_index.bin";
+  const BoundingBox bbox1(0, 0, 10, 10), bbox2(10, 0, 20, 10);
+  const auto grid1 = BuildGrid(bbox1, 7, 5),
+             // Tiles keep their own cell sizes
+             grid2 = BuildGrid(bbox2, 3, 3, 2.f),
+             empty = GridRangeQuery<SegmentId>(bbox1, 1.f, 1.f);
+
+  {
+    GridIndexWriter writer(path, 1.f, 1.f, 8.f);
+    // Out of order
+    writer.Write(baldr::GraphId(7, 2, 0), 1, grid1);
+    writer.Write(baldr::GraphId(3, 2, 0), 12, grid2);
+    writer.Write(baldr::GraphId(9, 2, 0), 1, empty);
+    writer.Close();
+  }
+
+  std::unique_ptr<GridRangeQuery<SegmentId>> mapped;
+  {
+    GridIndex index(path);
+    assert(index.size() == 3);
+    assert(index.cell_width() == 1.f && index.cell_height() == 1.f);
+    assert(index.cell_items() == 8.f);
+    assert(!index.Find(baldr::GraphId(5, 2, 0)));
+
+    const auto entry1 = index.Find(baldr::GraphId(7, 2, 0));
+    assert(entry1);
+    AssertSameGrid(index.Grid(*entry1), grid1);
+
+    const auto entry2 = index.Find(baldr::GraphId(3, 2, 0));
+    assert(entry2 && entry2->edge_count == 12);
+    AssertSameGrid(index.Grid(*entry2), grid2);
+    assert(index.Grid(*entry2).cell_width() == 2.f && index.Grid(*entry2).num_cols() == 5);
+
+    const auto entry3 = index.Find(baldr::GraphId(9, 2, 0));
+    assert(entry3);
+    AssertSameGrid(index.Grid(*entry3), empty);
+
+    std::vector<SegmentId> buffer;
+    const auto edgeids = index.Grid(*entry1).Query(BoundingBox(2, 1.2, 3, 2.8), buffer);
+    assert(edgeids.size() == 2);
+    assert(edgeids.begin()[0].edgeid() == baldr::GraphId(7, 2, 1) && edgeids.begin()[1].edgeid() == baldr::GraphId(7, 2, 2));
+
+    mapped.reset(new GridRangeQuery<SegmentId>(index.Grid(*entry1)));
+  }
+
+  // The grid keeps the file mapped after the index is gone
+  AssertSameGrid(*mapped, grid1);
+
+  std::remove(path.c_str());
+}
+
+
+void TestInvalidIndex()
+{
+  const std::string path = "test_grid_index_invalid.bin";
+  {
+    std::ofstream out(path);
+    out << "not a grid index, but long enough to hold a header";
+  }
+
+  bool thrown = false;
+  try {
+    GridIndex index(path);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+  std::remove(path.c_str());
+
+  thrown = false;
+  try {
+    GridIndex index("no_such_grid_index.bin");
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  // Duplicate tiles
+  {
+    GridIndexWriter writer(path, 1.f, 1.f);
+    const auto grid = BuildGrid(BoundingBox(0, 0, 10, 10), 1, 1);
+    writer.Write(baldr::GraphId(1, 2, 0), 1, grid);
+    writer.Write(baldr::GraphId(1, 2, 0), 1, grid);
+    thrown = false;
+    try {
+      writer.Close();
+    } catch (const std::logic_error&) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+  std::remove(path.c_str());
+}
+
+
+int main(int argc, char *argv[])
+{
+  TestSegmentId();
+
+  TestRoundTrip();
+
+  TestInvalidIndex();
+
+  std::cout << "all tests passed" << std::endl;
+
+  return 0;
+}
@@ -2,8 +2,13 @@
 
 #undef NDEBUG
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <iostream>
+#include <iterator>
+#include <random>
+#include <vector>
 
 #include "mmp/grid_range_query.h"
 
@@ -67,9 +72,10 @@ void TestGridTools()
 void TestAddLineSegment()
 {
   BoundingBox bbox(0, 0, 100, 100);
-  GridRangeQuery<int> grid(bbox, 1.f, 1.f);
+  GridRangeQueryBuilder<int> builder(bbox, 1.f, 1.f);
 
-  grid.AddLineSegment(0, LineSegment({2.5, 3.5}, {10, 3.5}));
+  builder.AddLineSegment(0, LineSegment({2.5, 3.5}, {10, 3.5}));
+  auto grid = builder.Build();
   auto items23 = grid.ItemsInCell(2, 3);
   assert(items23.size() == 1);
   auto items53 = grid.ItemsInCell(5, 3);
@@ -77,26 +83,185 @@ void TestAddLineSegment()
   auto items88 = grid.ItemsInCell(8, 8);
   assert(items88.empty());
 
-  grid.AddLineSegment(1, LineSegment({10, 3.5}, {2.5, 3.5}));
+  builder.AddLineSegment(1, LineSegment({10, 3.5}, {2.5, 3.5}));
+  grid = builder.Build();
   auto items33 = grid.ItemsInCell(2, 3);
   assert(items33.size() == 2);
+  // Items in a cell keep the order they were added
+  assert(*items33.begin() == 0 && *std::next(items33.begin()) == 1);
 
-  grid.AddLineSegment(0, LineSegment({-10, -10}, {110, 110}));
+  builder.AddLineSegment(0, LineSegment({-10, -10}, {110, 110}));
+  grid = builder.Build();
   auto items50 = grid.ItemsInCell(50, 50);
   assert(items50.size() == 1);
 
   auto old_item00_size = grid.ItemsInCell(0, 0).size();
-  grid.AddLineSegment(0, LineSegment({0.5, 0.5}, {0.5, 0.5}));
+  builder.AddLineSegment(0, LineSegment({0.5, 0.5}, {0.5, 0.5}));
+  grid = builder.Build();
   assert(grid.ItemsInCell(0, 0).size() == old_item00_size + 1);
+  assert(grid.size() == builder.size());
+}
+
+
+// How AddLineSegment walked cells before: to the neighbor, across
+// the intersected sides of the current cell, whose center is closest
+// to the end. Cells outside the grid are skipped
+template <typename key_t>
+void AddLineSegmentByIntersections(GridRangeQueryBuilder<key_t>& builder,
+                                   const key_t item,
+                                   const LineSegment& segment)
+{
+  const auto& grid = builder.grid();
+  LineSegment interior;
+  if (!grid.InteriorLineSegment(segment, interior)) return;
+
+  const Point& start = interior.a();
+  const Point& end = interior.b();
+  Point current_point = start;
+  int i, j;
+  std::tie(i, j) = grid.GridCoordinates(current_point);
+  const auto add = [&builder, &grid, &item](int i, int j) {
+    if (0 <= i && i < grid.num_cols() && 0 <= j && j < grid.num_rows()) {
+      builder.AddItem(i, j, item);
+    }
+  };
+
+  if (start == end) {
+    add(i, j);
+    return;
+  }
+
+  while (grid.Unlerp(start, end, current_point) < 1.0) {
+    add(i, j);
+    const auto& intersects = grid.CellLineSegmentIntersections(i, j, LineSegment(current_point, end));
+    float bestd = end.DistanceSquared(grid.CellCenter(i, j));
+    BoundingBoxIntersection bestp;
+    for (const auto &intersect : intersects) {
+      float d = end.DistanceSquared(grid.CellCenter(i + intersect.dx, j + intersect.dy));
+      if (d < bestd) {
+        bestd = d;
+        bestp = intersect;
+      }
+    }
+    if (bestd < end.DistanceSquared(grid.CellCenter(i, j))) {
+      current_point = bestp.point;
+      i += bestp.dx;
+      j += bestp.dy;
+    } else {
+      break;
+    }
+  }
+}
+
+
+void TestAddLineSegmentTraversal()
+{
+  // Tiles of random roads, with coordinates rounded as in tiles so
+  // that many vertexes are on cell borders
+  const float tile_size = 0.25f, cell_size = tile_size / 50;
+  const BoundingBox bbox(0.f, 0.f, tile_size, tile_size);
+  const auto round = [](float value) {
+    return static_cast<float>(std::round(value * 1e6) / 1e6);
+  };
+
+  for (unsigned seed : {2016u, 4u, 15u, 21u, 27u}) {
+    // Uniform values from the raw engine output, which unlike the
+    // standard distributions is the same with all standard libraries
+    std::mt19937 generator(seed);
+    const auto uniform = [&generator](float min, float max) {
+      return static_cast<float>(min + (max - min) * (generator() / 4294967296.0));
+    };
+
+    GridRangeQueryBuilder<int> builder(bbox, cell_size, cell_size), expected_builder(bbox, cell_size, cell_size);
+    std::vector<Point> ends;
+    for (int item = 0; item < 50000; item++) {
+      const Point a(round(uniform(-0.01f, tile_size + 0.01f)), round(uniform(-0.01f, tile_size + 0.01f)));
+      const Point b(round(a.x() + uniform(-0.02f, 0.02f)), round(a.y() + uniform(-0.02f, 0.02f)));
+      builder.AddLineSegment(item, LineSegment(a, b));
+      AddLineSegmentByIntersections(expected_builder, item, LineSegment(a, b));
+      ends.push_back(b);
+    }
+
+    // The same cells, except that a segment ending on a cell border
+    // may differ by the cell across it: the traversal takes the cell
+    // GridCoordinates gives for the end, while the intersections
+    // before went either way as the intersection rounded
+    const auto grid = builder.Build(), expected_grid = expected_builder.Build();
+    std::vector<int> differences(ends.size(), 0);
+    for (int i = 0; i < grid.num_cols(); i++) {
+      for (int j = 0; j < grid.num_rows(); j++) {
+        // Items of a cell are in the order they were added
+        const auto items = grid.ItemsInCell(i, j), expected_items = expected_grid.ItemsInCell(i, j);
+        std::vector<int> difference;
+        std::set_symmetric_difference(items.begin(), items.end(),
+                                      expected_items.begin(), expected_items.end(),
+                                      std::back_inserter(difference));
+        const auto cell = grid.CellBoundingBox(i, j);
+        for (const auto item : difference) {
+          const auto& end = ends[item];
+          const float tolerance = cell_size * 1e-3f;
+          const bool on_border = std::abs(end.x() - cell.minx()) < tolerance
+                                 || std::abs(end.x() - cell.maxx()) < tolerance
+                                 || std::abs(end.y() - cell.miny()) < tolerance
+                                 || std::abs(end.y() - cell.maxy()) < tolerance;
+          assert(on_border);
+          assert(cell.minx() - tolerance < end.x() && end.x() < cell.maxx() + tolerance
+                 && cell.miny() - tolerance < end.y() && end.y() < cell.maxy() + tolerance);
+          differences[item]++;
+        }
+      }
+    }
+    assert(std::all_of(differences.begin(), differences.end(), [](int count) { return count <= 1; }));
+  }
+
+  // Segments that end on the far borders stay in the grid
+  GridRangeQueryBuilder<int> border_builder(BoundingBox(0, 0, 10, 10), 1.f, 1.f);
+  border_builder.AddLineSegment(0, LineSegment({12, 5.5}, {5.5, 5.5}));
+  border_builder.AddLineSegment(1, LineSegment({9.5, 9.5}, {10, 10}));
+  const auto border_grid = border_builder.Build();
+  assert(border_grid.size() == 6);
+  assert(border_grid.ItemsInCell(9, 5).size() == 1 && border_grid.ItemsInCell(5, 5).size() == 1);
+  assert(border_grid.ItemsInCell(9, 9).size() == 1);
+}
+
+
+void TestBuild()
+{
+  BoundingBox bbox(0, 0, 10, 10);
+  GridRangeQueryBuilder<int> builder(bbox, 1.f, 1.f);
+
+  // An empty grid has no items in any cell
+  assert(builder.occupied_cell_count() == 0);
+  auto grid = builder.Build();
+  assert(grid.size() == 0);
+  for (int i = 0; i < 10; i++) {
+    for (int j = 0; j < 10; j++) {
+      assert(grid.ItemsInCell(i, j).empty());
+    }
+  }
+
+  builder.AddItem(9, 9, 7);
+  builder.AddItem(0, 0, 3);
+  builder.AddItem(9, 9, 5);
+  builder.AddItem(4, 2, 1);
+  assert(builder.occupied_cell_count() == 3);
+  grid = builder.Build();
+  assert(grid.size() == 4);
+  assert(grid.ItemsInCell(0, 0).size() == 1 && *grid.ItemsInCell(0, 0).begin() == 3);
+  assert(grid.ItemsInCell(4, 2).size() == 1 && *grid.ItemsInCell(4, 2).begin() == 1);
+  const auto items99 = grid.ItemsInCell(9, 9);
+  assert(items99.size() == 2 && *items99.begin() == 7 && *std::next(items99.begin()) == 5);
+  assert(grid.ItemsInCell(2, 4).empty());
 }
 
 
 void TestQuery()
 {
   BoundingBox bbox(0, 0, 100, 100);
-  GridRangeQuery<int> grid(bbox, 1.f, 1.f);
+  GridRangeQueryBuilder<int> builder(bbox, 1.f, 1.f);
 
-  grid.AddLineSegment(0, LineSegment({2.5, 3.5}, {10, 3.5}));
+  builder.AddLineSegment(0, LineSegment({2.5, 3.5}, {10, 3.5}));
+  const auto grid = builder.Build();
 
   auto items = grid.Query(BoundingBox(2, 2, 5, 5));
   assert(items.size() == 1 && items.find(0) != items.end());
@@ -109,14 +274,52 @@ void TestQuery()
 }
 
 
+void TestQueryBuffer()
+{
+  BoundingBox bbox(0, 0, 100, 100);
+  GridRangeQueryBuilder<int> builder(bbox, 1.f, 1.f);
+
+  builder.AddLineSegment(3, LineSegment({2.5, 3.5}, {10, 3.5}));
+  builder.AddLineSegment(1, LineSegment({2.5, 2.5}, {2.5, 8.5}));
+  builder.AddLineSegment(2, LineSegment({50, 50}, {60, 60}));
+  const auto grid = builder.Build();
+
+  // Items spanning many cells are collected many times
+  std::vector<int> buffer;
+  grid.CollectItems(BoundingBox(2, 2, 5, 5), buffer);
+  assert(buffer.size() > 2);
+
+  // but queried once, in order
+  auto items = grid.Query(BoundingBox(2, 2, 5, 5), buffer);
+  assert(items.size() == 2 && items.begin()[0] == 1 && items.begin()[1] == 3);
+  assert(items.begin() == buffer.data());
+
+  items = grid.Query(BoundingBox(10, 10, 20, 20), buffer);
+  assert(items.empty() && buffer.empty());
+
+  items = grid.Query(BoundingBox(0, 0, 100, 100), buffer);
+  assert(items.size() == 3 && grid.Query(BoundingBox(0, 0, 100, 100)).size() == 3);
+
+  std::vector<int> duplicates = {5, 1, 5, 3, 1};
+  SortUnique(duplicates);
+  assert((duplicates == std::vector<int>{1, 3, 5}));
+}
+
+
 int main(int argc, char *argv[])
 {
   TestGridTools();
 
   TestAddLineSegment();
 
+  TestAddLineSegmentTraversal();
+
+  TestBuild();
+
   TestQuery();
 
+  TestQueryBuffer();
+
   std::cout << "all tests passed" << std::endl;
 
   return 0;
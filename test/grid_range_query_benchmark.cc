@@ -0,0 +1,133 @@
+// -*- mode: c++ -*-
+
+// Benchmark grid build time, memory per tile and query latency on a
+// synthetic tile of random road polylines
+//
+// usage: grid_range_query_benchmark [GRID_SIZE [EDGE_COUNT [QUERY_COUNT]]]
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "mmp/grid_range_query.h"
+
+using namespace mmp;
+
+// Same size as the GraphId
+using Key = uint64_t;
+
+// The local tile size in degrees
+constexpr float kTileSize = 0.25f;
+
+// About 10 meters in degrees
+constexpr float kStep = 0.0001f;
+
+
+std::vector<std::vector<Point>>
+RandomPolylines(const BoundingBox& bbox, size_t count, std::mt19937& generator)
+{
+  std::uniform_real_distribution<float> x(bbox.minx(), bbox.maxx()),
+      y(bbox.miny(), bbox.maxy()),
+      step(-10 * kStep, 10 * kStep);
+  std::uniform_int_distribution<int> size(2, 10);
+
+  std::vector<std::vector<Point>> polylines(count);
+  for (auto& polyline : polylines) {
+    polyline.emplace_back(x(generator), y(generator));
+    for (int i = size(generator); i > 1; i--) {
+      const auto& last = polyline.back();
+      polyline.emplace_back(last.x() + step(generator), last.y() + step(generator));
+    }
+  }
+  return polylines;
+}
+
+
+// Estimate what one vector per cell would take: the vector itself,
+// plus one allocation (capacity doubles) for each non-empty cell
+size_t VectorPerCellMemorySize(const GridRangeQuery<Key>& grid)
+{
+  // Typical malloc bookkeeping per allocation
+  constexpr size_t kAllocationOverhead = 16;
+  size_t bytes = 0;
+  for (int i = 0; i < grid.num_cols(); i++) {
+    for (int j = 0; j < grid.num_rows(); j++) {
+      bytes += sizeof(std::vector<Key>);
+      const auto size = grid.ItemsInCell(i, j).size();
+      if (size) {
+        size_t capacity = 1;
+        while (capacity < size) {
+          capacity *= 2;
+        }
+        bytes += capacity * sizeof(Key) + kAllocationOverhead;
+      }
+    }
+  }
+  return bytes;
+}
+
+
+int main(int argc, char *argv[])
+{
+  const int grid_size = argc > 1? std::atoi(argv[1]) : 500;
+  const size_t edge_count = argc > 2? std::atoi(argv[2]) : 50000,
+              query_count = argc > 3? std::atoi(argv[3]) : 100000;
+
+  std::mt19937 generator(2016);
+  const BoundingBox bbox(0.f, 0.f, kTileSize, kTileSize);
+  const auto polylines = RandomPolylines(bbox, edge_count, generator);
+  const float cell_size = kTileSize / grid_size;
+
+  // Build
+  auto start = std::chrono::steady_clock::now();
+  GridRangeQueryBuilder<Key> builder(bbox, cell_size, cell_size);
+  for (size_t key = 0; key < polylines.size(); key++) {
+    const auto& polyline = polylines[key];
+    for (size_t j = 1; j < polyline.size(); j++) {
+      builder.AddLineSegment(key, LineSegment(polyline[j - 1], polyline[j]));
+    }
+  }
+  const auto grid = builder.Build();
+  const auto build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  // Query boxes of about 50 meters around random points
+  std::uniform_real_distribution<float> x(bbox.minx(), bbox.maxx()),
+      y(bbox.miny(), bbox.maxy());
+  std::vector<BoundingBox> ranges;
+  ranges.reserve(query_count);
+  for (size_t i = 0; i < query_count; i++) {
+    const float cx = x(generator), cy = y(generator);
+    ranges.emplace_back(cx - 5 * kStep, cy - 5 * kStep, cx + 5 * kStep, cy + 5 * kStep);
+  }
+
+  size_t set_result_count = 0;
+  start = std::chrono::steady_clock::now();
+  for (const auto& range : ranges) {
+    set_result_count += grid.Query(range).size();
+  }
+  const auto set_query_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<Key> buffer;
+  size_t result_count = 0;
+  start = std::chrono::steady_clock::now();
+  for (const auto& range : ranges) {
+    result_count += grid.Query(range, buffer).size();
+  }
+  const auto query_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  assert(set_result_count == result_count);
+
+  std::cout << "grid size: " << grid_size << "x" << grid_size << std::endl;
+  std::cout << "edges: " << edge_count << ", cell items: " << grid.size() << std::endl;
+  std::cout << "build time: " << build_ms << " ms" << std::endl;
+  std::cout << "memory: " << grid.memory_size() / 1024 << " KiB"
+            << " (one vector per cell: " << VectorPerCellMemorySize(grid) / 1024 << " KiB)" << std::endl;
+  std::cout << "query latency: " << query_us / query_count << " us"
+            << " (" << static_cast<double>(result_count) / query_count << " results;"
+            << " " << set_query_us / query_count << " us into unordered_set)" << std::endl;
+
+  return 0;
+}
@@ -3,8 +3,13 @@
 #undef NDEBUG
 
 #include <cassert>
+#include <cmath>
 #include <iostream>
+#include <exception>
+#include <future>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -163,6 +168,183 @@ void TestMapMatcher(const ptree& root)
 }
 
 
+void TestMatchBatch(const ptree& root)
+{
+  // Traces of different sizes out at sea, where nothing is matched
+  std::vector<std::vector<mmp::Measurement>> traces(20);
+  for (size_t idx = 0; idx < traces.size(); idx++) {
+    for (size_t point = 0; point < idx % 5; point++) {
+      traces[idx].emplace_back(midgard::PointLL(-30.f + idx * 0.01f, point * 0.001f));
+    }
+  }
+
+  mmp::MapMatcherFactory factory(root);
+  mmp::BatchOptions options;
+  options.thread_count = 3;
+
+  // Results are in the order of the traces
+  const auto results = factory.MatchBatch(traces, options);
+  assert(results.size() == traces.size());
+  for (size_t idx = 0; idx < traces.size(); idx++) {
+    assert(!results[idx].error);
+    assert(results[idx].results.size() == traces[idx].size());
+    for (size_t point = 0; point < traces[idx].size(); point++) {
+      const auto& result = results[idx].results[point];
+      assert(!result.graphid().Is_Valid() && !result.state());
+      assert(result.lnglat() == traces[idx][point].lnglat());
+    }
+  }
+
+  // A trace that fails doesn't fail the others
+  std::vector<size_t> done(traces.size(), 0), failed(traces.size(), 0);
+  factory.MatchBatch(traces, options, [&done](size_t idx, mmp::MapMatcher&, std::vector<mmp::MatchResult>&) {
+      if (idx % 7 == 3) {
+        throw std::runtime_error("failed on purpose");
+      }
+      done[idx]++;
+    }, [&failed](size_t idx, std::exception_ptr error) {
+      try {
+        std::rethrow_exception(error);
+      } catch (const std::runtime_error& ex) {
+        assert(std::string(ex.what()) == "failed on purpose");
+        failed[idx]++;
+      }
+    });
+  for (size_t idx = 0; idx < traces.size(); idx++) {
+    assert(done[idx] + failed[idx] == 1);
+    assert((failed[idx] == 1) == (idx % 7 == 3));
+  }
+
+  // Without the error callback the failure is rethrown
+  bool happen = false;
+  try {
+    factory.MatchBatch(traces, options, [](size_t idx, mmp::MapMatcher&, std::vector<mmp::MatchResult>&) {
+        if (idx == 5) {
+          throw std::runtime_error("failed on purpose");
+        }
+      });
+  } catch (const std::runtime_error&) {
+    happen = true;
+  }
+  assert(happen);
+
+  // Traces submitted one by one fail in their own futures
+  {
+    auto batch = factory.OpenBatch(options);
+    std::vector<std::future<void>> futures;
+    std::vector<size_t> sizes(traces.size(), 0);
+    for (size_t idx = 0; idx < traces.size(); idx++) {
+      futures.push_back(batch->Submit(traces[idx], [&sizes, idx](mmp::MapMatcher&, std::vector<mmp::MatchResult>& results) {
+            if (idx % 7 == 3) {
+              throw std::runtime_error("failed on purpose");
+            }
+            sizes[idx] = results.size();
+          }));
+    }
+    for (size_t idx = 0; idx < traces.size(); idx++) {
+      bool failed = false;
+      try {
+        futures[idx].get();
+      } catch (const std::runtime_error&) {
+        failed = true;
+      }
+      assert(failed == (idx % 7 == 3));
+      assert(failed || sizes[idx] == traces[idx].size());
+    }
+  }
+}
+
+
+// Expose the bound of routes between two measurements
+class RouteBoundMapMatching: public mmp::MapMatching
+{
+ public:
+  using mmp::MapMatching::MapMatching;
+
+  float RouteBound(const mmp::Measurement& left, const mmp::Measurement& right)
+  {
+    Clear();
+    for (const auto& measurement : {left, right}) {
+      const mmp::Candidate candidate(baldr::Location(measurement.lnglat()));
+      AppendState(measurement, &candidate, &candidate + 1);
+    }
+    return MaxRouteDistance(*states(0).front(), *states(1).front());
+  }
+};
+
+
+void TestMaxRouteDistance(const ptree& root)
+{
+  mmp::MapMatcherFactory factory(root);
+  const float sigma_z = 4.f, breakage_distance = 2000.f, factor = 3.f, max_speed = 20.f;
+  // Routes are never searched here, so no costings are needed
+  RouteBoundMapMatching mm(factory.graphreader(), nullptr, sif::TravelMode::kDrive,
+                           sigma_z, 3.f, breakage_distance, factor, 40.f, 0.f, max_speed);
+  RouteBoundMapMatching unbounded(factory.graphreader(), nullptr, sif::TravelMode::kDrive,
+                                  sigma_z, 3.f, breakage_distance, factor, 40.f, 0.f, 0.f);
+
+  // About 111 meters apart
+  const midgard::PointLL a(13.4f, 52.5f), b(13.4f, 52.501f);
+  const float distance = a.Distance(b);
+  const auto near = [](float lhs, float rhs) { return std::abs(lhs - rhs) < 0.01f; };
+
+  // Bounded by the max speed in the elapsed time, with room for the
+  // errors at both ends (sigma_z where the accuracy is unknown)
+  assert(near(mm.RouteBound({a, -1.f, -1.f, 100.0}, {b, -1.f, -1.f, 110.0}),
+              max_speed * 10.f + 2.f * sigma_z));
+  assert(near(mm.RouteBound({a, -1.f, 5.f, 100.0}, {b, -1.f, 10.f, 110.0}),
+              max_speed * 10.f + 5.f + 10.f));
+  assert(near(mm.RouteBound({a, -1.f, 5.f, 100.0}, {b, -1.f, -1.f, 110.0}),
+              max_speed * 10.f + 5.f + sigma_z));
+
+  // Never below the distance between the measurements, even if they
+  // have the same time or go back in time
+  for (const double time : {101.0, 100.0, 90.0}) {
+    assert(near(mm.RouteBound({a, -1.f, -1.f, 100.0}, {b, -1.f, -1.f, time}),
+                distance + 2.f * sigma_z));
+  }
+
+  // Never beyond the bound by the distance
+  assert(near(mm.RouteBound({a, -1.f, -1.f, 100.0}, {b, -1.f, -1.f, 1000.0}), distance * factor));
+
+  // Not bounded by times if any of them is missing, or without the
+  // max speed
+  assert(near(mm.RouteBound({a}, {b}), distance * factor));
+  assert(near(mm.RouteBound({a, -1.f, -1.f, 100.0}, {b}), distance * factor));
+  assert(near(mm.RouteBound({a}, {b, -1.f, -1.f, 110.0}), distance * factor));
+  assert(near(unbounded.RouteBound({a, -1.f, -1.f, 100.0}, {b, -1.f, -1.f, 110.0}), distance * factor));
+
+  // And by the breakage distance
+  const midgard::PointLL far(13.4f, 52.52f);
+  assert(near(mm.RouteBound({a}, {far}), breakage_distance));
+}
+
+
+void TestHeadingFilter()
+{
+  // Unknown headings or full tolerance keep all edges
+  assert(!mmp::HeadingFilter().enabled());
+  assert(!mmp::HeadingFilter(-1.f, 30.f).enabled());
+  assert(!mmp::HeadingFilter(90.f, 180.f).enabled());
+  assert(mmp::HeadingFilter().Allowed(270.f));
+
+  const mmp::HeadingFilter filter(350.f, 30.f);
+  assert(filter.enabled());
+  assert(filter.Allowed(350.f));
+  assert(filter.Allowed(20.f));
+  assert(filter.Allowed(320.f));
+  assert(!filter.Allowed(21.f));
+  assert(!filter.Allowed(170.f));
+  // Headings beyond a turn are allowed too
+  assert(filter.Allowed(370.f));
+  assert(!filter.Allowed(530.f));
+
+  // The opposite direction
+  assert(mmp::HeadingFilter(0.f, 90.f).Allowed(90.f));
+  assert(!mmp::HeadingFilter(0.f, 90.f).Allowed(180.f));
+}
+
+
 int main(int argc, char *argv[])
 {
   ptree config;
@@ -175,6 +357,12 @@ int main(int argc, char *argv[])
 
   TestMapMatcher(config);
 
+  TestMatchBatch(config);
+
+  TestMaxRouteDistance(config);
+
+  TestHeadingFilter();
+
   std::cout << "all tests passed" << std::endl;
   return 0;
 }
@@ -58,9 +58,14 @@ void SimpleTestQueue()
   assert(queue.top() == Label(1, 1));
   assert(queue.size() == 2);
 
+  assert(queue.find(1) && *queue.find(1) == Label(1, 1));
+  assert(queue.find(2) && *queue.find(2) == Label(2, 2));
+  assert(!queue.find(3));
+
   queue.pop();
   assert(queue.top() == Label(2, 2));
   assert(queue.size() == 1);
+  assert(!queue.find(1));
 
   queue.pop();
   assert(queue.empty() && queue.size() == 0);
@@ -14,8 +14,11 @@ constexpr uint32_t kInvalidKey = std::numeric_limits<uint16_t>::max();
 
 using AdjacencyList = mmp::BucketQueue<uint32_t, kInvalidKey>;
 
+using RadixList = mmp::RadixQueue<uint32_t, kInvalidKey>;
 
-void Add(AdjacencyList &adjlist, const std::vector<float>& costs)
+
+template <typename queue_t>
+void Add(queue_t &adjlist, const std::vector<float>& costs)
 {
   uint32_t idx = 0;
   for (auto cost : costs) {
@@ -24,7 +27,8 @@ void Add(AdjacencyList &adjlist, const std::vector<float>& costs)
 }
 
 
-void TryRemove(AdjacencyList &adjlist, size_t num_to_remove, const std::vector<float>& costs)
+template <typename queue_t>
+void TryRemove(queue_t &adjlist, size_t num_to_remove, const std::vector<float>& costs)
 {
   auto previous_cost = -std::numeric_limits<float>::infinity();
   for (size_t i = 0; i < num_to_remove && !adjlist.empty(); ++i) {
@@ -38,10 +42,11 @@ void TryRemove(AdjacencyList &adjlist, size_t num_to_remove, const std::vector<f
 }
 
 
+template <typename queue_t>
 void TestAddRemove()
 {
   // Test add and remove
-  AdjacencyList adjlist(100000);
+  queue_t adjlist(100000);
   std::vector<float> costs = { 67, 325, 25, 466, 1000, 10000, 758, 167,
                                258, 16442, 278 };
   Add(adjlist, costs);
@@ -56,14 +61,14 @@ void TestAddRemove()
     auto cost = std::floor(rand01() * 100000);
     costs.push_back(cost);
   }
-  AdjacencyList adjlist2(10000);
+  queue_t adjlist2(10000);
   Add(adjlist2, costs);
   TryRemove(adjlist2, costs.size(), costs);
   if (!adjlist2.empty()) {
     throw std::runtime_error("TestAddRemove: expect list to be empty");
   }
 
-  AdjacencyList adjlist3(10);
+  queue_t adjlist3(10);
   adjlist3.add(1, 100);
   if (!(adjlist3.empty() && adjlist3.cost(1) < 0.f)) {
     throw std::runtime_error("TestAddRemove: 100 should not be added");
@@ -87,7 +92,8 @@ void TestAddRemove()
 }
 
 
-void TrySimulation(AdjacencyList& adjlist, size_t loop_count, size_t expansion_size, size_t max_increment_cost)
+template <typename queue_t>
+void TrySimulation(queue_t& adjlist, size_t loop_count, size_t expansion_size, size_t max_increment_cost)
 {
   std::vector<float> costs;
   // Track all label indexes in the adjlist
@@ -143,22 +149,85 @@ void TrySimulation(AdjacencyList& adjlist, size_t loop_count, size_t expansion_s
 }
 
 
+template <typename queue_t>
 void TestSimulation()
 {
-  AdjacencyList adjlist1(100000);
+  queue_t adjlist1(100000);
   TrySimulation(adjlist1, 1000, 40, 100);
 
-  AdjacencyList adjlist2(100000);
+  queue_t adjlist2(100000);
   TrySimulation(adjlist2, 222, 40, 100);
 
-  AdjacencyList adjlist3(100000);
+  queue_t adjlist3(100000);
   TrySimulation(adjlist3, 333, 60, 100);
 
-  AdjacencyList adjlist4(1000);
+  queue_t adjlist4(1000);
   TrySimulation(adjlist4, 333, 60, 100);
 }
 
 
+void TestRadixRebase()
+{
+  // Keys lower than the last popped one are popped before the others
+  RadixList adjlist(1000);
+  adjlist.add(0, 100.f);
+  adjlist.add(1, 300.f);
+  adjlist.add(2, 700.f);
+  if (adjlist.pop() != 0) {
+    throw std::runtime_error("TestRadixRebase: expect 0 to be popped");
+  }
+  adjlist.add(3, 50.f);
+  adjlist.add(4, 500.f);
+  adjlist.decrease(2, 20.f);
+  if (adjlist.size() != 4) {
+    throw std::runtime_error("TestRadixRebase: expect 4 keys");
+  }
+  const auto lower1 = adjlist.pop(), lower2 = adjlist.pop();
+  if (!((lower1 == 2 && lower2 == 3) || (lower1 == 3 && lower2 == 2))) {
+    throw std::runtime_error("TestRadixRebase: expect 2 and 3 to be popped");
+  }
+  if (adjlist.cost(1) != 300.f) {
+    throw std::runtime_error("TestRadixRebase: expect the cost of 1 to stay");
+  }
+  const std::vector<uint32_t> expected = {1, 4};
+  for (auto key : expected) {
+    if (adjlist.pop() != key) {
+      throw std::runtime_error("TestRadixRebase: expect " + std::to_string(key) + " to be popped");
+    }
+  }
+
+  // Lower keys are decreased in bucket 0 too
+  adjlist.add(5, 800.f);
+  adjlist.pop();
+  adjlist.add(6, 600.f);
+  adjlist.add(7, 900.f);
+  adjlist.decrease(6, 400.f);
+  if (!(adjlist.cost(6) == 400.f && adjlist.pop() == 6 && adjlist.pop() == 7)) {
+    throw std::runtime_error("TestRadixRebase: expect 6 and 7 to be popped");
+  }
+  if (!(adjlist.empty() && adjlist.pop() == kInvalidKey)) {
+    throw std::runtime_error("TestRadixRebase: expect list to be empty");
+  }
+
+  // Costs in the same bucket are popped in no particular order
+  RadixList adjlist2(100, 10.f);
+  adjlist2.add(0, 15.f);
+  adjlist2.add(1, 12.f);
+  adjlist2.add(2, 9.f);
+  if (adjlist2.pop() != 2) {
+    throw std::runtime_error("TestRadixRebase: expect 2 to be popped");
+  }
+  const auto key = adjlist2.pop();
+  if (!((key == 0 || key == 1) && adjlist2.size() == 1)) {
+    throw std::runtime_error("TestRadixRebase: expect 0 or 1 to be popped");
+  }
+  adjlist2.clear();
+  if (!adjlist2.empty()) {
+    throw std::runtime_error("TestRadixRebase: expect list to be empty");
+  }
+}
+
+
 void Benchmark()
 {
   std::vector<float> costs;
@@ -274,16 +343,181 @@ void TestRoutePathIterator()
 }
 
 
+void TestRouteArena()
+{
+  mmp::LabelSet labelset(100);
+  sif::TravelMode travelmode = static_cast<sif::TravelMode>(0);
+
+  // Construct a path 0 <- 1 <- 2 and a branch 1 <- 3
+  labelset.put(0, travelmode, nullptr);
+  labelset.put(1, baldr::GraphId(),
+               0.f, 0.5f,
+               1.f, 0.f, 1.f,
+               0, nullptr, travelmode, nullptr);
+  labelset.put(2, baldr::GraphId(),
+               0.5f, 1.f,
+               2.f, 1.f, 2.f,
+               1, nullptr, travelmode, nullptr);
+  labelset.put(3, baldr::GraphId(),
+               0.f, 0.2f,
+               3.f, 0.f, 3.f,
+               1, nullptr, travelmode, nullptr);
+
+  mmp::RouteArena arena;
+  const auto path2 = arena.Append(labelset, 2),
+             path3 = arena.Append(labelset, 3),
+             path_none = arena.Append(labelset, mmp::kInvalidLabelIndex);
+  if (!(path2.size == 3 && path3.size == 3 && path_none.size == 0 && arena.size() == 6)) {
+    throw std::runtime_error("TestRouteArena: wrong path sizes");
+  }
+
+  // Steps are copied from the destination back to the origin
+  std::vector<float> costs;
+  for (mmp::RouteStepIterator it(&arena, path2), end; it != end; it++) {
+    costs.push_back(it->cost);
+  }
+  if (costs != std::vector<float>{2.f, 1.f, 0.f}) {
+    throw std::runtime_error("TestRouteArena: wrong steps");
+  }
+
+  mmp::RouteStepIterator it3(&arena, path3), the_end;
+  if (!(it3->source == 0.f && it3->target == 0.2f && (*it3).cost == 3.f)) {
+    throw std::runtime_error("TestRouteArena: wrong dereferencing");
+  }
+  if (!(std::next(it3)->cost == 1.f && std::next(it3, 3) == the_end)) {
+    throw std::runtime_error("TestRouteArena: wrong forwarding");
+  }
+  if (mmp::RouteStepIterator(&arena, path_none) != the_end) {
+    throw std::runtime_error("TestRouteArena: expect unreachable path to be empty");
+  }
+
+  arena.Clear();
+  if (arena.size()) {
+    throw std::runtime_error("TestRouteArena: expect arena to be empty");
+  }
+}
+
+
+void TestResumableLabelSet()
+{
+  sif::TravelMode travelmode = static_cast<sif::TravelMode>(0);
+
+  mmp::LabelSet labelset(10, 1.f, true);
+  if (!labelset.resumable() || labelset.has_status()) {
+    throw std::runtime_error("TestResumableLabelSet: wrong initial status");
+  }
+
+  labelset.put(0, travelmode, nullptr);
+  if (labelset.pop() != 0) {
+    throw std::runtime_error("TestResumableLabelSet: origin expected");
+  }
+  const auto status = labelset.dest_status(0);
+  if (!(status && status->permanent && status->label_idx == 0)) {
+    throw std::runtime_error("TestResumableLabelSet: origin should be settled");
+  }
+
+  // Rejected since it is beyond the limit
+  labelset.put(1, baldr::GraphId(),
+               0.f, 1.f,
+               20.f, 0.f, 20.f,
+               0, nullptr, travelmode, nullptr);
+  if (!labelset.empty() || labelset.dest_status(1)) {
+    throw std::runtime_error("TestResumableLabelSet: 20 should not be added");
+  }
+  if (!labelset.release_suspended().empty()) {
+    throw std::runtime_error("TestResumableLabelSet: nothing should be suspended yet");
+  }
+
+  // The origin should be expanded again once the limit is raised
+  labelset.set_bucket_count(30);
+  const auto suspended = labelset.release_suspended();
+  if (!(suspended.size() == 1 && suspended.front() == 0)) {
+    throw std::runtime_error("TestResumableLabelSet: origin should be suspended");
+  }
+  labelset.put(1, baldr::GraphId(),
+               0.f, 1.f,
+               20.f, 0.f, 20.f,
+               0, nullptr, travelmode, nullptr);
+  if (labelset.pop() != 1) {
+    throw std::runtime_error("TestResumableLabelSet: 20 should be added now");
+  }
+
+  // Popping the empty queue settles nothing
+  labelset.pop();
+  if (labelset.settled_count() != 2) {
+    throw std::runtime_error("TestResumableLabelSet: 2 labels should be settled");
+  }
+
+  // Not resumable: suspending does nothing
+  mmp::LabelSet labelset2(10);
+  labelset2.suspend(0);
+  if (labelset2.resumable() || !labelset2.release_suspended().empty()) {
+    throw std::runtime_error("TestResumableLabelSet: should not be resumable");
+  }
+}
+
+
+void TestEdgeAccessDependsOnPredecessor()
+{
+  const auto travelmode = static_cast<sif::TravelMode>(0);
+  baldr::DirectedEdge edge, destonly_edge;
+  edge.set_localedgeidx(1);
+  destonly_edge.set_localedgeidx(1);
+  destonly_edge.set_dest_only(true);
+
+  // Coming from edge 2 of the node, without restrictions
+  const sif::EdgeLabel pred(mmp::kInvalidLabelIndex, baldr::GraphId(), &edge,
+                            sif::Cost(0.f, 0.f), 0.f, 0.f, 0, 2, travelmode);
+  if (mmp::EdgeAccessCache::DependsOnPredecessor(&edge, pred)) {
+    throw std::runtime_error("TestEdgeAccessDependsOnPredecessor: expect the cached verdict to do");
+  }
+
+  // Entering a destination-only edge is up to the predecessor
+  if (!mmp::EdgeAccessCache::DependsOnPredecessor(&destonly_edge, pred)) {
+    throw std::runtime_error("TestEdgeAccessDependsOnPredecessor: expect destination-only edges to be checked");
+  }
+  const sif::EdgeLabel destonly_pred(mmp::kInvalidLabelIndex, baldr::GraphId(), &destonly_edge,
+                                     sif::Cost(0.f, 0.f), 0.f, 0.f, 0, 2, travelmode);
+  if (mmp::EdgeAccessCache::DependsOnPredecessor(&destonly_edge, destonly_pred)) {
+    throw std::runtime_error("TestEdgeAccessDependsOnPredecessor: expect to stay on destination-only edges");
+  }
+
+  const sif::EdgeLabel uturn(mmp::kInvalidLabelIndex, baldr::GraphId(), &edge,
+                             sif::Cost(0.f, 0.f), 0.f, 0.f, 0, 1, travelmode);
+  if (!mmp::EdgeAccessCache::DependsOnPredecessor(&edge, uturn)) {
+    throw std::runtime_error("TestEdgeAccessDependsOnPredecessor: expect u-turns to be checked");
+  }
+
+  const sif::EdgeLabel restricted(mmp::kInvalidLabelIndex, baldr::GraphId(), &edge,
+                                  sif::Cost(0.f, 0.f), 0.f, 0.f, 1 << 1, 2, travelmode);
+  if (!mmp::EdgeAccessCache::DependsOnPredecessor(&edge, restricted)) {
+    throw std::runtime_error("TestEdgeAccessDependsOnPredecessor: expect restrictions to be checked");
+  }
+}
+
+
 int main(int argc, char *argv[])
 {
-  TestAddRemove();
+  TestAddRemove<AdjacencyList>();
+
+  TestAddRemove<RadixList>();
 
-  TestSimulation();
+  TestSimulation<AdjacencyList>();
+
+  TestSimulation<RadixList>();
+
+  TestRadixRebase();
 
   Benchmark();
 
   TestRoutePathIterator();
 
+  TestRouteArena();
+
+  TestResumableLabelSet();
+
+  TestEdgeAccessDependsOnPredecessor();
+
   std::cout << "all tests passed" << std::endl;
 
   return 0;
@@ -0,0 +1,97 @@
+// -*- mode: c++ -*-
+
+#undef NDEBUG
+
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+
+#include "mmp/thread_pool.h"
+
+using namespace mmp;
+
+
+void TestRun()
+{
+  ThreadPool pool(4);
+  assert(pool.size() == 4);
+
+  std::vector<int> results(1000, 0);
+  std::atomic<size_t> invalid_worker_count(0);
+  std::vector<std::future<void>> futures;
+  for (size_t i = 0; i < results.size(); i++) {
+    futures.push_back(pool.Submit([&results, &invalid_worker_count, i, &pool](size_t worker) {
+          if (!(worker < pool.size())) {
+            invalid_worker_count++;
+          }
+          results[i] = i * 2;
+        }));
+  }
+  for (auto& future : futures) {
+    future.get();
+  }
+
+  assert(!invalid_worker_count);
+  for (size_t i = 0; i < results.size(); i++) {
+    assert(results[i] == static_cast<int>(i * 2));
+  }
+}
+
+
+void TestException()
+{
+  ThreadPool pool(2);
+  auto future = pool.Submit([](size_t) {
+      throw std::runtime_error("task failed");
+    });
+
+  bool caught = false;
+  try {
+    future.get();
+  } catch (const std::runtime_error&) {
+    caught = true;
+  }
+  assert(caught);
+
+  // The worker survives
+  bool done = false;
+  pool.Submit([&done](size_t) { done = true; }).get();
+  assert(done);
+}
+
+
+void TestDrain()
+{
+  // Queued tasks are done before the pool is destroyed
+  std::atomic<size_t> count(0);
+  {
+    ThreadPool pool(1);
+    for (size_t i = 0; i < 100; i++) {
+      pool.Submit([&count](size_t) { count++; });
+    }
+  }
+  assert(count == 100);
+
+  bool thrown = false;
+  try {
+    ThreadPool pool(0);
+  } catch (const std::invalid_argument&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+
+int main(int argc, char *argv[])
+{
+  TestRun();
+
+  TestException();
+
+  TestDrain();
+
+  std::cout << "all tests passed" << std::endl;
+
+  return 0;
+}
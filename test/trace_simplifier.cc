@@ -0,0 +1,182 @@
+// -*- mode: c++ -*-
+
+#undef NDEBUG
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <valhalla/midgard/pointll.h>
+
+#include "mmp/trace_simplifier.h"
+
+using namespace mmp;
+using namespace valhalla;
+
+
+// A little more than 1 meter in degrees along the equator
+constexpr float kMeter = 1.f / 110000.f;
+
+
+// A trace at 1 meter apart going east for east_count locations then
+// north for north_count locations
+std::vector<midgard::PointLL> MakeTurn(size_t east_count, size_t north_count)
+{
+  std::vector<midgard::PointLL> trace;
+  for (size_t idx = 0; idx < east_count; idx++) {
+    trace.emplace_back(idx * kMeter, 0.f);
+  }
+  const auto corner = trace.back();
+  for (size_t idx = 1; idx <= north_count; idx++) {
+    trace.emplace_back(corner.lng(), idx * kMeter);
+  }
+  return trace;
+}
+
+
+void TestDistanceSimplifier()
+{
+  const DistanceSimplifier simplifier(10.f);
+  assert(simplifier.Simplify({}).empty());
+  assert(simplifier.Simplify({{0.f, 0.f}}) == std::vector<size_t>{0});
+
+  // Every 10th location, and always the last one
+  const auto indexes = simplifier.Simplify(MakeTurn(36, 0));
+  assert((indexes == std::vector<size_t>{0, 10, 20, 30, 35}));
+
+  // Nothing is dropped without an interpolation distance
+  assert(DistanceSimplifier(0.f).Simplify(MakeTurn(5, 5)).size() == 10);
+}
+
+
+void TestDouglasPeuckerSimplifier()
+{
+  // A straight run collapses to its ends
+  const DouglasPeuckerSimplifier simplifier(4.f, 0.f, 1000.f);
+  assert((simplifier.Simplify(MakeTurn(100, 0)) == std::vector<size_t>{0, 99}));
+
+  // The corner is kept
+  assert((simplifier.Simplify(MakeTurn(100, 100)) == std::vector<size_t>{0, 99, 199}));
+
+  // Noise within the tolerance is dropped
+  std::mt19937 generator(2016);
+  std::uniform_real_distribution<float> noise(-2.f * kMeter, 2.f * kMeter);
+  auto trace = MakeTurn(100, 100);
+  for (auto& location : trace) {
+    location.set_y(location.lat() + noise(generator));
+    location.set_x(location.lng() + noise(generator));
+  }
+  const auto indexes = simplifier.Simplify(trace);
+  assert(indexes.front() == 0 && indexes.back() == 199);
+  assert(indexes.size() <= 5);
+
+  // Long runs are split
+  const auto split = DouglasPeuckerSimplifier(4.f, 0.f, 30.f).Simplify(MakeTurn(100, 0));
+  assert(split.size() > 2);
+  for (size_t idx = 1; idx < split.size(); idx++) {
+    assert(split[idx - 1] < split[idx]);
+    assert(split[idx] - split[idx - 1] <= 30);
+  }
+
+  // Only the locations picked by the distance are matched
+  const auto decimated = DistanceSimplifier(10.f).Simplify(trace);
+  for (const auto idx : DouglasPeuckerSimplifier(1.f, 10.f, 1000.f).Simplify(trace)) {
+    assert(std::find(decimated.begin(), decimated.end(), idx) != decimated.end());
+  }
+}
+
+
+void TestCreateTraceSimplifier()
+{
+  boost::property_tree::ptree config;
+  config.put("interpolation_distance", 10.f);
+  config.put("sigma_z", 4.f);
+  assert(dynamic_cast<DistanceSimplifier*>(create_trace_simplifier(config).get()));
+
+  config.put("simplification", "douglas_peucker");
+  const auto simplifier = create_trace_simplifier(config);
+  assert(dynamic_cast<DouglasPeuckerSimplifier*>(simplifier.get()));
+  // Locations closer than the interpolation distance are never
+  // matched, so the corner is matched by the locations around it
+  const auto indexes = simplifier->Simplify(MakeTurn(100, 100));
+  assert(indexes.size() <= 4 && indexes.front() == 0 && indexes.back() == 199);
+
+  config.put("simplification", "none");
+  bool thrown = false;
+  try {
+    create_trace_simplifier(config);
+  } catch (const std::invalid_argument&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+
+// A simplifier that breaks the contract as told
+class FixedSimplifier: public TraceSimplifier
+{
+ public:
+  explicit FixedSimplifier(const std::vector<size_t>& indexes)
+      : indexes_(indexes) {}
+
+  std::vector<size_t>
+  Simplify(const std::vector<midgard::PointLL>& locations) const override
+  { return indexes_; }
+
+ private:
+  std::vector<size_t> indexes_;
+};
+
+
+void TestSimplifyTrace()
+{
+  const auto trace = MakeTurn(5, 0);
+  assert((simplify_trace(FixedSimplifier({0, 2, 4}), trace) == std::vector<size_t>{0, 2, 4}));
+  assert(simplify_trace(FixedSimplifier({}), {}).empty());
+  assert(simplify_trace(DistanceSimplifier(10.f), trace).size() == 2);
+
+  const std::vector<std::vector<size_t>> broken{
+    {},
+    // Without the first or the last location
+    {1, 4}, {0, 3}, {0, 2, 5},
+    // Out of order, or duplicates
+    {0, 3, 2, 4}, {0, 2, 2, 4}};
+  for (const auto& indexes : broken) {
+    bool thrown = false;
+    try {
+      simplify_trace(FixedSimplifier(indexes), trace);
+    } catch (const std::logic_error&) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  bool thrown = false;
+  try {
+    simplify_trace(FixedSimplifier({0}), {});
+  } catch (const std::logic_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+
+int main(int argc, char *argv[])
+{
+  TestDistanceSimplifier();
+
+  TestDouglasPeuckerSimplifier();
+
+  TestCreateTraceSimplifier();
+
+  TestSimplifyTrace();
+
+  std::cout << "all tests passed" << std::endl;
+
+  return 0;
+}
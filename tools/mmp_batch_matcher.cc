@@ -0,0 +1,268 @@
+// -*- mode: c++ -*-
+
+// Match newline-delimited GeoJSON traces (a Feature or a Geometry per
+// line, as the service accepts) on worker threads, and write a
+// GeoJSON Feature per trace in the input order. A trace that fails
+// is written as a Feature of null geometry with the error message in
+// its properties. Traces are submitted to the workers as they are
+// read, and written as soon as all traces before them are done, with
+// at most WINDOW traces in flight whatever the input size
+//
+// If the input is a binary trace file instead (see binary_format.h),
+// the output is a binary result file of a record per trace. A record
+// that is truncated or corrupt stops the input, since the following
+// ones can't be found: the traces before it are still written, and
+// it exits with 3 (as it does if the file header is invalid)
+//
+// usage: mmp_batch_matcher CONFIG [INPUT [THREADS [WINDOW]]]
+//
+// INPUT is "-" (the default) for the standard input. THREADS is 0
+// (the default) for one per hardware thread, and WINDOW defaults to
+// 64 traces per thread
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+
+#include "mmp/map_matching.h"
+#include "mmp/binary_format.h"
+#include "mmp/geojson.h"
+
+using namespace valhalla;
+
+
+// A trace read and the output it's written as
+struct Pending
+{
+  std::vector<mmp::Measurement> trace;
+
+  std::string output;
+
+  // Valid if the trace is submitted; otherwise the output is the
+  // error of parsing it
+  std::future<void> matched;
+};
+
+
+std::string ErrorFeature(const std::string& message, bool binary)
+{
+  if (binary) {
+    std::string out;
+    mmp::AppendBinaryError(out, message);
+    return out;
+  }
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartObject();
+  writer.String("type");
+  writer.String("Feature");
+  writer.String("geometry");
+  writer.Null();
+  writer.String("properties");
+  writer.StartObject();
+  writer.String("error");
+  writer.String(message.c_str());
+  writer.EndObject();
+  writer.EndObject();
+  return sb.GetString();
+}
+
+
+std::string ResultFeature(const std::vector<mmp::MatchResult>& results, mmp::MapMatcher& matcher, bool binary)
+{
+  if (binary) {
+    std::string out;
+    mmp::AppendBinaryResults(out, results, &matcher.mapmatching());
+    return out;
+  }
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  mmp::serialize_results_as_feature(results, matcher.mapmatching(), writer,
+                                    matcher.config().get<bool>("route"), false);
+  return sb.GetString();
+}
+
+
+// Read the next trace, skipping empty lines. A line that fails to
+// parse gets its error as the output. Unlike lines, a binary record
+// that fails to read throws since the following ones can't be found.
+// Return false at the end of the input
+bool ReadTrace(std::istream& input, bool binary, Pending& pending)
+{
+  if (binary) {
+    std::string buffer;
+    return mmp::ReadBinaryTrace(input, buffer, pending.trace);
+  }
+
+  std::string line;
+  while (std::getline(input, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    try {
+      rapidjson::Document json;
+      mmp::parse_json(json, line.c_str());
+      pending.trace = mmp::read_geojson(json);
+    } catch (const mmp::SequenceParseError& ex) {
+      pending.output = ErrorFeature(ex.what(), false);
+    }
+    return true;
+  }
+  return false;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    std::cerr << "usage: mmp_batch_matcher CONFIG [INPUT [THREADS [WINDOW]]]" << std::endl;
+    return 1;
+  }
+
+  boost::property_tree::ptree config;
+  boost::property_tree::read_json(argv[1], config);
+
+  std::ifstream file;
+  const std::string input_path = argc > 2? argv[2] : "-";
+  if (input_path != "-") {
+    file.open(input_path, std::ios::binary);
+    if (!file) {
+      std::cerr << "Unable to open " << input_path << std::endl;
+      return 1;
+    }
+  }
+  auto& input = input_path == "-"? std::cin : file;
+
+  mmp::BatchOptions options;
+  options.preferences.put("mode", config.get<std::string>("mm.mode"));
+  options.thread_count = argc > 3? std::atoi(argv[3]) : 0;
+  if (!options.thread_count) {
+    options.thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  const size_t window_size = argc > 4? std::atoi(argv[4]) : 64 * options.thread_count;
+  if (!window_size) {
+    std::cerr << "Expect a positive window size" << std::endl;
+    return 1;
+  }
+
+  // GeoJSON lines never start with the magic
+  const bool binary = input.peek() == mmp::kBinaryTraceMagic[0];
+  if (binary) {
+    char header[sizeof(mmp::BinaryFileHeader)];
+    input.read(header, sizeof(header));
+    try {
+      mmp::ReadBinaryHeader(header, input.gcount(), mmp::kBinaryTraceMagic);
+    } catch (const std::exception& ex) {
+      std::cerr << "Invalid binary trace file: " << ex.what() << std::endl;
+      return 3;
+    }
+  }
+
+  mmp::MapMatcherFactory factory(config);
+
+  std::ios::sync_with_stdio(false);
+  const auto start = std::chrono::steady_clock::now();
+  size_t trace_count = 0, error_count = 0;
+
+  if (binary) {
+    std::string header;
+    mmp::AppendBinaryHeader(header, mmp::kBinaryResultMagic);
+    std::cout.write(header.data(), header.size());
+  }
+
+  // Write the oldest trace once it's done
+  std::deque<std::unique_ptr<Pending>> window;
+  const auto write_front = [&]() {
+    auto& pending = *window.front();
+    if (pending.matched.valid()) {
+      try {
+        pending.matched.get();
+      } catch (const std::exception& ex) {
+        pending.output = ErrorFeature(ex.what(), binary);
+        error_count++;
+      } catch (...) {
+        pending.output = ErrorFeature("Unknown error", binary);
+        error_count++;
+      }
+    } else {
+      error_count++;
+    }
+    std::cout.write(pending.output.data(), pending.output.size());
+    if (!binary) {
+      std::cout << '\n';
+    }
+    trace_count++;
+    window.pop_front();
+  };
+  const auto done = [](const Pending& pending) {
+    return !pending.matched.valid()
+        || pending.matched.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  };
+
+  bool corrupt = false;
+  {
+    auto batch = factory.OpenBatch(options);
+    while (true) {
+      std::unique_ptr<Pending> pending(new Pending);
+      try {
+        if (!ReadTrace(input, binary, *pending)) {
+          break;
+        }
+      } catch (const std::exception& ex) {
+        std::cerr << "Truncated or corrupt record after " << trace_count + window.size()
+                  << " traces: " << ex.what() << std::endl;
+        corrupt = true;
+        break;
+      }
+
+      if (pending->output.empty()) {
+        auto& output = pending->output;
+        pending->matched = batch->Submit(pending->trace, [&output, binary](mmp::MapMatcher& matcher, std::vector<mmp::MatchResult>& results) {
+            output = ResultFeature(results, matcher, binary);
+          });
+      }
+      window.push_back(std::move(pending));
+
+      // Wait for the oldest one only if the window is full
+      while (!window.empty() && (window.size() > window_size || done(*window.front()))) {
+        write_front();
+      }
+    }
+
+    while (!window.empty()) {
+      write_front();
+    }
+  }
+  std::cout.flush();
+
+  const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cerr << trace_count << " traces (" << error_count << " failed) in " << seconds << " s"
+            << " on " << options.thread_count << " threads: "
+            << static_cast<size_t>(trace_count / std::max(seconds, 1e-9)) << " traces/s" << std::endl;
+
+  if (corrupt) {
+    return 3;
+  }
+  return error_count? 2 : 0;
+}
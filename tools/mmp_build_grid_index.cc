@@ -0,0 +1,70 @@
+// -*- mode: c++ -*-
+
+// Build the grid index of all local tiles for the configured tile set
+//
+// usage: mmp_build_grid_index CONFIG OUTPUT
+
+#include <cstdlib>
+#include <iostream>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <valhalla/baldr/graphreader.h>
+
+#include "mmp/candidate_search.h"
+#include "mmp/grid_index.h"
+#include "mmp/map_matching.h"
+
+using namespace valhalla;
+
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    std::cout << "usage: mmp_build_grid_index CONFIG OUTPUT" << std::endl;
+    return 1;
+  }
+
+  boost::property_tree::ptree config;
+  boost::property_tree::read_json(argv[1], config);
+
+  baldr::GraphReader graphreader(config.get_child("mjolnir"));
+  const auto& hierarchy = graphreader.GetTileHierarchy();
+  // Same as what the matcher factory computes
+  const float cell_size = mmp::local_tile_size(graphreader) / config.get<size_t>("grid.size");
+  const float cell_items = config.get<float>("grid.cell_items", 0.f);
+
+  // Grids are only queried on the local level
+  const auto& local_level = hierarchy.levels().rbegin()->second;
+  const auto tile_count = local_level.tiles.TileCount();
+
+  mmp::GridIndexWriter writer(argv[2], cell_size, cell_size, cell_items);
+  size_t item_count = 0;
+  for (int32_t id = 0; id < tile_count; id++) {
+    const baldr::GraphId tile_id(id, local_level.level, 0);
+    if (!graphreader.DoesTileExist(tile_id)) {
+      continue;
+    }
+
+    const auto tile = graphreader.GetGraphTile(tile_id);
+    if (!tile) {
+      continue;
+    }
+
+    const auto grid = mmp::BuildTileGrid(*tile, tile->BoundingBox(hierarchy),
+                                         cell_size, cell_size, cell_items);
+    writer.Write(tile->id(), tile->header()->directededgecount(), grid);
+    item_count += grid.size();
+
+    if (graphreader.OverCommitted()) {
+      graphreader.Clear();
+    }
+  }
+  writer.Close();
+
+  std::cout << "Indexed " << writer.size() << " tiles"
+            << " (" << item_count << " cell items) into " << argv[2] << std::endl;
+
+  return 0;
+}
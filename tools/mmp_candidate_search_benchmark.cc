@@ -0,0 +1,193 @@
+// -*- mode: c++ -*-
+
+// Measure candidate search throughput at random locations in a
+// bounding box, with the grid settings of the configuration, and the
+// query latencies in the tiles of more edges (the denser half of the
+// queries) and of fewer edges. Check the recall of the grid search
+// against the exhaustive search (CandidateQuery) on a sample of the
+// locations. Then compare searching a random walk trace location by
+// location with searching it in bulk
+//
+// usage: mmp_candidate_search_benchmark CONFIG MINLNG MINLAT MAXLNG MAXLAT [RADIUS [COUNT]]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "mmp/map_matching.h"
+
+using namespace valhalla;
+
+
+// Whether both candidates correlate a same edge or snap to a same
+// node (of which only one candidate is kept)
+bool SameCandidate(const mmp::Candidate& lhs, const mmp::Candidate& rhs)
+{
+  for (const auto& edge : lhs.edges()) {
+    for (const auto& other : rhs.edges()) {
+      if (edge.id == other.id) {
+        return true;
+      }
+    }
+  }
+  return lhs.vertex().Distance(rhs.vertex()) < 0.1f;
+}
+
+
+// Latencies of (tile edge count, microseconds) queries
+void PrintLatencies(const std::string& name,
+                    std::vector<std::pair<uint32_t, double>>::iterator begin,
+                    std::vector<std::pair<uint32_t, double>>::iterator end)
+{
+  if (begin == end) {
+    return;
+  }
+
+  std::vector<double> latencies;
+  uint32_t min_edge_count = begin->first, max_edge_count = begin->first;
+  for (auto it = begin; it != end; it++) {
+    min_edge_count = std::min(min_edge_count, it->first);
+    max_edge_count = std::max(max_edge_count, it->first);
+    latencies.push_back(it->second);
+  }
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&latencies](double p) {
+    return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+  };
+
+  std::cout << name << " tiles (" << min_edge_count << " to " << max_edge_count << " edges, "
+            << latencies.size() << " queries): "
+            << "p50 " << percentile(0.5) << " us, "
+            << "p90 " << percentile(0.9) << " us, "
+            << "p99 " << percentile(0.99) << " us, "
+            << "max " << latencies.back() << " us" << std::endl;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc < 6) {
+    std::cout << "usage: mmp_candidate_search_benchmark CONFIG MINLNG MINLAT MAXLNG MAXLAT [RADIUS [COUNT]]" << std::endl;
+    return 1;
+  }
+
+  boost::property_tree::ptree config;
+  boost::property_tree::read_json(argv[1], config);
+  const float minlng = std::atof(argv[2]), minlat = std::atof(argv[3]),
+              maxlng = std::atof(argv[4]), maxlat = std::atof(argv[5]);
+  const float radius = argc > 6? std::atof(argv[6]) : 40.f;
+  const size_t count = argc > 7? std::atoi(argv[7]) : 100000;
+
+  mmp::MapMatcherFactory factory(config);
+  auto& rangequery = factory.rangequery();
+
+  std::mt19937 generator(2016);
+  std::uniform_real_distribution<float> lng(minlng, maxlng), lat(minlat, maxlat);
+  std::vector<midgard::PointLL> locations;
+  locations.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    locations.emplace_back(lng(generator), lat(generator));
+  }
+
+  // Index the tiles before timing
+  for (const auto& location : locations) {
+    rangequery.Query(location, radius * radius, nullptr);
+  }
+
+  // Time each query too, along with the edge count of its tile
+  std::vector<std::pair<uint32_t, double>> latencies;
+  latencies.reserve(count);
+  for (const auto& location : locations) {
+    const auto tile = factory.graphreader().GetGraphTile(location);
+    latencies.emplace_back(tile? tile->header()->directededgecount() : 0, 0.0);
+  }
+
+  size_t candidate_count = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t idx = 0; idx < count; idx++) {
+    const auto query_start = std::chrono::steady_clock::now();
+    candidate_count += rangequery.Query(locations[idx], radius * radius, nullptr).size();
+    latencies[idx].second = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - query_start).count();
+  }
+  const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::sort(latencies.begin(), latencies.end());
+
+  // The exhaustive search is much slower so check a sample only
+  const size_t sample_count = std::min<size_t>(count, 1000);
+  const mmp::CandidateQuery exhaustive_query(factory.graphreader());
+  std::vector<std::vector<mmp::Candidate>> expected_candidates;
+  expected_candidates.reserve(sample_count);
+  const auto exhaustive_start = std::chrono::steady_clock::now();
+  for (size_t idx = 0; idx < sample_count; idx++) {
+    expected_candidates.push_back(exhaustive_query.Query(locations[idx], radius * radius, nullptr));
+  }
+  const auto exhaustive_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - exhaustive_start).count();
+
+  size_t expected_count = 0, found_count = 0;
+  for (size_t idx = 0; idx < sample_count; idx++) {
+    const auto found = rangequery.Query(locations[idx], radius * radius, nullptr);
+    for (const auto& expected : expected_candidates[idx]) {
+      expected_count++;
+      found_count += std::any_of(found.begin(), found.end(), [&expected](const mmp::Candidate& candidate) {
+          return SameCandidate(expected, candidate);
+        });
+    }
+  }
+
+  // A trace of about 10 meters between measurements from the center
+  std::uniform_real_distribution<float> step(-0.0001f, 0.0001f);
+  std::vector<midgard::PointLL> trace{{(minlng + maxlng) / 2, (minlat + maxlat) / 2}};
+  trace.reserve(count);
+  while (trace.size() < count) {
+    const auto& last = trace.back();
+    trace.emplace_back(std::min(std::max(last.lng() + step(generator), minlng), maxlng),
+                       std::min(std::max(last.lat() + step(generator), minlat), maxlat));
+  }
+
+  auto trace_start = std::chrono::steady_clock::now();
+  size_t trace_candidate_count = 0;
+  for (const auto& location : trace) {
+    trace_candidate_count += rangequery.Query(location, radius * radius, nullptr).size();
+  }
+  const auto trace_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - trace_start).count();
+
+  mmp::BulkCandidates bulk_candidates;
+  trace_start = std::chrono::steady_clock::now();
+  rangequery.QueryBulk(trace, radius * radius, nullptr, bulk_candidates);
+  const auto bulk_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - trace_start).count();
+  if (bulk_candidates.candidates.size() != trace_candidate_count) {
+    std::cerr << "Bulk search found " << bulk_candidates.candidates.size()
+              << " candidates but " << trace_candidate_count << " expected" << std::endl;
+    return 2;
+  }
+
+  const auto& stats = factory.grid_cache_stats();
+  std::cout << "queries: " << count << ", radius: " << radius << " meters" << std::endl;
+  std::cout << "throughput: " << static_cast<size_t>(count / seconds) << " queries/s"
+            << " (" << seconds * 1e6 / count << " us per query)" << std::endl;
+  std::cout << "candidates per query: " << static_cast<double>(candidate_count) / count << std::endl;
+  PrintLatencies("sparse", latencies.begin(), latencies.begin() + count / 2);
+  PrintLatencies("dense", latencies.begin() + count / 2, latencies.end());
+  std::cout << "exhaustive search: " << exhaustive_seconds * 1e6 / std::max<size_t>(sample_count, 1) << " us per query,"
+            << " recall of the grid search: " << found_count << "/" << expected_count
+            << " candidates of " << sample_count << " queries" << std::endl;
+  std::cout << "trace of " << count << " locations: "
+            << trace_seconds * 1e3 << " ms one by one, "
+            << bulk_seconds * 1e3 << " ms in bulk" << std::endl;
+  std::cout << "grid cache: " << stats.hits << " hits, "
+            << stats.misses << " misses, "
+            << stats.evictions << " evictions" << std::endl;
+  const auto& shape_stats = factory.shape_cache_stats();
+  std::cout << "shape cache: " << shape_stats.decodes << " decodes, "
+            << shape_stats.hits << " hits" << std::endl;
+
+  return 0;
+}
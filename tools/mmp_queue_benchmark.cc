@@ -0,0 +1,150 @@
+// -*- mode: c++ -*-
+
+// Compare the routing queues on a synthetic label-setting workload
+// across breakage distances, reporting throughput and peak memory.
+// With destinations, some labels are added below the last popped cost
+// as destination labels are (they are added without heuristics)
+
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <ctime>
+#include <new>
+#include <vector>
+#include <iostream>
+
+#include <valhalla/midgard/util.h>
+
+#include "mmp/routing.h"
+
+using namespace valhalla;
+
+
+namespace {
+
+// Bytes allocated on the heap, tracked by the operators below
+size_t g_allocated = 0, g_peak = 0;
+
+}
+
+
+void* operator new(size_t size)
+{
+  auto p = static_cast<size_t*>(std::malloc(size + sizeof(size_t)));
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  *p = size;
+  g_allocated += size;
+  if (g_peak < g_allocated) {
+    g_peak = g_allocated;
+  }
+  return p + 1;
+}
+
+
+void operator delete(void* ptr) noexcept
+{
+  if (ptr) {
+    auto p = static_cast<size_t*>(ptr) - 1;
+    g_allocated -= *p;
+    std::free(p);
+  }
+}
+
+
+constexpr uint32_t kInvalidKey = std::numeric_limits<uint32_t>::max();
+
+
+// Expand like a route search: every settled label adds two
+// successors and tries to decrease the cost of a recently added one,
+// and every 16th one also adds a destination label below its own cost
+// if destinations are wanted. Labels beyond the breakage distance the
+// queue is built with are dropped by the queue itself
+template <typename queue_t>
+size_t Route(queue_t& queue, size_t max_settled, bool destinations)
+{
+  // Label costs indexed by keys
+  std::vector<float> costs;
+  std::vector<uint32_t> recent;
+  costs.push_back(0.f);
+  queue.add(0, 0.f);
+
+  size_t settled = 0;
+  while (!queue.empty() && settled < max_settled) {
+    const auto base = costs[queue.pop()];
+    settled++;
+
+    if (destinations && settled % 16 == 0) {
+      const uint32_t key = costs.size();
+      costs.push_back(std::max(base - rand01() * 50.f, 0.f));
+      queue.add(key, costs.back());
+    }
+
+    for (int i = 0; i < 2; i++) {
+      const uint32_t key = costs.size();
+      costs.push_back(base + 10.f + rand01() * 90.f);
+      if (queue.add(key, costs.back())) {
+        recent.push_back(key);
+      }
+    }
+
+    if (!recent.empty()) {
+      const auto key = recent[static_cast<size_t>(rand01() * recent.size()) % recent.size()];
+      const auto newcost = base + (costs[key] - base) * rand01();
+      if (queue.cost(key) >= 0.f && queue.decrease(key, newcost)) {
+        costs[key] = newcost;
+      }
+    }
+    if (recent.size() > 64) {
+      recent.erase(recent.begin(), recent.begin() + 32);
+    }
+  }
+
+  queue.clear();
+  return settled;
+}
+
+
+template <typename queue_t>
+void Benchmark(const char* name, float breakage_distance, size_t route_count, size_t max_settled, bool destinations)
+{
+  const auto allocated = g_allocated;
+  g_peak = g_allocated;
+
+  std::clock_t start = std::clock();
+  size_t settled = 0;
+  {
+    queue_t queue(std::ceil(breakage_distance));
+    for (size_t i = 0; i < route_count; i++) {
+      settled += Route(queue, max_settled, destinations);
+    }
+  }
+  const double ms = (std::clock() - start) / static_cast<double>(CLOCKS_PER_SEC / 1000);
+
+  std::cout << name
+            << "\t" << (destinations? "destinations" : "monotone")
+            << "\t" << breakage_distance
+            << "\t" << static_cast<size_t>(ms)
+            << "\t" << static_cast<size_t>(settled / (ms > 0? ms : 1.0))
+            << "\t" << (g_peak - allocated) / 1024 << std::endl;
+}
+
+
+int main(int argc, char *argv[])
+{
+  const size_t route_count = argc > 1? std::atoi(argv[1]) : 200,
+               max_settled = argc > 2? std::atoi(argv[2]) : 20000;
+
+  std::cout << "queue\tpattern\tbreakage_distance\tms\tsettled/ms\tpeak KiB" << std::endl;
+  for (bool destinations : {false, true}) {
+    for (float breakage_distance : {500.f, 2000.f, 5000.f, 20000.f, 100000.f}) {
+      Benchmark<mmp::BucketQueue<uint32_t, kInvalidKey>>("bucket", breakage_distance, route_count, max_settled, destinations);
+      Benchmark<mmp::RadixQueue<uint32_t, kInvalidKey>>("radix", breakage_distance, route_count, max_settled, destinations);
+    }
+  }
+
+  return 0;
+}
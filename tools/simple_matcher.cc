@@ -1,3 +1,5 @@
+#include <chrono>
+
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
@@ -29,7 +31,9 @@ int main(int argc, char *argv[])
 
       // Offline match
       std::cout << "Sequence " << index++ << std::endl;
+      const auto start = std::chrono::steady_clock::now();
       const auto& results = matcher->OfflineMatch(measurements);
+      const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
       // Show results
       size_t mmt_id = 0, count = 0;
@@ -45,7 +49,9 @@ int main(int argc, char *argv[])
       }
 
       // Summary
-      std::cout << count << "/" << measurements.size() << std::endl << std::endl;
+      std::cout << count << "/" << measurements.size() << std::endl;
+      std::cout << "States: " << matcher->mapmatching().size()
+                << " Latency: " << elapsed << " ms" << std::endl << std::endl;
 
       // Clean up
       measurements.clear();